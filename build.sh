@@ -1,3 +1,5 @@
 #!/bin/sh -xe
 
-cc -Wall -Wextra -std=c11 -pedantic -o meno src/main.c
+cc -Wall -Wextra -std=c11 -pedantic -pthread -o meno src/main.c
+cc -Wall -Wextra -std=c11 -pedantic -pthread -o tests/regex tests/regex.c
+./tests/regex
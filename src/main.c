@@ -1,21 +1,35 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdbool.h>
 
 #include <ctype.h>
+#include <time.h>
 #include <errno.h>
 #include <assert.h>
 
+#include <pwd.h>
+#include <poll.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <termios.h>
+#include <signal.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
 
 #include "sv.h"
+#include "regex.h"
 #include "syntax.h"
 
 #define INC_CAP 128
@@ -46,6 +60,17 @@ static inline Vector vector_sub(Vector a, Vector b)
     return (Vector) {.x = a.x - b.x, .y = a.y - b.y};
 }
 
+static inline bool vector_lt(Vector a, Vector b)
+{
+    return a.y < b.y || (a.y == b.y && a.x < b.x);
+}
+
+int vector_compare(const void *a, const void *b)
+{
+    const Vector *u = (const Vector *) a, *v = (const Vector *) b;
+    return vector_lt(*u, *v) ? -1 : vector_lt(*v, *u);
+}
+
 // Syntax
 typedef enum {
     SYNTAX_NORMAL,
@@ -151,11 +176,17 @@ static const Color color_syntaxes[] = {
 #define COLOR_VISUAL (Color) {.fg = -1, .bg = 239, .bold = -1}
 #define COLOR_PROMPT (Color) {.fg = 12, .bg = -1,  .bold = 1}
 #define COLOR_SEARCH (Color) {.fg = 0,  .bg = 15,  .bold = 0}
+#define COLOR_MATCH  (Color) {.fg = 15, .bg = 240, .bold = 0}
+#define COLOR_CURSOR (Color) {.fg = 0,  .bg = 7,   .bold = 0}
 #define COLOR_FAILED (Color) {.fg = 0,  .bg = 9,   .bold = 0}
 
 typedef struct {
     struct termios save;
     Vector size;
+
+    // Nothing is drawn while a macro is replayed, the screen is brought up
+    // to date once it is done
+    bool deferred;
 } Term;
 
 static Term term = {0};
@@ -198,21 +229,32 @@ void term_color_reset(void)
     fflush(stdout);
 }
 
-void term_color(Color color)
+#define COLOR_ESCAPE_MAX 64
+
+size_t color_format(char *escape, Color color)
 {
+    size_t size = 0;
     if (color.bold == 1) {
-        printf("\x1b[1m");
+        size += snprintf(escape + size, COLOR_ESCAPE_MAX - size, "\x1b[1m");
     } else if (color.bold == 0) {
-        printf("\x1b[22m");
+        size += snprintf(escape + size, COLOR_ESCAPE_MAX - size, "\x1b[22m");
     }
 
     if (color.bg != -1) {
-        printf("\x1b[48;5;%dm", color.bg);
+        size += snprintf(escape + size, COLOR_ESCAPE_MAX - size, "\x1b[48;5;%dm", color.bg);
     }
 
     if (color.fg != -1) {
-        printf("\x1b[38;5;%dm", color.fg);
+        size += snprintf(escape + size, COLOR_ESCAPE_MAX - size, "\x1b[38;5;%dm", color.fg);
     }
+
+    return size;
+}
+
+void term_color(Color color)
+{
+    char escape[COLOR_ESCAPE_MAX];
+    fwrite(escape, 1, color_format(escape, color), stdout);
 }
 
 // String
@@ -234,14 +276,41 @@ String string(const char *data, size_t size)
     return string;
 }
 
+// The contents of a shared string also belong to a snapshot being saved in
+// the background and are copied before they are first written to. Instead
+// of its capacity, the string holds its index in the snapshot, see Save.
+#define STRING_SHARED ((size_t) 1 << (sizeof(size_t) * 8 - 1))
+
+// The contents of a borrowed string live in a block of Chunks and are copied
+// the same way
+#define STRING_BORROWED ((size_t) 1 << (sizeof(size_t) * 8 - 2))
+
+void string_own(String *string)
+{
+    if (string->capacity & (STRING_SHARED | STRING_BORROWED)) {
+        char *data = string->data;
+        string->data = NULL;
+        string->capacity = 0;
+        if (string->size) {
+            string->data = malloc(string->size);
+            assert(string->data);
+            memcpy(string->data, data, string->size);
+            string->capacity = string->size;
+        }
+    }
+}
+
 void string_free(String *string)
 {
-    free(string->data);
+    if (!(string->capacity & (STRING_SHARED | STRING_BORROWED))) {
+        free(string->data);
+    }
     memset(string, 0, sizeof(String));
 }
 
 void string_grow(String *string, size_t size)
 {
+    string_own(string);
     string->capacity = MAX(string->capacity + INC_CAP, size);
     string->data = realloc(string->data, string->capacity);
     assert(string->data);
@@ -249,6 +318,7 @@ void string_grow(String *string, size_t size)
 
 void string_insert(String *string, size_t index, const char *data, size_t size)
 {
+    string_own(string);
     if (string->size + size > string->capacity) {
         string_grow(string, string->size + size);
     }
@@ -258,18 +328,56 @@ void string_insert(String *string, size_t index, const char *data, size_t size)
     string->size += size;
 }
 
+// Append COUNT spaces to STRING
+void string_pad(String *string, size_t count)
+{
+    if (!count) {
+        return;
+    }
+    string_own(string);
+    if (string->size + count > string->capacity) {
+        string_grow(string, string->size + count);
+    }
+    memset(string->data + string->size, ' ', count);
+    string->size += count;
+}
+
 void string_replace(String *string, size_t index, size_t size, String with)
 {
-    if (with.size > size) {
-        string_grow(string, with.size - size);
+    string_own(string);
+    const size_t result = string->size - size + with.size;
+    if (result > string->capacity) {
+        string_grow(string, result);
     }
 
     memmove(string->data + index + with.size, string->data + index + size, string->size - index - size);
     memcpy(string->data + index, with.data, with.size);
+    string->size = result;
+}
 
-    if (with.size > size) {
-        string->size += with.size - size;
+void string_vprintf(String *string, const char *format, va_list ap)
+{
+    string_own(string);
+    va_list copy;
+    va_copy(copy, ap);
+    const int size = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    assert(size >= 0);
+
+    if (string->size + size + 1 > string->capacity) {
+        string_grow(string, string->size + size + 1);
     }
+
+    vsnprintf(string->data + string->size, size + 1, format, ap);
+    string->size += size;
+}
+
+void string_printf(String *string, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    string_vprintf(string, format, ap);
+    va_end(ap);
 }
 
 bool memieq(const char *a, const char *b, size_t size)
@@ -283,24 +391,70 @@ bool memieq(const char *a, const char *b, size_t size)
     return true;
 }
 
-bool string_search_forward(String string, String query, size_t *position)
+// Find the first occurrence of NEEDLE in DATA, ignoring case. The first
+// character of the needle is looked for eight bytes at a time, using the
+// usual bit trick to tell whether a word contains a zero byte, and only the
+// words where it may appear are compared byte by byte.
+const char *memifind(const char *data, size_t size, const char *needle, size_t count)
 {
-    if (string.size >= query.size) {
-        for (size_t i = *position; i <= string.size - query.size; ++i) {
-            if (memieq(string.data + i, query.data, query.size)) {
-                *position = i;
-                return true;
+    if (count > size) {
+        return NULL;
+    }
+
+    const uint64_t ones = 0x0101010101010101ull;
+    const unsigned char first = tolower((unsigned char) *needle);
+    const uint64_t fold = isalpha(first) ? ones * 0x20 : 0;
+    const uint64_t target = ones * first;
+    const size_t end = size - count + 1;
+
+    size_t i = 0;
+    for (; i + 8 <= end; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        word = (word | fold) ^ target;
+        if (!((word - ones) & ~word & (ones * 0x80))) {
+            continue;
+        }
+
+        for (size_t j = i; j < i + 8; ++j) {
+            if (memieq(data + j, needle, count)) {
+                return data + j;
             }
         }
     }
 
-    return false;
+    for (; i < end; ++i) {
+        if (memieq(data + i, needle, count)) {
+            return data + i;
+        }
+    }
+
+    return NULL;
+}
+
+bool string_search_forward(String string, String query, size_t *position)
+{
+    if (*position > string.size) {
+        return false;
+    }
+
+    if (!query.size) {
+        return true;
+    }
+
+    const char *found = memifind(string.data + *position, string.size - *position, query.data, query.size);
+    if (!found) {
+        return false;
+    }
+
+    *position = found - string.data;
+    return true;
 }
 
 bool string_search_backward(String string, String query, size_t *position)
 {
     if (string.size >= query.size) {
-        for (size_t i = *position + 1; i > 0; --i) {
+        for (size_t i = MIN(*position, string.size - query.size) + 1; i > 0; --i) {
             if (memieq(string.data + i - 1, query.data, query.size)) {
                 *position = i - 1;
                 return true;
@@ -311,876 +465,7904 @@ bool string_search_backward(String string, String query, size_t *position)
     return false;
 }
 
-// Buffer
+static uint64_t clock_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Pool
+typedef void (*Task)(void *arg);
+
 typedef struct {
-    String *lines;
+    Task task;
+    void *arg;
+    size_t *pending;
+} Job;
+
+typedef struct {
+    pthread_t *threads;
     size_t count;
-    size_t capacity;
 
-    bool region;
-    Vector cursor;
-    Vector marker;
+    Job *jobs;
+    size_t head;
+    size_t tail;
+    size_t capacity;
 
-    String path;
-    Vector anchor;
-    size_t syntax;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+} Pool;
 
-    bool modified;
-} Buffer;
+static Pool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
 
-void buffer_free(Buffer *buffer)
+void *pool_worker(void *arg)
 {
-    for (size_t i = 0; i < buffer->count; ++i) {
-        string_free(buffer->lines + i);
+    (void) arg;
+
+    pthread_mutex_lock(&pool.lock);
+    while (true) {
+        while (pool.head == pool.tail) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+
+        const Job job = pool.jobs[pool.head++];
+        if (pool.head == pool.tail) {
+            pool.head = pool.tail = 0;
+        }
+
+        pthread_mutex_unlock(&pool.lock);
+        job.task(job.arg);
+        pthread_mutex_lock(&pool.lock);
+
+        if (job.pending && --*job.pending == 0) {
+            pthread_cond_broadcast(&pool.done);
+        }
     }
-    free(buffer->lines);
-    memset(buffer, 0, sizeof(Buffer));
+
+    return NULL;
 }
 
-void buffer_grow(Buffer *buffer, size_t size)
+size_t pool_size(void)
 {
-    if (size >= buffer->capacity) {
-        buffer->capacity = MAX(buffer->capacity + INC_CAP, size);
-        buffer->lines = realloc(buffer->lines, buffer->capacity * sizeof(String));
-        assert(buffer->lines);
+    if (!pool.count) {
+        const long count = sysconf(_SC_NPROCESSORS_ONLN);
+        pool.count = MAX(count, 1);
+        pool.threads = malloc(pool.count * sizeof(pthread_t));
+        assert(pool.threads);
+
+        for (size_t i = 0; i < pool.count; ++i) {
+            assert(pthread_create(pool.threads + i, NULL, pool_worker, NULL) == 0);
+        }
     }
-}
 
-void buffer_push(Buffer *buffer, String line)
-{
-    buffer_grow(buffer, buffer->count + 1);
-    buffer->lines[buffer->count++] = line;
+    return pool.count;
 }
 
-void buffer_open(Buffer *buffer)
+// Run TASK on a worker thread. If PENDING is not NULL, it is incremented
+// now and decremented once the task is done, see pool_wait().
+void pool_submit(Task task, void *arg, size_t *pending)
 {
-    String path = buffer->path;
-    buffer_free(buffer);
-    buffer->path = path;
+    pool_size();
+    pthread_mutex_lock(&pool.lock);
 
-    const int fd = open(buffer->path.data, O_RDONLY);
-    if (fd == -1) {
-        return;
+    if (pool.tail == pool.capacity) {
+        pool.capacity += INC_CAP;
+        pool.jobs = realloc(pool.jobs, pool.capacity * sizeof(Job));
+        assert(pool.jobs);
     }
 
-    struct stat statbuf;
-    if (fstat(fd, &statbuf) == -1) {
-        close(fd);
-        return;
+    pool.jobs[pool.tail++] = (Job) {.task = task, .arg = arg, .pending = pending};
+    if (pending) {
+        (*pending)++;
     }
 
-    SV contents = {0};
-    contents.size = statbuf.st_size;
+    pthread_cond_signal(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+}
 
-    contents.data = mmap(NULL, contents.size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
+// Wait for all the tasks submitted with PENDING to finish.
+void pool_wait(size_t *pending)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (*pending) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
 
-    if (contents.data == MAP_FAILED) {
-        return;
+// Events
+typedef struct {
+    Task task;
+    void *arg;
+} Event;
+
+typedef struct {
+    int fd;
+    Task task;
+    void *arg;
+} Watch;
+
+// Tasks posted from worker threads to be run on the main thread, which is
+// woken up by a byte written to the pipe. The main thread also runs a task
+// whenever one of the watched file descriptors is ready.
+typedef struct {
+    Event *items;
+    size_t count;
+    size_t capacity;
+
+    pthread_mutex_t lock;
+    int wake[2];
+
+    Watch *watches;
+    size_t watches_count;
+    size_t watches_capacity;
+} Events;
+
+static Events events = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = {-1, -1},
+};
+
+void events_init(void)
+{
+    assert(pipe(events.wake) == 0);
+    for (size_t i = 0; i < 2; ++i) {
+        fcntl(events.wake[i], F_SETFL, fcntl(events.wake[i], F_GETFL) | O_NONBLOCK);
+        fcntl(events.wake[i], F_SETFD, FD_CLOEXEC);
     }
+}
 
-    char *head = (char *) contents.data;
-    while (contents.size) {
-        const SV line = sv_split(&contents, '\n');
-        buffer_push(buffer, string(line.data, line.size));
+// Run TASK on the main thread the next time it waits for input
+void events_post(Task task, void *arg)
+{
+    pthread_mutex_lock(&events.lock);
+    if (events.count == events.capacity) {
+        events.capacity += INC_CAP;
+        events.items = realloc(events.items, events.capacity * sizeof(Event));
+        assert(events.items);
     }
+    events.items[events.count++] = (Event) {.task = task, .arg = arg};
+    pthread_mutex_unlock(&events.lock);
 
-    munmap(head, statbuf.st_size);
+    // If the pipe is full the main thread is already due to wake up
+    const char byte = 0;
+    if (write(events.wake[1], &byte, 1) < 0) {
+        assert(errno == EAGAIN);
+    }
 }
 
-void buffer_detect_syntax(Buffer *buffer)
+// Run TASK on the main thread whenever FD is ready for reading
+void events_watch(int fd, Task task, void *arg)
 {
-    SV path = sv_rtrim(sv(buffer->path.data, buffer->path.size), '\0');
-    for (size_t i = 1; i < syntaxes_count; ++i) {
-        if (sv_list_find(syntaxes[i].filenames, path)) {
-            buffer->syntax = i;
-            return;
-        }
+    if (events.watches_count == events.watches_capacity) {
+        events.watches_capacity += INC_CAP;
+        events.watches = realloc(events.watches, events.watches_capacity * sizeof(Watch));
+        assert(events.watches);
     }
+    events.watches[events.watches_count++] = (Watch) {.fd = fd, .task = task, .arg = arg};
+}
 
-    sv_split(&path, '.');
-    for (size_t i = 1; i < syntaxes_count; ++i) {
-        if (sv_list_find(syntaxes[i].extensions, path)) {
-            buffer->syntax = i;
+void events_unwatch(int fd)
+{
+    for (size_t i = 0; i < events.watches_count; ++i) {
+        if (events.watches[i].fd == fd) {
+            events.watches[i] = events.watches[--events.watches_count];
             return;
         }
     }
-
-    buffer->syntax = 0;
 }
 
-bool buffer_save(Buffer *buffer)
+// Run the posted tasks in the order they were posted
+void events_run(void)
 {
-    if (buffer->modified) {
-        FILE *output = fopen(buffer->path.data, "w");
-        if (!output) {
-            return false;
-        }
+    char drain[64];
+    while (read(events.wake[0], drain, sizeof(drain)) > 0);
+
+    pthread_mutex_lock(&events.lock);
+    Event *items = events.items;
+    const size_t count = events.count;
+    events.items = NULL;
+    events.count = events.capacity = 0;
+    pthread_mutex_unlock(&events.lock);
+
+    for (size_t i = 0; i < count; ++i) {
+        items[i].task(items[i].arg);
+    }
+    free(items);
+}
 
-        for (size_t i = 0; i < buffer->count; ++i) {
-            const String line = buffer->lines[i];
-            fprintf(output, "%.*s\n", (int) line.size, line.data);
-        }
+// Pattern
+typedef struct {
+    String source;
+    bool regex;
+    Regex compiled;
+    RegexMatch match;
+} Pattern;
 
-        fclose(output);
-        buffer->modified = false;
+void pattern_free(Pattern *pattern)
+{
+    string_free(&pattern->source);
+    if (pattern->regex) {
+        regex_free(&pattern->compiled);
     }
+    memset(pattern, 0, sizeof(Pattern));
+}
+
+bool pattern_compile(Pattern *pattern, String source, bool regex)
+{
+    pattern_free(pattern);
+    pattern->source = string(source.data, source.size);
+    pattern->regex = regex;
 
+    if (regex) {
+        return regex_compile(&pattern->compiled, source.data, source.size, true);
+    }
     return true;
 }
 
-void buffer_anchor_fix(Buffer *buffer)
+// Whether SOURCE has any of the characters with a special meaning in a regex
+bool pattern_special(String source)
 {
-    const Vector limit = vector_add(buffer->anchor, term.size);
+    for (size_t i = 0; i < source.size; ++i) {
+        if (strchr(".[]()*+?^$|\\", source.data[i])) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    if (buffer->cursor.y >= limit.y) {
-        buffer->anchor.y += buffer->cursor.y - limit.y + 1;
-    } else if (buffer->cursor.y < buffer->anchor.y) {
-        buffer->anchor.y -= buffer->anchor.y - buffer->cursor.y;
+size_t pattern_size(Pattern *pattern)
+{
+    return pattern->match.groups[1] - pattern->match.groups[0];
+}
+
+static void pattern_literal_match(Pattern *pattern, size_t position)
+{
+    for (size_t i = 0; i < REGEX_GROUPS * 2; ++i) {
+        pattern->match.groups[i] = REGEX_UNSET;
     }
+    pattern->match.groups[0] = position;
+    pattern->match.groups[1] = position + pattern->source.size;
+}
 
-    if (buffer->cursor.x >= limit.x) {
-        buffer->anchor.x += buffer->cursor.x - limit.x + 1;
-    } else if (buffer->cursor.x < buffer->anchor.x) {
-        buffer->anchor.x -= buffer->anchor.x - buffer->cursor.x;
+bool pattern_search_forward(Pattern *pattern, String string, size_t *position)
+{
+    if (pattern->regex) {
+        return regex_search_forward(&pattern->compiled, string.data, string.size, position, &pattern->match);
+    }
+
+    if (string_search_forward(string, pattern->source, position)) {
+        pattern_literal_match(pattern, *position);
+        return true;
     }
+    return false;
 }
 
-void buffer_insert(Buffer *buffer, char ch)
+bool pattern_search_backward(Pattern *pattern, String string, size_t *position)
 {
-    buffer->modified = true;
-    buffer_grow(buffer, buffer->count + 1);
+    if (pattern->regex) {
+        return regex_search_backward(&pattern->compiled, string.data, string.size, position, &pattern->match);
+    }
 
-    if (buffer->count == 0) {
-        memset(buffer->lines, 0, sizeof(String));
-        buffer->count = 1;
+    if (string_search_backward(string, pattern->source, position)) {
+        pattern_literal_match(pattern, *position);
+        return true;
     }
+    return false;
+}
 
-    if (isprint(ch)) {
-        string_insert(buffer->lines + buffer->cursor.y, buffer->cursor.x++, &ch, 1);
-    } else if (ch == '\r') {
-        String *prev = buffer->lines + buffer->cursor.y;
+// Expand the replacement WITH for the last match of PATTERN in STRING into
+// RESULT. For regex patterns, \0 to \9 are replaced by the text of the
+// corresponding group and \\ by a single backslash.
+void pattern_expand(Pattern *pattern, String string, String with, String *result)
+{
+    result->size = 0;
+    if (!pattern->regex) {
+        string_insert(result, 0, with.data, with.size);
+        return;
+    }
 
-        memmove(buffer->lines + buffer->cursor.y + 1,
-                buffer->lines + buffer->cursor.y,
-                (buffer->count - buffer->cursor.y) * sizeof(String));
+    for (size_t i = 0; i < with.size; ++i) {
+        if (with.data[i] == '\\' && i + 1 < with.size) {
+            const char ch = with.data[++i];
+            if (isdigit(ch)) {
+                const size_t start = pattern->match.groups[(ch - '0') * 2];
+                const size_t end = pattern->match.groups[(ch - '0') * 2 + 1];
+                if (start != REGEX_UNSET && end != REGEX_UNSET) {
+                    string_insert(result, result->size, string.data + start, end - start);
+                }
+                continue;
+            }
+            string_insert(result, result->size, &ch, 1);
+        } else {
+            string_insert(result, result->size, with.data + i, 1);
+        }
+    }
+}
 
-        buffer->lines[++buffer->cursor.y] =
-            string(prev->data + buffer->cursor.x,
-                   prev->size - buffer->cursor.x);
+// Matches
+typedef struct {
+    Vector position;
+    size_t size;
+} Match;
 
-        buffer->count++;
+#define MATCHES_CHUNK 16384
 
-        prev->size = buffer->cursor.x;
-        buffer->cursor.x = 0;
+// Every match of a pattern in a buffer, sorted by position
+typedef struct {
+    Match *items;
+    size_t count;
+    size_t capacity;
 
-        buffer_anchor_fix(buffer);
-    } else if (ch == '\t') {
-        string_insert(buffer->lines + buffer->cursor.y, buffer->cursor.x, "    ", 4);
-        buffer->cursor.x += 4;
-    }
+    bool valid;
+    Pattern pattern;
+} Matches;
+
+void matches_free(Matches *matches)
+{
+    free(matches->items);
+    pattern_free(&matches->pattern);
+    memset(matches, 0, sizeof(Matches));
 }
 
-String buffer_snap_previous_line(Buffer *buffer)
+void matches_grow(Matches *matches, size_t size)
 {
-    const String line = buffer->lines[--buffer->cursor.y];
-    buffer->cursor.x = line.size;
-    return line;
+    if (size > matches->capacity) {
+        matches->capacity = MAX(matches->capacity * 2, size);
+        matches->items = realloc(matches->items, matches->capacity * sizeof(Match));
+        assert(matches->items);
+    }
 }
 
-String buffer_snap_next_line(Buffer *buffer)
+bool matches_of(Matches *matches, Pattern *pattern)
 {
-    const String line = buffer->lines[++buffer->cursor.y];
-    buffer->cursor.x = 0;
-    return line;
+    return matches->valid && matches->pattern.regex == pattern->regex &&
+        sv_eq(sv(matches->pattern.source.data, matches->pattern.source.size),
+              sv(pattern->source.data, pattern->source.size));
 }
 
-void buffer_anchor_snap(Buffer *buffer)
+// The index of the first match at or after POSITION
+size_t matches_find(const Matches *matches, Vector position)
 {
-    buffer->anchor.x = buffer->cursor.x - buffer->cursor.x % term.size.x;
+    size_t low = 0;
+    size_t high = matches->count;
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        const Vector it = matches->items[mid].position;
+        if (it.y < position.y || (it.y == position.y && it.x < position.x)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
 }
 
-void buffer_backward_char(Buffer *buffer)
+// Append the non-overlapping matches of PATTERN in LINE
+void matches_scan(Matches *matches, Pattern *pattern, String line, size_t y)
 {
-    if (buffer->count) {
-        if (buffer->cursor.x) {
-            buffer->cursor.x--;
-            buffer_anchor_fix(buffer);
-        } else if (buffer->cursor.y) {
-            buffer_snap_previous_line(buffer);
-            buffer_anchor_snap(buffer);
-        }
+    size_t x = 0;
+    while (x <= line.size && pattern_search_forward(pattern, line, &x)) {
+        const size_t size = pattern_size(pattern);
+        matches_grow(matches, matches->count + 1);
+        matches->items[matches->count++] = (Match) {.position = Vector(x, y), .size = size};
+        x += size ? size : 1;
     }
 }
 
-void buffer_forward_char(Buffer *buffer)
+// Replace every match of PATTERN at or after START in STRING with WITH,
+// building the new contents in one pass. Returns the number of matches.
+// The contents STRING had are moved to OLD, if it is not NULL and there was
+// anything to replace
+size_t string_replace_all(String *string, Pattern *pattern, size_t start, String with, String *expanded,
+                          String *old)
 {
-    if (buffer->count) {
-        if (buffer->cursor.x < buffer->lines[buffer->cursor.y].size) {
-            buffer->cursor.x++;
-            buffer_anchor_fix(buffer);
-            buffer_anchor_snap(buffer);
+    String result = {0};
+    size_t count = 0;
+    size_t copied = 0;
+
+    size_t x = start;
+    while (x <= string->size && pattern_search_forward(pattern, *string, &x)) {
+        const size_t size = pattern_size(pattern);
+        if (!count) {
+            string_grow(&result, string->size + with.size);
         }
-    }
-}
 
-void buffer_backward_word(Buffer *buffer)
-{
-    if (buffer->count) {
-        String line = buffer->lines[buffer->cursor.y];
+        pattern_expand(pattern, *string, with, expanded);
+        string_insert(&result, result.size, string->data + copied, x - copied);
+        string_insert(&result, result.size, expanded->data, expanded->size);
 
-        if (line.size) {
-            if (buffer->cursor.x && syntax_isident(buffer->syntax, line.data[buffer->cursor.x])) {
-                buffer->cursor.x--;
-            }
+        count++;
+        copied = x + size;
+        x += size ? size : 1;
+    }
 
-            while (buffer->cursor.x && !syntax_isident(buffer->syntax, line.data[buffer->cursor.x])) {
-                buffer->cursor.x--;
-            }
+    if (count) {
+        string_insert(&result, result.size, string->data + copied, string->size - copied);
+        if (old) {
+            string_own(string);
+            *old = *string;
+        } else {
+            string_free(string);
         }
+        *string = result;
+    }
 
-        if (buffer->cursor.x == 0 && buffer->cursor.y) {
-            line = buffer_snap_previous_line(buffer);
-        }
+    return count;
+}
 
-        while (buffer->cursor.x > 1 && syntax_isident(buffer->syntax, line.data[buffer->cursor.x - 1])) {
-            buffer->cursor.x--;
-        }
+// Ranges
+typedef struct {
+    size_t start;
+    size_t end;
+} Range;
 
-        if (buffer->cursor.x == 1 && syntax_isident(buffer->syntax, *line.data)) {
-            buffer->cursor.x--;
-        }
+// Sorted, disjoint ranges of lines
+typedef struct {
+    Range *items;
+    size_t count;
+    size_t capacity;
+    size_t current;
+} Ranges;
 
-        buffer_anchor_snap(buffer);
-        buffer_anchor_fix(buffer);
-    }
-}
+#define RANGES_NONE ((size_t) -1)
 
-void buffer_forward_word(Buffer *buffer)
+void ranges_push(Ranges *ranges, size_t start, size_t end)
 {
-    if (buffer->count) {
-        String line = buffer->lines[buffer->cursor.y];
-
-        while (buffer->cursor.x < line.size && !syntax_isident(buffer->syntax, line.data[buffer->cursor.x])) {
-            buffer->cursor.x++;
-        }
-
-        if (buffer->cursor.x == line.size && buffer->cursor.y < buffer->count) {
-            line = buffer_snap_next_line(buffer);
-        }
+    if (start == end) {
+        return;
+    }
 
-        while (buffer->cursor.x < line.size && syntax_isident(buffer->syntax, line.data[buffer->cursor.x])) {
-            buffer->cursor.x++;
-        }
+    if (ranges->count && ranges->items[ranges->count - 1].end == start) {
+        ranges->items[ranges->count - 1].end = end;
+        return;
+    }
 
-        buffer_anchor_snap(buffer);
-        buffer_anchor_fix(buffer);
+    if (ranges->count == ranges->capacity) {
+        ranges->capacity += INC_CAP;
+        ranges->items = realloc(ranges->items, ranges->capacity * sizeof(Range));
+        assert(ranges->items);
     }
+    ranges->items[ranges->count++] = (Range) {.start = start, .end = end};
 }
 
-void buffer_backward_line(Buffer *buffer)
+// The first line at or after Y in RANGES, or RANGES_NONE. Lookups usually
+// move to a nearby line, so the range of the last one is tried first.
+size_t ranges_next(Ranges *ranges, size_t y)
 {
-    if (buffer->count) {
-        buffer->cursor.x = 0;
+    size_t i = ranges->current;
+    if (i >= ranges->count || ranges->items[i].start > y) {
+        i = 0;
+    }
+
+    while (i < ranges->count && ranges->items[i].end <= y) {
+        i++;
     }
+
+    if (i == ranges->count) {
+        return RANGES_NONE;
+    }
+
+    ranges->current = i;
+    return MAX(y, ranges->items[i].start);
 }
 
-void buffer_forward_line(Buffer *buffer)
+// The last line at or before Y in RANGES, or RANGES_NONE, which is also
+// what going back from line 0 gives
+size_t ranges_previous(Ranges *ranges, size_t y)
 {
-    if (buffer->count) {
-        buffer->cursor.x = buffer->lines[buffer->cursor.y].size;
+    if (y == RANGES_NONE) {
+        return RANGES_NONE;
+    }
+
+    size_t i = ranges->current;
+    if (i >= ranges->count || ranges->items[i].end <= y) {
+        i = ranges->count;
+    } else {
+        i++;
+    }
+
+    while (i > 0 && ranges->items[i - 1].start > y) {
+        i--;
+    }
+
+    if (i == 0) {
+        return RANGES_NONE;
     }
+
+    ranges->current = i - 1;
+    return MIN(y, ranges->items[i - 1].end - 1);
 }
 
-void buffer_cursor_fix(Buffer *buffer)
+// Trigrams
+#define TRIGRAM_BLOCK 4096
+#define TRIGRAM_AUTO_SIZE (16 << 20)
+#define TRIGRAM_PENDING UINT32_MAX
+
+// The ids of the blocks of lines containing a trigram, in ascending order
+typedef struct {
+    uint32_t key;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *ids;
+} Posting;
+
+typedef struct {
+    uint32_t id;
+    size_t count;
+    size_t stale;
+} TrigramBlock;
+
+// An index from the case folded trigrams of a buffer to the blocks of lines
+// they appear in. The blocks are kept in buffer order with the number of
+// lines in each, and have ids which do not change when lines are inserted
+// or deleted before them, so edits only touch the postings of the lines
+// they change. Postings are never removed: a block which lost too many
+// lines is given a new id and indexed again, and everything is indexed
+// again once too many ids are dead.
+//
+// The last block is the pending one, holding the lines not indexed yet,
+// which is always searched. It is indexed a few blocks at a time by
+// trigrams_step() while the editor is idle.
+typedef struct {
+    bool enabled;
+
+    Posting *postings;
+    size_t postings_count;
+    size_t postings_capacity;
+    size_t memory;
+
+    TrigramBlock *blocks;
+    size_t count;
+    size_t capacity;
+    size_t lines;
+
+    uint32_t next_id;
+    size_t dead;
+
+    size_t hint;
+    size_t hint_start;
+} Trigrams;
+
+static inline uint32_t trigram_key(const char *data)
 {
-    if (buffer->count) {
-        buffer->cursor.x = MIN(buffer->cursor.x, buffer->lines[buffer->cursor.y].size);
-    }
+    return (uint32_t) tolower((unsigned char) data[0]) << 16 |
+        (uint32_t) tolower((unsigned char) data[1]) << 8 |
+        (uint32_t) tolower((unsigned char) data[2]);
 }
 
-void buffer_previous_line(Buffer *buffer)
+void trigrams_free(Trigrams *trigrams)
 {
-    if (buffer->cursor.y) {
-        buffer->cursor.y--;
-        buffer_cursor_fix(buffer);
-        buffer_anchor_snap(buffer);
-        buffer_anchor_fix(buffer);
+    for (size_t i = 0; i < trigrams->postings_capacity; ++i) {
+        free(trigrams->postings[i].ids);
     }
+    free(trigrams->postings);
+    free(trigrams->blocks);
+    memset(trigrams, 0, sizeof(Trigrams));
 }
 
-void buffer_next_line(Buffer *buffer)
+// Throw the index away, leaving LINES lines to be indexed
+void trigrams_reset(Trigrams *trigrams, size_t lines)
 {
-    if (buffer->cursor.y + 1 < buffer->count) {
-        buffer->cursor.y++;
-        buffer_cursor_fix(buffer);
-        buffer_anchor_snap(buffer);
-        buffer_anchor_fix(buffer);
-    }
+    trigrams_free(trigrams);
+    trigrams->enabled = true;
+    trigrams->capacity = INC_CAP;
+    trigrams->blocks = malloc(trigrams->capacity * sizeof(TrigramBlock));
+    assert(trigrams->blocks);
+    trigrams->blocks[trigrams->count++] = (TrigramBlock) {.id = TRIGRAM_PENDING, .count = lines};
+    trigrams->lines = lines;
+    trigrams->memory = trigrams->capacity * sizeof(TrigramBlock);
 }
 
-void buffer_previous_para(Buffer *buffer)
+// The posting of KEY in the hash table, which uses linear probing and a
+// zero key for empty slots, so keys are stored plus one
+Posting *trigrams_posting(Trigrams *trigrams, uint32_t key, bool create)
 {
-    while (buffer->cursor.y && buffer->lines[buffer->cursor.y].size) {
-        buffer->cursor.y--;
+    if (create && (trigrams->postings_count + 1) * 2 > trigrams->postings_capacity) {
+        const Posting *old = trigrams->postings;
+        const size_t old_capacity = trigrams->postings_capacity;
+
+        trigrams->postings_capacity = MAX(1024, old_capacity * 2);
+        trigrams->postings = calloc(trigrams->postings_capacity, sizeof(Posting));
+        assert(trigrams->postings);
+        trigrams->memory += (trigrams->postings_capacity - old_capacity) * sizeof(Posting);
+
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old[i].key) {
+                size_t slot = old[i].key * 2654435761u & (trigrams->postings_capacity - 1);
+                while (trigrams->postings[slot].key) {
+                    slot = (slot + 1) & (trigrams->postings_capacity - 1);
+                }
+                trigrams->postings[slot] = old[i];
+            }
+        }
+        free((void *) old);
     }
 
-    while (buffer->cursor.y && !buffer->lines[buffer->cursor.y].size) {
-        buffer->cursor.y--;
+    if (!trigrams->postings_capacity) {
+        return NULL;
     }
 
-    buffer_cursor_fix(buffer);
-    buffer_anchor_snap(buffer);
-    buffer_anchor_fix(buffer);
+    size_t slot = (key + 1) * 2654435761u & (trigrams->postings_capacity - 1);
+    while (trigrams->postings[slot].key) {
+        if (trigrams->postings[slot].key == key + 1) {
+            return trigrams->postings + slot;
+        }
+        slot = (slot + 1) & (trigrams->postings_capacity - 1);
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    trigrams->postings_count++;
+    trigrams->postings[slot].key = key + 1;
+    return trigrams->postings + slot;
 }
 
-void buffer_next_para(Buffer *buffer)
+void trigrams_add(Trigrams *trigrams, uint32_t id, uint32_t key)
 {
-    while (buffer->cursor.y + 1 < buffer->count && buffer->lines[buffer->cursor.y].size) {
-        buffer->cursor.y++;
+    Posting *posting = trigrams_posting(trigrams, key, true);
+
+    // Blocks are mostly indexed in id order, so ids are usually appended
+    size_t index = posting->count;
+    if (index && posting->ids[index - 1] >= id) {
+        size_t low = 0, high = posting->count;
+        while (low < high) {
+            const size_t mid = (low + high) / 2;
+            if (posting->ids[mid] < id) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        if (low < posting->count && posting->ids[low] == id) {
+            return;
+        }
+        index = low;
     }
 
-    while (buffer->cursor.y + 1 < buffer->count && !buffer->lines[buffer->cursor.y].size) {
-        buffer->cursor.y++;
+    // Most trigrams appear in few blocks, so postings start small and double
+    if (posting->count == posting->capacity) {
+        const uint32_t capacity = MAX(4, posting->capacity * 2);
+        posting->ids = realloc(posting->ids, capacity * sizeof(uint32_t));
+        assert(posting->ids);
+        trigrams->memory += (capacity - posting->capacity) * sizeof(uint32_t);
+        posting->capacity = capacity;
     }
 
-    buffer_cursor_fix(buffer);
-    buffer_anchor_snap(buffer);
-    buffer_anchor_fix(buffer);
+    memmove(posting->ids + index + 1, posting->ids + index, (posting->count - index) * sizeof(uint32_t));
+    posting->ids[index] = id;
+    posting->count++;
 }
 
-void buffer_get_region(Buffer buffer, Vector *start, Vector *end)
+void trigrams_add_line(Trigrams *trigrams, uint32_t id, String line)
 {
-    *start = buffer.marker;
-    *end = buffer.cursor;
-
-    if (start->y > end->y || (start->y == end->y && start->x > end->x)) {
-        const Vector temp = *start;
-        *start = *end;
-        *end = temp;
+    for (size_t i = 0; i + 3 <= line.size; ++i) {
+        trigrams_add(trigrams, id, trigram_key(line.data + i));
     }
 }
 
-void buffer_print(Buffer buffer)
+void trigrams_insert_block(Trigrams *trigrams, size_t index, TrigramBlock block)
 {
-    term_clear();
-
-    Vector start, end;
-    if (buffer.region) {
-        buffer_get_region(buffer, &start, &end);
+    if (trigrams->count == trigrams->capacity) {
+        trigrams->capacity += INC_CAP;
+        trigrams->blocks = realloc(trigrams->blocks, trigrams->capacity * sizeof(TrigramBlock));
+        assert(trigrams->blocks);
+        trigrams->memory += INC_CAP * sizeof(TrigramBlock);
     }
 
-    Vector pen;
-    bool first = true;
-    const size_t space = MIN(buffer.count, buffer.anchor.y + term.size.y);
-    for (pen.y = buffer.anchor.y; pen.y < space; ++pen.y) {
-        if (first) {
-            first = false;
-        } else {
-            putchar('\n');
-        }
-        pen.x = 0;
+    memmove(trigrams->blocks + index + 1, trigrams->blocks + index, (trigrams->count - index) * sizeof(TrigramBlock));
+    trigrams->blocks[index] = block;
+    trigrams->count++;
+}
 
-        SV view = {
-            .data = buffer.lines[pen.y].data,
-            .size = buffer.lines[pen.y].size
-        };
+// The block containing line Y, or the pending one if Y is past the end.
+// START receives its first line.
+size_t trigrams_locate(Trigrams *trigrams, size_t y, size_t *start)
+{
+    size_t i = 0, first = 0;
+    if (trigrams->hint < trigrams->count && trigrams->hint_start <= y) {
+        i = trigrams->hint;
+        first = trigrams->hint_start;
+    }
 
-        view.size = MIN(view.size, buffer.anchor.x + term.size.x);
+    while (i + 1 < trigrams->count && first + trigrams->blocks[i].count <= y) {
+        first += trigrams->blocks[i].count;
+        i++;
+    }
 
-        while (view.size) {
-            SyntaxType type;
-            const SV word = syntax_split(buffer.syntax, &view, &type);
+    trigrams->hint = i;
+    trigrams->hint_start = first;
+    *start = first;
+    return i;
+}
 
-            if (type) term_color(color_syntaxes[type]);
-            for (size_t i = 0; i < word.size; ++i) {
-                if (buffer.region && vector_eq(pen, start)) {
-                    term_color(COLOR_VISUAL);
-                }
+// Give block INDEX, starting at line START, a new id and index its lines
+void trigrams_refresh(Trigrams *trigrams, const String *lines, size_t index, size_t start)
+{
+    TrigramBlock *block = trigrams->blocks + index;
+    block->id = trigrams->next_id++;
+    block->stale = 0;
 
-                if (pen.x >= buffer.anchor.x) {
-                    putchar(word.data[i]);
-                }
+    for (size_t y = start; y < start + block->count; ++y) {
+        trigrams_add_line(trigrams, block->id, lines[y]);
+    }
+}
 
-                if (buffer.region && vector_eq(pen, end)) {
-                    term_color(COLOR_NORMAL);
-                }
+// Lines [Y, Y + REMOVED) were replaced by [Y, Y + ADDED) in LINES
+void trigrams_changed(Trigrams *trigrams, const String *lines, size_t y, size_t removed, size_t added)
+{
+    const size_t total = trigrams->lines - removed + added;
+    if (added > TRIGRAM_BLOCK || trigrams->dead > trigrams->count) {
+        trigrams_reset(trigrams, total);
+        return;
+    }
 
-                pen.x++;
-            }
-            if (type) term_color(color_syntaxes[SYNTAX_NORMAL]);
-        }
+    size_t start;
+    const size_t index = trigrams_locate(trigrams, y, &start);
+
+    size_t offset = y - start;
+    for (size_t i = index, left = removed; left && i < trigrams->count; ++i) {
+        TrigramBlock *block = trigrams->blocks + i;
+        const size_t size = MIN(left, block->count - offset);
+        block->count -= size;
+        block->stale += size;
+        left -= size;
+        offset = 0;
+    }
 
-        if (buffer.region && vector_eq(pen, start)) {
-            term_color(COLOR_VISUAL);
+    TrigramBlock *block = trigrams->blocks + index;
+    block->count += added;
+    if (block->id != TRIGRAM_PENDING) {
+        for (size_t i = y; i < y + added; ++i) {
+            trigrams_add_line(trigrams, block->id, lines[i]);
         }
+    }
+    trigrams->lines = total;
 
-        if (buffer.region && vector_eq(pen, end)) {
-            term_color(COLOR_NORMAL);
+    // Blocks emptied by the deletion go, but the pending one always stays
+    size_t kept = index + 1;
+    for (size_t i = index + 1; i < trigrams->count; ++i) {
+        if (trigrams->blocks[i].count || trigrams->blocks[i].id == TRIGRAM_PENDING) {
+            trigrams->blocks[kept++] = trigrams->blocks[i];
+        } else {
+            trigrams->dead++;
+        }
+    }
+    trigrams->count = kept;
+
+    if (block->id != TRIGRAM_PENDING) {
+        if (block->count > 2 * TRIGRAM_BLOCK) {
+            // The old id keeps the postings of the lines split off, which
+            // only makes it a candidate more often than needed
+            const size_t half = block->count / 2;
+            const size_t moved = block->count - half;
+            block->count = half;
+            block->stale += moved;
+
+            trigrams_insert_block(trigrams, index + 1, (TrigramBlock) {.count = moved});
+            trigrams_refresh(trigrams, lines, index + 1, start + half);
+        } else if (block->stale > TRIGRAM_BLOCK) {
+            trigrams_refresh(trigrams, lines, index, start);
+            trigrams->dead++;
+        } else if (block->count < TRIGRAM_BLOCK / 4 && index > 0) {
+            // Fold what is left of a small block into the previous one
+            TrigramBlock *previous = block - 1;
+            for (size_t i = start; i < start + block->count; ++i) {
+                trigrams_add_line(trigrams, previous->id, lines[i]);
+            }
+            previous->count += block->count;
+
+            memmove(block, block + 1, (trigrams->count - index - 1) * sizeof(TrigramBlock));
+            trigrams->count--;
+            trigrams->dead++;
+        } else if (!block->count) {
+            memmove(block, block + 1, (trigrams->count - index - 1) * sizeof(TrigramBlock));
+            trigrams->count--;
+            trigrams->dead++;
         }
     }
 
-    term_move(vector_sub(buffer.cursor, buffer.anchor));
+    trigrams->hint = 0;
+    trigrams->hint_start = 0;
 }
 
-void buffer_toggle_region(Buffer *buffer)
-{
-    if (buffer->region) {
-        buffer->region = false;
-    } else {
-        buffer->region = true;
-        buffer->marker = buffer->cursor;
-    }
-}
+typedef struct {
+    const String *lines;
+    size_t start;
+    size_t end;
 
-typedef void (*BufferAction)(Buffer *);
+    uint32_t *keys;
+    size_t count;
+    size_t capacity;
+} TrigramChunk;
 
-void buffer_delete(Buffer *buffer, BufferAction motion)
+// Collect the distinct trigrams of a block of lines
+void trigram_chunk_task(void *arg)
 {
-    if (buffer->count == 0) {
-        return;
-    }
+    TrigramChunk *chunk = (TrigramChunk *) arg;
+    uint64_t *seen = calloc((1 << 24) / 64, sizeof(uint64_t));
+    assert(seen);
+
+    for (size_t y = chunk->start; y < chunk->end; ++y) {
+        const String line = chunk->lines[y];
+        for (size_t i = 0; i + 3 <= line.size; ++i) {
+            const uint32_t key = trigram_key(line.data + i);
+            const uint64_t bit = (uint64_t) 1 << (key & 63);
+            if (seen[key >> 6] & bit) {
+                continue;
+            }
+            seen[key >> 6] |= bit;
 
-    buffer->modified = true;
-    if (!buffer->region) {
-        buffer->marker = buffer->cursor;
-        motion(buffer);
+            if (chunk->count == chunk->capacity) {
+                chunk->capacity = MAX(INC_CAP, chunk->capacity * 2);
+                chunk->keys = realloc(chunk->keys, chunk->capacity * sizeof(uint32_t));
+                assert(chunk->keys);
+            }
+            chunk->keys[chunk->count++] = key;
+        }
     }
 
-    Vector start, end;
-    buffer_get_region(*buffer, &start, &end);
+    free(seen);
+}
 
-    if (buffer->region && end.x < buffer->lines[end.y].size) {
-        end.x++;
+// Index the next pending lines, one block for each worker, which read the
+// lines while the main thread waits for them. Returns whether any lines
+// are left pending.
+bool trigrams_step(Trigrams *trigrams, const String *lines)
+{
+    const size_t pending = trigrams->blocks[trigrams->count - 1].count;
+    if (!pending) {
+        return false;
     }
 
-    if (start.y == end.y) {
-        if (end.x > start.x) {
-            String *string = buffer->lines + start.y;
-            assert(string->size >= end.x);
+    const size_t first = trigrams->lines - pending;
 
-            memmove(string->data + start.x, string->data + end.x, string->size - end.x);
-            string->size -= end.x - start.x;
+    // A few lines added at the end go to the last block instead of a new one
+    TrigramBlock *last = trigrams->count > 1 ? trigrams->blocks + trigrams->count - 2 : NULL;
+    if (last && pending < TRIGRAM_BLOCK && last->count + pending <= 2 * TRIGRAM_BLOCK) {
+        for (size_t y = first; y < first + pending; ++y) {
+            trigrams_add_line(trigrams, last->id, lines[y]);
         }
-    } else {
-        String *string_start = buffer->lines + start.y;
-        String string_end = buffer->lines[end.y];
+        last->count += pending;
+        trigrams->blocks[trigrams->count - 1].count = 0;
+        return false;
+    }
 
-        string_start->size = start.x;
-        string_insert(string_start, start.x, string_end.data + end.x, string_end.size - end.x);
+    const size_t count = MIN(pool_size(), (pending + TRIGRAM_BLOCK - 1) / TRIGRAM_BLOCK);
+    TrigramChunk *chunks = calloc(count, sizeof(TrigramChunk));
+    assert(chunks);
 
-        for (size_t i = start.y + 1; i <= end.y; ++i) {
-            string_free(buffer->lines + i);
-        }
+    size_t waiting = 0;
+    for (size_t i = 0; i < count; ++i) {
+        chunks[i].lines = lines;
+        chunks[i].start = first + i * TRIGRAM_BLOCK;
+        chunks[i].end = MIN(first + pending, chunks[i].start + TRIGRAM_BLOCK);
+        pool_submit(trigram_chunk_task, chunks + i, &waiting);
+    }
+    pool_wait(&waiting);
 
-        memmove(buffer->lines + start.y + 1,
-                buffer->lines + end.y + 1,
-                (buffer->count - end.y - 1) * sizeof(String));
+    for (size_t i = 0; i < count; ++i) {
+        const TrigramBlock block = {
+            .id = trigrams->next_id++,
+            .count = chunks[i].end - chunks[i].start,
+        };
+        trigrams_insert_block(trigrams, trigrams->count - 1, block);
+        trigrams->blocks[trigrams->count - 1].count -= block.count;
 
-        buffer->count -= end.y - start.y;
+        for (size_t j = 0; j < chunks[i].count; ++j) {
+            trigrams_add(trigrams, block.id, chunks[i].keys[j]);
+        }
+        free(chunks[i].keys);
     }
+    free(chunks);
 
-    buffer->region = false;
-    buffer->cursor = start;
+    trigrams->hint = 0;
+    trigrams->hint_start = 0;
+    return trigrams->blocks[trigrams->count - 1].count;
 }
 
-bool buffer_search(Buffer *buffer, String query, bool forward)
+// Add to RANGES the lines which may contain QUERY, which is at least three
+// characters long: those of the blocks with every trigram of the query,
+// and the pending ones.
+void trigrams_ranges(Trigrams *trigrams, String query, Ranges *ranges)
 {
-    if (forward) {
-        size_t x = buffer->cursor.x + 1;
+    const size_t count = query.size - 2;
+    Posting *postings[count];
+    bool missing = false;
+    for (size_t i = 0; i < count; ++i) {
+        postings[i] = trigrams_posting(trigrams, trigram_key(query.data + i), false);
+        missing = missing || !postings[i];
+    }
 
-        for (size_t y = buffer->cursor.y; y < buffer->count; ++y) {
-            if (string_search_forward(buffer->lines[y], query, &x)) {
-                buffer->cursor = Vector(x, y);
-                goto found;
+    // Intersect the shortest posting with the others
+    bool *found = calloc(MAX(trigrams->next_id, 1), sizeof(bool));
+    assert(found);
+    if (!missing) {
+        size_t shortest = 0;
+        for (size_t i = 1; i < count; ++i) {
+            if (postings[i]->count < postings[shortest]->count) {
+                shortest = i;
             }
+        }
 
-            if (y == buffer->cursor.y) {
-                x = 0;
+        for (uint32_t j = 0; j < postings[shortest]->count; ++j) {
+            const uint32_t id = postings[shortest]->ids[j];
+            bool all = true;
+            for (size_t i = 0; all && i < count; ++i) {
+                size_t low = 0, high = postings[i]->count;
+                while (low < high) {
+                    const size_t mid = (low + high) / 2;
+                    if (postings[i]->ids[mid] < id) {
+                        low = mid + 1;
+                    } else {
+                        high = mid;
+                    }
+                }
+                all = low < postings[i]->count && postings[i]->ids[low] == id;
             }
+            found[id] = all;
         }
+    }
 
-        for (size_t y = 0; y <= buffer->cursor.y; ++y) {
-            if (string_search_forward(buffer->lines[y], query, &x)) {
-                buffer->cursor = Vector(x, y);
-                goto found;
-            }
+    size_t start = 0;
+    for (size_t i = 0; i < trigrams->count; ++i) {
+        const TrigramBlock block = trigrams->blocks[i];
+        if (block.id == TRIGRAM_PENDING || found[block.id]) {
+            ranges_push(ranges, start, start + block.count);
         }
-    } else {
-        size_t x = buffer->cursor.x;
-        if (x) x--;
+        start += block.count;
+    }
+    free(found);
+}
 
-        for (size_t y = buffer->cursor.y + 1; y > 0; --y) {
-            const String line = buffer->lines[y - 1];
+// Hashes
+// The hash of every line of a buffer, next to the hashes of the lines of its
+// file as last read or written. The buffer is modified when they differ, and
+// undoing an edit by hand makes it clean again.
+typedef struct {
+    uint64_t *items;
+    size_t count;
+    size_t capacity;
 
-            if (y <= buffer->cursor.y) {
-                x = line.size;
-            }
+    // Hashes dropped near the top leave GAP unused ones before ITEMS, the
+    // same way as the lines of a buffer
+    size_t gap;
 
-            if (string_search_backward(line, query, &x)) {
-                buffer->cursor = Vector(x, y - 1);
-                goto found;
-            }
-        }
+    uint64_t *saved;
+    size_t saved_count;
 
-        for (size_t y = buffer->count; y > buffer->cursor.y; --y) {
-            const String line = buffer->lines[y - 1];
+    // Lines whose hash differs from the saved one at the same index, only
+    // counted again when asked for after lines were inserted or removed
+    size_t differ;
+    bool stale;
+} Hashes;
+
+uint64_t hash_line(String line)
+{
+    uint64_t hash = 0x9e3779b97f4a7c15 ^ line.size;
+    size_t i = 0;
+    for (; i + 8 <= line.size; i += 8) {
+        uint64_t word;
+        memcpy(&word, line.data + i, 8);
+        hash = (hash ^ word) * 0xbf58476d1ce4e5b9;
+        hash ^= hash >> 31;
+    }
+
+    if (i < line.size) {
+        uint64_t word = 0;
+        memcpy(&word, line.data + i, line.size - i);
+        hash = (hash ^ word) * 0xbf58476d1ce4e5b9;
+        hash ^= hash >> 31;
+    }
+
+    hash = (hash ^ (hash >> 29)) * 0x94d049bb133111eb;
+    return hash ^ (hash >> 32);
+}
+
+// The hash of contents whose lines have the COUNT hashes at HASHES
+uint64_t hashes_content(const uint64_t *hashes, size_t count)
+{
+    return hash_line((String) {.data = (char *) hashes, .size = count * sizeof(uint64_t)});
+}
+
+void hashes_free(Hashes *hashes)
+{
+    free(hashes->gap ? hashes->items - hashes->gap : hashes->items);
+    free(hashes->saved);
+    memset(hashes, 0, sizeof(Hashes));
+}
+
+void hashes_grow(Hashes *hashes, size_t size)
+{
+    if (size > hashes->capacity && hashes->gap) {
+        memmove(hashes->items - hashes->gap, hashes->items, hashes->count * sizeof(uint64_t));
+        hashes->items -= hashes->gap;
+        hashes->capacity += hashes->gap;
+        hashes->gap = 0;
+    }
+
+    if (size > hashes->capacity) {
+        hashes->capacity = MAX(hashes->capacity + INC_CAP, size);
+        hashes->items = realloc(hashes->items, hashes->capacity * sizeof(uint64_t));
+        assert(hashes->items);
+    }
+}
+
+void hashes_reset(Hashes *hashes, const String *lines, size_t count)
+{
+    hashes_grow(hashes, count);
+    for (size_t i = 0; i < count; ++i) {
+        hashes->items[i] = hash_line(lines[i]);
+    }
+    hashes->count = count;
+    hashes->stale = true;
+}
+
+// The lines as they are now were read from or written to the file
+void hashes_save(Hashes *hashes, uint64_t *saved, size_t count)
+{
+    free(hashes->saved);
+    hashes->saved = saved;
+    hashes->saved_count = count;
+    hashes->stale = true;
+}
+
+// Lines [Y, Y + REMOVED) were replaced by [Y, Y + ADDED) in LINES
+void hashes_changed(Hashes *hashes, const String *lines, size_t count, size_t y, size_t removed, size_t added)
+{
+    if (hashes->count + added - removed != count) {
+        hashes_reset(hashes, lines, count);
+        return;
+    }
+
+    if (removed == added && !hashes->stale) {
+        for (size_t i = y; i < y + added; ++i) {
+            const bool saved = i < hashes->saved_count;
+            hashes->differ -= saved && hashes->items[i] != hashes->saved[i];
+            hashes->items[i] = hash_line(lines[i]);
+            hashes->differ += saved && hashes->items[i] != hashes->saved[i];
+        }
+        return;
+    }
+
+    const size_t after = hashes->count - y - removed;
+    if (added < removed && y < after) {
+        const size_t drop = removed - added;
+        memmove(hashes->items + drop, hashes->items, y * sizeof(uint64_t));
+        hashes->items += drop;
+        hashes->gap += drop;
+        hashes->capacity -= drop;
+    } else {
+        hashes_grow(hashes, count);
+        memmove(hashes->items + y + added, hashes->items + y + removed, after * sizeof(uint64_t));
+    }
+    for (size_t i = y; i < y + added; ++i) {
+        hashes->items[i] = hash_line(lines[i]);
+    }
+    hashes->count = count;
+    hashes->stale = hashes->stale || removed != added;
+}
+
+// The lines from FIRST on were read from the end of the file
+void hashes_append_saved(Hashes *hashes, size_t first)
+{
+    if (hashes->saved_count == first && hashes->count > first) {
+        hashes->saved = realloc(hashes->saved, hashes->count * sizeof(uint64_t));
+        assert(hashes->saved);
+        memcpy(hashes->saved + first, hashes->items + first, (hashes->count - first) * sizeof(uint64_t));
+        hashes->saved_count = hashes->count;
+    }
+}
+
+bool hashes_modified(Hashes *hashes)
+{
+    if (hashes->count != hashes->saved_count) {
+        return true;
+    }
+
+    if (hashes->stale) {
+        hashes->differ = 0;
+        for (size_t i = 0; i < hashes->count; ++i) {
+            hashes->differ += hashes->items[i] != hashes->saved[i];
+        }
+        hashes->stale = false;
+    }
+    return hashes->differ;
+}
+
+// Diff
+#define DIFF_MAX 1024
+#define DIFF_BUDGET (64 << 20)
+
+typedef struct {
+    size_t old_start;
+    size_t old_count;
+    size_t new_start;
+    size_t new_count;
+} Hunk;
+
+typedef struct {
+    Hunk *items;
+    size_t count;
+    size_t capacity;
+} Hunks;
+
+typedef struct {
+    size_t x;
+    size_t y;
+    bool insert;
+} Edit;
+
+// Line X of the old lines is removed, or line Y of the new ones inserted
+// before it. Edits must come in order, adjacent ones make up a hunk.
+void hunks_push(Hunks *hunks, Edit edit)
+{
+    Hunk *last = hunks->count ? hunks->items + hunks->count - 1 : NULL;
+    if (!last || last->old_start + last->old_count != edit.x || last->new_start + last->new_count != edit.y) {
+        if (hunks->count == hunks->capacity) {
+            hunks->capacity += INC_CAP;
+            hunks->items = realloc(hunks->items, hunks->capacity * sizeof(Hunk));
+            assert(hunks->items);
+        }
+        last = hunks->items + hunks->count++;
+        *last = (Hunk) {.old_start = edit.x, .new_start = edit.y};
+    }
+
+    if (edit.insert) {
+        last->new_count++;
+    } else {
+        last->old_count++;
+    }
+}
+
+// Where line Y of the old lines ended up in the new ones
+size_t hunks_map(const Hunks *hunks, size_t y)
+{
+    size_t result = y;
+    for (size_t i = 0; i < hunks->count; ++i) {
+        const Hunk hunk = hunks->items[i];
+        if (y < hunk.old_start) {
+            break;
+        }
+
+        if (y < hunk.old_start + hunk.old_count) {
+            return hunk.new_start + MIN(y - hunk.old_start, hunk.new_count ? hunk.new_count - 1 : 0);
+        }
+        result = result + hunk.new_count - hunk.old_count;
+    }
+    return result;
+}
+
+// The hunks turning the lines hashed in A into the ones hashed in B, found
+// with Myers' O(ND) algorithm. Gives up and returns false when more than
+// DIFF_MAX lines differ or it takes too long.
+bool diff_hashes(const uint64_t *a, size_t n, const uint64_t *b, size_t m, Hunks *hunks)
+{
+    const ptrdiff_t max = MIN(n + m, DIFF_MAX);
+
+    // The furthest x reached on every diagonal k = x - y, and a copy of
+    // them for every number of edits d to trace the path back
+    ptrdiff_t *v = malloc((2 * max + 3) * sizeof(ptrdiff_t));
+    ptrdiff_t *trace = malloc((max + 1) * (max + 1) * sizeof(ptrdiff_t));
+    assert(v && trace);
+
+    ptrdiff_t *const V = v + max + 1;
+    V[1] = 0;
+
+    size_t work = 0;
+    ptrdiff_t found = -1;
+    for (ptrdiff_t d = 0; d <= max && found < 0 && work < DIFF_BUDGET; ++d) {
+        for (ptrdiff_t k = -d; k <= d; k += 2) {
+            ptrdiff_t x = (k == -d || (k != d && V[k - 1] < V[k + 1])) ? V[k + 1] : V[k - 1] + 1;
+            ptrdiff_t y = x - k;
+            const ptrdiff_t from = x;
+            while (x < (ptrdiff_t) n && y < (ptrdiff_t) m && a[x] == b[y]) {
+                x++;
+                y++;
+            }
+
+            V[k] = x;
+            work += x - from + 1;
+            if (x >= (ptrdiff_t) n && y >= (ptrdiff_t) m) {
+                found = d;
+                break;
+            }
+        }
+        memcpy(trace + d * d, V - d, (2 * d + 1) * sizeof(ptrdiff_t));
+    }
+
+    if (found >= 0) {
+        Edit *edits = malloc((found + 1) * sizeof(Edit));
+        assert(edits);
+
+        ptrdiff_t x = n, y = m;
+        for (ptrdiff_t d = found; d > 0; --d) {
+            const ptrdiff_t *P = trace + (d - 1) * (d - 1) + (d - 1);
+            const ptrdiff_t k = x - y;
+            const bool insert = k == -d || (k != d && P[k - 1] < P[k + 1]);
+            const ptrdiff_t previous = insert ? k + 1 : k - 1;
+
+            x = P[previous];
+            y = x - previous;
+            edits[d - 1] = (Edit) {.x = x, .y = y, .insert = insert};
+        }
+
+        for (ptrdiff_t d = 0; d < found; ++d) {
+            hunks_push(hunks, edits[d]);
+        }
+        free(edits);
+    }
+
+    free(trace);
+    free(v);
+    return found >= 0;
+}
+
+// Chunks
+// Text read from a stream is kept in large blocks, and the lines of a buffer
+// borrow from them instead of each having an allocation of its own. Blocks
+// are only freed once neither the buffer nor a save refers to them. The
+// lines of a large kill are handed over to blocks the same way, see Kills.
+#define CHUNK_SIZE (1 << 20)
+
+typedef struct Chunks {
+    char **items;
+    size_t count;
+    size_t capacity;
+
+    size_t size;
+    size_t used;
+    size_t refs;
+} Chunks;
+
+Chunks *chunks_new(void)
+{
+    Chunks *chunks = calloc(1, sizeof(Chunks));
+    assert(chunks);
+    chunks->refs = 1;
+    return chunks;
+}
+
+void chunks_release(Chunks *chunks)
+{
+    if (chunks && --chunks->refs == 0) {
+        for (size_t i = 0; i < chunks->count; ++i) {
+            free(chunks->items[i]);
+        }
+        free(chunks->items);
+        free(chunks);
+    }
+}
+
+void chunks_grow(Chunks *chunks, size_t count)
+{
+    if (count > chunks->capacity) {
+        chunks->capacity = MAX(chunks->capacity + INC_CAP, count);
+        chunks->items = realloc(chunks->items, chunks->capacity * sizeof(char *));
+        assert(chunks->items);
+    }
+}
+
+// Start a new block with room for at least SIZE bytes, beginning with the
+// last KEEP bytes of the current one
+void chunks_next(Chunks *chunks, size_t keep, size_t size)
+{
+    chunks_grow(chunks, chunks->count + 1);
+
+    char *block = malloc(size);
+    assert(block);
+    if (keep) {
+        memcpy(block, chunks->items[chunks->count - 1] + chunks->used - keep, keep);
+    }
+
+    chunks->items[chunks->count++] = block;
+    chunks->size = size;
+    chunks->used = keep;
+}
+
+// The Chunks whose blocks the lines held by a buffer, a save or a kill may
+// borrow from, each of which they keep a reference to
+typedef struct {
+    Chunks **items;
+    size_t count;
+    size_t capacity;
+} Lenders;
+
+void lenders_add(Lenders *lenders, Chunks *chunks)
+{
+    for (size_t i = 0; i < lenders->count; ++i) {
+        if (lenders->items[i] == chunks) {
+            return;
+        }
+    }
+
+    if (lenders->count == lenders->capacity) {
+        lenders->capacity += INC_CAP;
+        lenders->items = realloc(lenders->items, lenders->capacity * sizeof(Chunks *));
+        assert(lenders->items);
+    }
+    lenders->items[lenders->count++] = chunks;
+    chunks->refs++;
+}
+
+void lenders_add_all(Lenders *lenders, const Lenders *from)
+{
+    for (size_t i = 0; i < from->count; ++i) {
+        lenders_add(lenders, from->items[i]);
+    }
+}
+
+void lenders_free(Lenders *lenders)
+{
+    for (size_t i = 0; i < lenders->count; ++i) {
+        chunks_release(lenders->items[i]);
+    }
+    free(lenders->items);
+    memset(lenders, 0, sizeof(Lenders));
+}
+
+// Stream
+#define STREAM_READS 16
+
+// A pipe read into a buffer as data arrives, from stdin or a command, or a
+// file followed as it grows
+typedef struct Stream {
+    int fd;
+    pid_t pid;
+    size_t start;
+
+    // The last line of the buffer is the incomplete one at the end of the
+    // stream, shown as it is so far
+    bool partial;
+} Stream;
+
+typedef enum {
+    STREAM_WAIT,
+    STREAM_MORE,
+    STREAM_END,
+} StreamState;
+
+// Stop reading, killing the command with SIG if it is not 0. Returns the wait
+// status of the command.
+int stream_close(Stream *stream, int sig)
+{
+    int status = 0;
+    events_unwatch(stream->fd);
+    close(stream->fd);
+    if (stream->pid > 0) {
+        if (sig) {
+            kill(-stream->pid, sig);
+        }
+        while (waitpid(stream->pid, &status, 0) == -1 && errno == EINTR);
+    }
+    free(stream);
+    return status;
+}
+
+// Follow
+#define FOLLOW_EVENTS (IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+// A file whose directory is watched, so that writes to it, as well as the
+// file being replaced when logs are rotated, are noticed
+typedef struct Follow {
+    int inotify;
+    char *name;
+    dev_t dev;
+    ino_t ino;
+    off_t offset;
+} Follow;
+
+void follow_close(Follow *follow)
+{
+    events_unwatch(follow->inotify);
+    close(follow->inotify);
+    free(follow->name);
+    free(follow);
+}
+
+// View
+#define VIEW_WINDOW (8 << 20)
+#define VIEW_LINES 65536
+#define VIEW_BLOCK (1 << 20)
+#define VIEW_CHECKPOINT 4096
+#define VIEW_UNKNOWN ((size_t) -1)
+
+// Build with -DVIEW_AUTO_SIZE=BYTES to choose the size from which files are
+// opened as views, a quarter of the memory by default
+#ifndef VIEW_AUTO_SIZE
+#define VIEW_AUTO_SIZE 0
+#endif
+
+// A file too large to be read into memory, shown read-only through a window
+// of it. The buffer borrows the lines of the window, which is read again
+// around the cursor as it nears either end. Line numbers come from a sparse
+// index of where every VIEW_CHECKPOINT-th line starts, built while idle.
+typedef struct View {
+    int fd;
+    off_t size;
+
+    // The window read at BASE, holding the lines from START to END
+    char *window;
+    off_t base;
+    off_t start;
+    off_t end;
+
+    // The number of the line at START, or VIEW_UNKNOWN
+    size_t line;
+
+    off_t *checkpoints;
+    size_t count;
+    size_t capacity;
+
+    // How far the index got, and the lines ended before that
+    off_t indexed;
+    size_t lines;
+} View;
+
+size_t view_auto_size(void)
+{
+    if (VIEW_AUTO_SIZE) {
+        return VIEW_AUTO_SIZE;
+    }
+    return (size_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 4;
+}
+
+View *view_new(int fd, off_t size)
+{
+    View *view = calloc(1, sizeof(View));
+    assert(view);
+    view->fd = fd;
+    view->size = size;
+    view->window = malloc(VIEW_WINDOW);
+    assert(view->window);
+
+    view->capacity = INC_CAP;
+    view->checkpoints = malloc(view->capacity * sizeof(off_t));
+    assert(view->checkpoints);
+    view->checkpoints[view->count++] = 0;
+    return view;
+}
+
+void view_close(View *view)
+{
+    close(view->fd);
+    free(view->window);
+    free(view->checkpoints);
+    free(view);
+}
+
+// The number of lines ending in [FROM, TO)
+size_t view_count_lines(View *view, off_t from, off_t to)
+{
+    char *block = malloc(VIEW_BLOCK);
+    assert(block);
+
+    size_t count = 0;
+    while (from < to) {
+        const ssize_t size = pread(view->fd, block, MIN(VIEW_BLOCK, to - from), from);
+        if (size <= 0) {
+            break;
+        }
+
+        for (const char *p = block; (p = memchr(p, '\n', block + size - p)); ++p) {
+            count++;
+        }
+        from += size;
+    }
+
+    free(block);
+    return count;
+}
+
+// Index the next block of the file. Returns whether any is left.
+bool view_index_step(View *view)
+{
+    if (view->indexed >= view->size) {
+        return false;
+    }
+
+    char *block = malloc(VIEW_BLOCK);
+    assert(block);
+
+    const ssize_t size = pread(view->fd, block, VIEW_BLOCK, view->indexed);
+    if (size <= 0) {
+        view->indexed = view->size;
+    } else {
+        for (const char *p = block; (p = memchr(p, '\n', block + size - p)); ++p) {
+            if (++view->lines % VIEW_CHECKPOINT == 0) {
+                if (view->count == view->capacity) {
+                    view->capacity *= 2;
+                    view->checkpoints = realloc(view->checkpoints, view->capacity * sizeof(off_t));
+                    assert(view->checkpoints);
+                }
+                view->checkpoints[view->count++] = view->indexed + (p - block) + 1;
+            }
+        }
+        view->indexed += size;
+    }
+
+    free(block);
+    return view->indexed < view->size;
+}
+
+// The number of the line starting at OFFSET, if the index got that far
+size_t view_line_at(View *view, off_t offset)
+{
+    if (offset > view->indexed) {
+        return VIEW_UNKNOWN;
+    }
+
+    size_t low = 0, high = view->count;
+    while (high - low > 1) {
+        const size_t middle = (low + high) / 2;
+        if (view->checkpoints[middle] <= offset) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return low * VIEW_CHECKPOINT + view_count_lines(view, view->checkpoints[low], offset);
+}
+
+// Where line Y starts, indexing the file up to it first. Lines past the end
+// are taken to be the last one.
+off_t view_line_offset(View *view, size_t y)
+{
+    while (y / VIEW_CHECKPOINT >= view->count && view_index_step(view));
+
+    const size_t index = MIN(y / VIEW_CHECKPOINT, view->count - 1);
+    off_t offset = view->checkpoints[index];
+    size_t left = y - index * VIEW_CHECKPOINT;
+
+    char *block = malloc(VIEW_BLOCK);
+    assert(block);
+
+    off_t line = offset, previous = offset;
+    while (left) {
+        const ssize_t size = pread(view->fd, block, VIEW_BLOCK, offset);
+        if (size <= 0) {
+            break;
+        }
+
+        for (const char *p = block; left && (p = memchr(p, '\n', block + size - p)); ++p) {
+            previous = line;
+            line = offset + (p - block) + 1;
+            left--;
+        }
+        offset += size;
+    }
+
+    free(block);
+    return line < view->size ? line : previous;
+}
+
+// A key pressed during a long search stops it
+bool view_interrupted(void)
+{
+    struct pollfd fd = {.fd = STDIN_FILENO, .events = POLLIN};
+    return poll(&fd, 1, 0) > 0;
+}
+
+// Search the lines from FROM on for PATTERN, a block at a time. Returns the
+// offset of the line of the first match, its column going into X, or -1.
+off_t view_search_forward(View *view, Pattern *pattern, off_t from, size_t *x)
+{
+    char *block = malloc(VIEW_BLOCK);
+    assert(block);
+
+    off_t result = -1;
+    size_t kept = 0;
+    while (result == -1 && from + (off_t) kept < view->size && !view_interrupted()) {
+        const ssize_t size = pread(view->fd, block + kept, VIEW_BLOCK - kept, from + kept);
+        if (size <= 0) {
+            break;
+        }
+
+        const size_t end = kept + size;
+        const bool last = from + (off_t) end >= view->size;
+        size_t start = 0;
+        while (start < end) {
+            const char *newline = memchr(block + start, '\n', end - start);
+
+            // Read the rest of the line, unless it alone fills the block
+            if (!newline && !last && start) {
+                break;
+            }
+
+            const size_t stop = newline ? (size_t) (newline - block) : end;
+            const String line = {.data = block + start, .size = stop - start};
+            size_t column = 0;
+            if (pattern_search_forward(pattern, line, &column)) {
+                *x = column;
+                result = from + start;
+                break;
+            }
+            start = stop + 1;
+        }
+
+        start = MIN(start, end);
+        kept = end - start;
+        memmove(block, block + start, kept);
+        from += start;
+    }
+
+    free(block);
+    return result;
+}
+
+// Like view_search_forward(), but going back from the line ending before TO.
+// The lines of each block are still scanned forward, keeping the last match.
+off_t view_search_backward(View *view, Pattern *pattern, off_t to, size_t *x)
+{
+    char *block = malloc(VIEW_BLOCK);
+    assert(block);
+
+    off_t result = -1;
+    while (result == -1 && to > 0 && !view_interrupted()) {
+        const off_t base = to > VIEW_BLOCK ? to - VIEW_BLOCK : 0;
+        const ssize_t size = pread(view->fd, block, to - base, base);
+        if (size <= 0) {
+            break;
+        }
+
+        // The line the block starts in is left for the next one, unless it
+        // alone fills the block
+        size_t first = 0;
+        if (base) {
+            const char *newline = memchr(block, '\n', size);
+            first = newline && newline + 1 < block + size ? (size_t) (newline - block) + 1 : 0;
+        }
+
+        String found = {0};
+        for (size_t at = first; at < (size_t) size;) {
+            const char *newline = memchr(block + at, '\n', size - at);
+            const size_t stop = newline ? (size_t) (newline - block) : (size_t) size;
+            const String line = {.data = block + at, .size = stop - at};
+            size_t column = 0;
+            if (pattern_search_forward(pattern, line, &column)) {
+                found = line;
+            }
+            at = stop + 1;
+        }
+
+        if (found.data) {
+            *x = found.size;
+            pattern_search_backward(pattern, found, x);
+            result = base + (found.data - block);
+        }
+        to = base + first;
+    }
+
+    free(block);
+    return result;
+}
+
+// Undo
+// Build with -DUNDO_BUDGET=<bytes> to keep more or less history
+#ifndef UNDO_BUDGET
+#define UNDO_BUDGET (64 << 20)
+#endif
+
+// A change is kept as the lines it replaced. Undoing it swaps them with the
+// lines standing for it in the buffer, which it then keeps, so that the same
+// swap redoes it. A sparse change replaced single lines here and there, the
+// ones at YS, like a replace-all does. A change JOINED to the one before it
+// was made along with it, and is undone and redone with it.
+typedef struct {
+    bool sparse;
+    bool joined;
+    size_t y;
+    size_t span;
+
+    String *lines;
+    size_t *ys;
+    size_t count;
+
+    Vector cursor;
+    size_t bytes;
+} Change;
+
+typedef struct {
+    Change *items;
+    size_t count;
+    size_t capacity;
+
+    // The changes before it are undone next, the ones from it on redone
+    size_t current;
+    size_t bytes;
+
+    bool pending;
+    bool applying;
+    bool typing;
+
+    // The hash of the contents before the first change, and of the ones
+    // after the first SYNCED changes, which are in the history file. SAVING
+    // changes are being saved. See History.
+    uint64_t root;
+    uint64_t synced_hash;
+    size_t synced;
+    size_t saving;
+    bool rooted;
+    bool is_synced;
+    bool is_saving;
+    bool loaded;
+} Undo;
+
+void change_measure(Change *change)
+{
+    change->bytes = sizeof(Change) + change->count * (sizeof(String) + (change->sparse ? sizeof(size_t) : 0));
+    for (size_t i = 0; i < change->count; ++i) {
+        change->bytes += change->lines[i].size;
+    }
+}
+
+void change_free(Change *change)
+{
+    for (size_t i = 0; i < change->count; ++i) {
+        string_free(change->lines + i);
+    }
+    free(change->lines);
+    free(change->ys);
+    memset(change, 0, sizeof(Change));
+}
+
+// Drop the changes from INDEX on
+void undo_truncate(Undo *undo, size_t index)
+{
+    for (size_t i = index; i < undo->count; ++i) {
+        undo->bytes -= undo->items[i].bytes;
+        change_free(undo->items + i);
+    }
+    undo->count = index;
+    undo->current = MIN(undo->current, index);
+    undo->is_synced = undo->is_synced && undo->synced <= index;
+    undo->is_saving = undo->is_saving && undo->saving <= index;
+}
+
+void undo_free(Undo *undo)
+{
+    undo_truncate(undo, 0);
+    free(undo->items);
+    memset(undo, 0, sizeof(Undo));
+}
+
+// Start a new change made at CURSOR, which forgets the ones undone
+Change *undo_push(Undo *undo, Vector cursor)
+{
+    undo_truncate(undo, undo->current);
+    if (undo->count == undo->capacity) {
+        undo->capacity += INC_CAP;
+        undo->items = realloc(undo->items, undo->capacity * sizeof(Change));
+        assert(undo->items);
+    }
+
+    Change *change = undo->items + undo->count++;
+    memset(change, 0, sizeof(Change));
+    change->cursor = cursor;
+    undo->current = undo->count;
+    undo->pending = true;
+    return change;
+}
+
+// Forget the oldest changes once the history grows past UNDO_BUDGET, always
+// keeping the last one. It goes down to three quarters of it, so that the
+// changes are not moved along on every one made past the budget.
+void undo_trim(Undo *undo)
+{
+    if (undo->bytes <= UNDO_BUDGET) {
+        return;
+    }
+
+    // Changes joined together go together
+    size_t drop = 0;
+    while ((undo->bytes > UNDO_BUDGET / 4 * 3 || undo->items[drop].joined) && drop + 1 < undo->current) {
+        undo->bytes -= undo->items[drop].bytes;
+        change_free(undo->items + drop++);
+    }
+
+    if (drop) {
+        memmove(undo->items, undo->items + drop, (undo->count - drop) * sizeof(Change));
+        undo->count -= drop;
+        undo->current -= drop;
+        undo->rooted = false;
+        undo->is_synced = undo->is_synced && undo->synced >= drop;
+        undo->synced -= MIN(undo->synced, drop);
+        undo->is_saving = undo->is_saving && undo->saving >= drop;
+        undo->saving -= MIN(undo->saving, drop);
+    }
+}
+
+// Buffer
+// The cursors added to the main one of a buffer, in order, see Cursors
+typedef struct {
+    Vector *items;
+    size_t count;
+    size_t capacity;
+} Cursors;
+
+typedef struct {
+    String *lines;
+    size_t count;
+    size_t capacity;
+
+    // Lines dropped near the top leave GAP unused ones before LINES in its
+    // array, see buffer_resize_lines()
+    size_t gap;
+
+    bool region;
+    bool rectangle;
+    Vector cursor;
+    Vector marker;
+    Cursors cursors;
+
+    String path;
+    Vector anchor;
+    size_t syntax;
+
+    Hashes hashes;
+    Undo undo;
+    struct Save *save;
+    struct Journal *journal;
+    struct Load *load;
+    View *view;
+    Chunks *chunks;
+    Lenders lenders;
+    Stream *stream;
+    Follow *follow;
+
+    int watch;
+    struct stat disk;
+
+    bool locations;
+    Matches matches;
+    Trigrams trigrams;
+} Buffer;
+
+void journal_free(struct Journal *journal);
+
+void buffer_free(Buffer *buffer)
+{
+    if (buffer->stream) {
+        stream_close(buffer->stream, SIGKILL);
+    }
+    if (buffer->follow) {
+        follow_close(buffer->follow);
+    }
+    if (buffer->journal) {
+        journal_free(buffer->journal);
+    }
+    if (buffer->view) {
+        view_close(buffer->view);
+    }
+    chunks_release(buffer->chunks);
+    lenders_free(&buffer->lenders);
+
+    for (size_t i = 0; i < buffer->count; ++i) {
+        string_free(buffer->lines + i);
+    }
+    free(buffer->gap ? buffer->lines - buffer->gap : buffer->lines);
+    matches_free(&buffer->matches);
+    trigrams_free(&buffer->trigrams);
+    hashes_free(&buffer->hashes);
+    undo_free(&buffer->undo);
+    free(buffer->cursors.items);
+    memset(buffer, 0, sizeof(Buffer));
+}
+
+void buffer_grow(Buffer *buffer, size_t size)
+{
+    if (size >= buffer->capacity && buffer->gap) {
+        memmove(buffer->lines - buffer->gap, buffer->lines, buffer->count * sizeof(String));
+        buffer->lines -= buffer->gap;
+        buffer->capacity += buffer->gap;
+        buffer->gap = 0;
+    }
+
+    if (size >= buffer->capacity) {
+        buffer->capacity = MAX(buffer->capacity + INC_CAP, size);
+        buffer->lines = realloc(buffer->lines, buffer->capacity * sizeof(String));
+        assert(buffer->lines);
+    }
+}
+
+void buffer_push(Buffer *buffer, String line)
+{
+    buffer_grow(buffer, buffer->count + 1);
+    buffer->lines[buffer->count++] = line;
+}
+
+// Make room for ADDED lines from Y in place of the REMOVED ones there, which
+// were freed or moved elsewhere, leaving the new ones to be filled in. When
+// lines go, the ones before them move down instead of the ones after if
+// there are fewer, so that dropping lines near the top is as quick as near
+// the bottom.
+void buffer_resize_lines(Buffer *buffer, size_t y, size_t removed, size_t added)
+{
+    const size_t after = buffer->count - y - removed;
+    if (added > removed) {
+        buffer_grow(buffer, buffer->count - removed + added);
+        memmove(buffer->lines + y + added, buffer->lines + y + removed, after * sizeof(String));
+    } else if (y < after) {
+        const size_t drop = removed - added;
+        memmove(buffer->lines + drop, buffer->lines, y * sizeof(String));
+        buffer->lines += drop;
+        buffer->gap += drop;
+        buffer->capacity -= drop;
+    } else {
+        memmove(buffer->lines + y + added, buffer->lines + y + removed, after * sizeof(String));
+    }
+    buffer->count = buffer->count - removed + added;
+}
+
+// Edits to ranges of lines here and there are made one range at a time, each
+// one moving the lines after it. Ranges less than RANGES_GAP lines apart are
+// made as one instead, which costs less than moving the lines again, and so
+// are the closest ones past RANGES_MAX ranges.
+#ifndef RANGES_GAP
+#define RANGES_GAP 256
+#endif
+
+#ifndef RANGES_MAX
+#define RANGES_MAX 64
+#endif
+
+int size_compare_down(const void *a, const void *b)
+{
+    const size_t u = *(const size_t *) a, v = *(const size_t *) b;
+    return u < v ? 1 : -(u > v);
+}
+
+// Mark in APART which of the COUNT GAPS, the lines between one range of lines
+// and the next, the ranges are edited apart at
+void ranges_apart(const size_t *gaps, size_t count, bool *apart)
+{
+    // Past RANGES_MAX ranges only the widest gaps split them, the first of the
+    // ones as wide as the narrowest of these going first
+    size_t least = RANGES_GAP, ties = count;
+    if (count >= RANGES_MAX) {
+        size_t *sorted = malloc(count * sizeof(size_t));
+        assert(sorted);
+        memcpy(sorted, gaps, count * sizeof(size_t));
+        qsort(sorted, count, sizeof(size_t), size_compare_down);
+        least = MAX(least, sorted[RANGES_MAX - 2]);
+        ties = 0;
+        for (size_t i = 0; i < RANGES_MAX - 1; ++i) {
+            ties += sorted[i] == least;
+        }
+        free(sorted);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        apart[i] = gaps[i] > least || (gaps[i] == least && ties && ties--);
+    }
+}
+
+// Add the Chunks the lines of BUFFER and of its history may borrow from to
+// LENDERS
+void buffer_lenders(const Buffer *buffer, Lenders *lenders)
+{
+    if (buffer->chunks) {
+        lenders_add(lenders, buffer->chunks);
+    }
+    lenders_add_all(lenders, &buffer->lenders);
+}
+
+// The offset in the file of line Y of the window of a view
+off_t buffer_view_offset(Buffer *buffer, size_t y)
+{
+    View *view = buffer->view;
+    return y < buffer->count ? view->base + (buffer->lines[y].data - view->window) : view->end;
+}
+
+// Read the window of the view of BUFFER around TARGET, putting the cursor on
+// column X of the line containing it
+void buffer_view_seek(Buffer *buffer, off_t target, size_t x)
+{
+    View *view = buffer->view;
+    const off_t base = target > VIEW_WINDOW / 2 ? target - VIEW_WINDOW / 2 : 0;
+    ssize_t size = pread(view->fd, view->window, VIEW_WINDOW, base);
+    if (size < 0) {
+        size = 0;
+    }
+
+    const char *window = view->window;
+    const size_t position = MIN(target - base, size);
+
+    // Start at a line, unless the target is in the first one read
+    size_t start = 0;
+    if (base) {
+        const char *newline = memchr(window, '\n', position);
+        if (newline) {
+            start = newline - window + 1;
+        }
+    }
+
+    // Keep the target in the first half of the lines
+    size_t before = 0;
+    for (const char *p = window + start; (p = memchr(p, '\n', window + position - p)); ++p) {
+        before++;
+    }
+    while (before > VIEW_LINES / 2) {
+        start = (const char *) memchr(window + start, '\n', position - start) - window + 1;
+        before--;
+    }
+
+    const bool last = base + size >= view->size;
+    size_t count = 0, y = 0, at = start;
+    buffer_grow(buffer, VIEW_LINES);
+    while (at < (size_t) size && count < VIEW_LINES) {
+        const char *newline = memchr(window + at, '\n', size - at);
+
+        // The line goes on past the window, unless it alone fills it
+        if (!newline && !last && count) {
+            break;
+        }
+
+        const size_t stop = newline ? (size_t) (newline - window) : (size_t) size;
+        buffer->lines[count] = (String) {
+            .data = view->window + at,
+            .size = stop - at,
+            .capacity = STRING_BORROWED,
+        };
+        if (at <= position) {
+            y = count;
+        }
+        count++;
+        at = stop + 1;
+    }
+
+    // Number the lines from the index, or from the window before
+    const off_t first = base + start;
+    size_t line = view_line_at(view, first);
+    if (line == VIEW_UNKNOWN && view->line != VIEW_UNKNOWN) {
+        if (first >= view->start && first - view->start <= 2 * VIEW_WINDOW) {
+            line = view->line + view_count_lines(view, view->start, first);
+        } else if (first < view->start && view->start - first <= 2 * VIEW_WINDOW) {
+            line = view->line - view_count_lines(view, first, view->start);
+        }
+    }
+
+    view->base = base;
+    view->start = first;
+    view->end = base + MIN(at, (size_t) size);
+    view->line = line;
+
+    buffer->count = count;
+    buffer->cursor = Vector(count ? MIN(x, buffer->lines[y].size) : 0, y);
+    buffer->region = false;
+    buffer->matches.valid = false;
+}
+
+void buffer_open(Buffer *buffer)
+{
+    String path = buffer->path;
+    buffer_free(buffer);
+    buffer->path = path;
+
+    const int fd = open(buffer->path.data, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1) {
+        close(fd);
+        return;
+    }
+
+    if ((size_t) statbuf.st_size >= view_auto_size()) {
+        buffer->view = view_new(fd, statbuf.st_size);
+        buffer->disk = statbuf;
+        buffer_view_seek(buffer, 0, 0);
+        return;
+    }
+
+    SV contents = {0};
+    contents.size = statbuf.st_size;
+
+    contents.data = mmap(NULL, contents.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (contents.data == MAP_FAILED) {
+        return;
+    }
+
+    char *head = (char *) contents.data;
+    while (contents.size) {
+        const SV line = sv_split(&contents, '\n');
+        buffer_push(buffer, string(line.data, line.size));
+    }
+
+    munmap(head, statbuf.st_size);
+    buffer->disk = statbuf;
+
+    Hashes *hashes = &buffer->hashes;
+    hashes_reset(hashes, buffer->lines, buffer->count);
+    uint64_t *saved = malloc(MAX(buffer->count, 1) * sizeof(uint64_t));
+    assert(saved);
+    memcpy(saved, hashes->items, buffer->count * sizeof(uint64_t));
+    hashes_save(hashes, saved, buffer->count);
+
+    Undo *undo = &buffer->undo;
+    undo->root = undo->synced_hash = hashes_content(saved, buffer->count);
+    undo->rooted = undo->is_synced = true;
+
+    if (statbuf.st_size >= TRIGRAM_AUTO_SIZE) {
+        trigrams_reset(&buffer->trigrams, buffer->count);
+    }
+}
+
+void buffer_detect_syntax(Buffer *buffer)
+{
+    SV path = sv_rtrim(sv(buffer->path.data, buffer->path.size), '\0');
+    for (size_t i = 1; i < syntaxes_count; ++i) {
+        if (sv_list_find(syntaxes[i].filenames, path)) {
+            buffer->syntax = i;
+            return;
+        }
+    }
+
+    sv_split(&path, '.');
+    for (size_t i = 1; i < syntaxes_count; ++i) {
+        if (sv_list_find(syntaxes[i].extensions, path)) {
+            buffer->syntax = i;
+            return;
+        }
+    }
+
+    buffer->syntax = 0;
+}
+
+#define SAVE_CHUNK (1 << 20)
+
+// Build with -DSAVE_FSYNC=0 to trade durability for faster saves
+#ifndef SAVE_FSYNC
+#define SAVE_FSYNC 1
+#endif
+
+// Write all of the vectors, resuming after short writes
+bool write_all(int fd, struct iovec *iov, int count)
+{
+    while (count) {
+        const ssize_t written = writev(fd, iov, count);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        size_t left = written;
+        while (count && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if (count) {
+            iov->iov_base = (char *) iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return true;
+}
+
+// Lines are staged into chunks of SAVE_CHUNK bytes, a line that does not fit
+// goes out directly in the same writev as the chunk before it
+bool save_lines(int fd, const String *lines, size_t count)
+{
+    char *chunk = malloc(SAVE_CHUNK);
+    assert(chunk);
+
+    size_t size = 0;
+    bool ok = true;
+    for (size_t i = 0; ok && i < count; ++i) {
+        const String line = lines[i];
+        if (size + line.size + 1 <= SAVE_CHUNK) {
+            memcpy(chunk + size, line.data, line.size);
+            chunk[size + line.size] = '\n';
+            size += line.size + 1;
+        } else {
+            struct iovec iov[] = {{chunk, size}, {line.data, line.size}, {"\n", 1}};
+            ok = write_all(fd, iov, 3);
+            size = 0;
+        }
+    }
+
+    if (ok && size) {
+        struct iovec iov = {chunk, size};
+        ok = write_all(fd, &iov, 1);
+    }
+
+    free(chunk);
+    return ok;
+}
+
+// The lines are written to a temporary file next to the target which is then
+// renamed over it, so the file on disk is always either the old or the new one
+bool save_file(const char *file, const String *lines, size_t count)
+{
+    // Replace the file a symlink points to rather than the symlink itself
+    char *target = realpath(file, NULL);
+    const char *path = target ? target : file;
+
+    const char *slash = strrchr(path, '/');
+    const int directory = slash ? slash - path + 1 : 0;
+    const size_t size = strlen(path) + sizeof(".~XXXXXX");
+    char *temp = malloc(size);
+    assert(temp);
+    snprintf(temp, size, "%.*s.%s~XXXXXX", directory, path, path + directory);
+
+    bool ok = false;
+    const int fd = mkstemp(temp);
+    if (fd != -1) {
+        struct stat statbuf;
+        if (stat(path, &statbuf) == 0) {
+            // Only the owner may give the file away, otherwise it is ours now
+            (void) fchown(fd, statbuf.st_uid, statbuf.st_gid);
+            ok = fchmod(fd, statbuf.st_mode & 07777) == 0;
+        } else {
+            const mode_t mask = umask(0);
+            umask(mask);
+            ok = fchmod(fd, 0666 & ~mask) == 0;
+        }
+
+        ok = ok && save_lines(fd, lines, count) && (!SAVE_FSYNC || fsync(fd) == 0);
+        ok = close(fd) == 0 && ok;
+        ok = ok && rename(temp, path) == 0;
+
+        if (!ok) {
+            const int error = errno;
+            unlink(temp);
+            errno = error;
+        } else if (SAVE_FSYNC) {
+            // Make the rename itself durable
+            char *parent = directory ? strndup(path, directory) : strdup(".");
+            assert(parent);
+            const int dir = open(parent, O_RDONLY | O_DIRECTORY);
+            if (dir != -1) {
+                fsync(dir);
+                close(dir);
+            }
+            free(parent);
+        }
+    } else if (errno == EACCES) {
+        // The directory is not writable but the file may still be
+        const int fd = open(path, O_WRONLY | O_TRUNC);
+        if (fd != -1) {
+            ok = save_lines(fd, lines, count);
+            ok = close(fd) == 0 && ok;
+        }
+    }
+
+    free(temp);
+    free(target);
+    return ok;
+}
+
+// Journal
+#define JOURNAL_MAGIC "menojnl1"
+#define JOURNAL_INTERVAL 250
+
+// The changes made to a buffer since it last matched its file, appended to
+// a file next to it so that they can be recovered if meno does not exit
+// cleanly. A record replaces a range of lines with new ones:
+//
+//   varint y, varint removed, varint added, (varint size, bytes) * added,
+//   u64 hash of the record so far
+//
+// Records are collected in memory and written together, then synced on a
+// worker, at most JOURNAL_INTERVAL milliseconds after the first of them.
+typedef struct Journal {
+    char *path;
+    int fd;
+    String pending;
+    uint64_t since;
+
+    // The file the changes apply to
+    struct stat disk;
+} Journal;
+
+typedef struct {
+    char magic[8];
+    uint64_t size;
+    uint64_t ino;
+    int64_t sec;
+    int64_t nsec;
+} JournalHeader;
+
+JournalHeader journal_header(const struct stat *disk)
+{
+    JournalHeader header = {
+        .size = disk->st_size,
+        .ino = disk->st_ino,
+        .sec = disk->st_mtim.tv_sec,
+        .nsec = disk->st_mtim.tv_nsec,
+    };
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    return header;
+}
+
+// The file .FILE~SUFFIX next to FILE
+char *sidecar_path(const char *file, const char *suffix)
+{
+    const char *slash = strrchr(file, '/');
+    const int directory = slash ? slash - file + 1 : 0;
+    const size_t size = strlen(file) + strlen(suffix) + sizeof(".~");
+    char *path = malloc(size);
+    assert(path);
+    snprintf(path, size, "%.*s.%s~%s", directory, file, file + directory, suffix);
+    return path;
+}
+
+// The journal of FILE, whose contents are described by DISK, is .FILE~journal
+Journal *journal_new(const char *file, const struct stat *disk)
+{
+    Journal *journal = calloc(1, sizeof(Journal));
+    assert(journal);
+
+    journal->path = sidecar_path(file, "journal");
+    journal->fd = -1;
+    journal->disk = *disk;
+    return journal;
+}
+
+void journal_free(Journal *journal)
+{
+    if (journal->fd != -1) {
+        close(journal->fd);
+    }
+    string_free(&journal->pending);
+    free(journal->path);
+    free(journal);
+}
+
+// Forget the changes recorded so far, the buffer now matches DISK
+void journal_discard(Journal *journal, const struct stat *disk)
+{
+    if (journal->fd != -1) {
+        close(journal->fd);
+        journal->fd = -1;
+    }
+    unlink(journal->path);
+    journal->pending.size = 0;
+    journal->since = 0;
+    journal->disk = *disk;
+}
+
+void journal_push_varint(String *out, uint64_t value)
+{
+    char bytes[10];
+    size_t size = 0;
+    do {
+        bytes[size++] = (value & 0x7f) | (value >= 0x80 ? 0x80 : 0);
+        value >>= 7;
+    } while (value);
+    string_insert(out, out->size, bytes, size);
+}
+
+bool journal_read_varint(SV *view, uint64_t *value)
+{
+    *value = 0;
+    for (size_t i = 0; i < 10 && i < view->size; ++i) {
+        const unsigned char byte = view->data[i];
+        *value |= (uint64_t) (byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            view->data += i + 1;
+            view->size -= i + 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Lines [Y, Y + REMOVED) were replaced by [Y, Y + ADDED) in LINES
+void journal_record(Journal *journal, const String *lines, size_t y, size_t removed, size_t added)
+{
+    String *out = &journal->pending;
+    const size_t start = out->size;
+
+    size_t size = start + 40;
+    for (size_t i = y; i < y + added; ++i) {
+        size += lines[i].size + 10;
+    }
+    if (size > out->capacity) {
+        string_grow(out, size);
+    }
+
+    journal_push_varint(out, y);
+    journal_push_varint(out, removed);
+    journal_push_varint(out, added);
+    for (size_t i = y; i < y + added; ++i) {
+        journal_push_varint(out, lines[i].size);
+        if (lines[i].size) {
+            string_insert(out, out->size, lines[i].data, lines[i].size);
+        }
+    }
+
+    const uint64_t hash = hash_line((String) {.data = out->data + start, .size = out->size - start});
+    string_insert(out, out->size, (const char *) &hash, sizeof(hash));
+
+    if (!journal->since) {
+        journal->since = clock_ns();
+    }
+}
+
+void journal_sync_task(void *arg)
+{
+    const int fd = (intptr_t) arg;
+    fsync(fd);
+    close(fd);
+}
+
+// Append the pending records to the journal, which is created along with
+// the first of them
+void journal_write(Journal *journal)
+{
+    if (!journal->pending.size) {
+        return;
+    }
+
+    JournalHeader header = journal_header(&journal->disk);
+    struct iovec iov[] = {{&header, sizeof(header)}, {journal->pending.data, journal->pending.size}};
+    bool ok = true;
+    if (journal->fd == -1) {
+        journal->fd = open(journal->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        ok = journal->fd != -1 && write_all(journal->fd, iov, 2);
+    } else {
+        ok = write_all(journal->fd, iov + 1, 1);
+    }
+    journal->pending.size = 0;
+    journal->since = 0;
+
+    const int fd = ok ? dup(journal->fd) : -1;
+    if (fd != -1) {
+        pool_submit(journal_sync_task, (void *) (intptr_t) fd, NULL);
+    }
+}
+
+// History
+#define HISTORY_MAGIC "menoundo"
+#define HISTORY_LIMIT (2 * (off_t) UNDO_BUDGET)
+
+// The undo history of a file is appended to .FILE~undo each time the file
+// is saved. A record holds the changes that turn contents with the hash
+// PARENT into the ones with the hash SAVED, as they were done:
+//
+//   u64 parent, u64 saved, varint changes,
+//   (varint sparse | joined << 1, varint y, varint span, varint x,
+//    varint y of the cursor, varint lines, varint ys * lines if sparse,
+//    (varint size, bytes) * lines) * changes, u64 hash of the record so far
+//
+// The history of a file is then found by following the records back from
+// the hash of its contents, so a record is never rewritten. It is only read
+// when undo is first asked for past the changes of the session.
+typedef struct {
+    uint64_t parent;
+    uint64_t saved;
+    SV changes;
+} HistoryRecord;
+
+void history_push_change(String *out, const Change *change)
+{
+    journal_push_varint(out, change->sparse | change->joined << 1);
+    journal_push_varint(out, change->y);
+    journal_push_varint(out, change->span);
+    journal_push_varint(out, change->cursor.x);
+    journal_push_varint(out, change->cursor.y);
+    journal_push_varint(out, change->count);
+    for (size_t i = 0; change->sparse && i < change->count; ++i) {
+        journal_push_varint(out, change->ys[i]);
+    }
+    for (size_t i = 0; i < change->count; ++i) {
+        journal_push_varint(out, change->lines[i].size);
+        if (change->lines[i].size) {
+            string_insert(out, out->size, change->lines[i].data, change->lines[i].size);
+        }
+    }
+}
+
+bool history_read_change(SV *view, Change *change)
+{
+    uint64_t flags, y, span, x, cursor, count;
+    if (!journal_read_varint(view, &flags) || !journal_read_varint(view, &y) ||
+        !journal_read_varint(view, &span) || !journal_read_varint(view, &x) ||
+        !journal_read_varint(view, &cursor) || !journal_read_varint(view, &count) || count > view->size) {
+        return false;
+    }
+
+    memset(change, 0, sizeof(Change));
+    change->sparse = flags & 1;
+    change->joined = flags >> 1 & 1;
+    change->y = y;
+    change->span = span;
+    change->cursor = Vector(x, cursor);
+    change->lines = calloc(MAX(count, 1), sizeof(String));
+    change->ys = change->sparse ? malloc(MAX(count, 1) * sizeof(size_t)) : NULL;
+    assert(change->lines && (change->ys || !change->sparse));
+
+    bool ok = true;
+    for (size_t i = 0; ok && change->sparse && i < count; ++i) {
+        uint64_t line;
+        ok = journal_read_varint(view, &line);
+        change->ys[i] = line;
+    }
+    for (size_t i = 0; ok && i < count; ++i) {
+        uint64_t size;
+        ok = journal_read_varint(view, &size) && size <= view->size;
+        if (ok) {
+            change->lines[i] = string(view->data, size);
+            change->count++;
+            view->data += size;
+            view->size -= size;
+        }
+    }
+
+    if (!ok) {
+        change_free(change);
+        return false;
+    }
+    change_measure(change);
+    return true;
+}
+
+// The record of the changes of UNDO since they were last saved, which are
+// saved next. Its hash and the one of the contents saved are left to
+// history_append(). Empty if the changes do not go on from saved contents.
+String history_record(Undo *undo)
+{
+    String record = {0};
+    size_t from = 0;
+    uint64_t parent = undo->root;
+    if (undo->is_synced && undo->synced <= undo->current) {
+        from = undo->synced;
+        parent = undo->synced_hash;
+    } else if (!undo->rooted) {
+        return record;
+    }
+
+    if (from < undo->current) {
+        const uint64_t saved = 0;
+        string_insert(&record, record.size, (const char *) &parent, sizeof(parent));
+        string_insert(&record, record.size, (const char *) &saved, sizeof(saved));
+        journal_push_varint(&record, undo->current - from);
+        for (size_t i = from; i < undo->current; ++i) {
+            history_push_change(&record, undo->items + i);
+        }
+    }
+    return record;
+}
+
+// Append RECORD to the history of FILE, whose contents now have the hash
+// SAVED. A history grown past HISTORY_LIMIT starts over.
+void history_append(const char *file, String *record, uint64_t saved)
+{
+    memcpy(record->data + sizeof(uint64_t), &saved, sizeof(saved));
+    const uint64_t hash = hash_line(*record);
+    string_insert(record, record->size, (const char *) &hash, sizeof(hash));
+
+    char *path = sidecar_path(file, "undo");
+    const int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    free(path);
+    if (fd == -1) {
+        return;
+    }
+
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == 0 && (statbuf.st_size == 0 || statbuf.st_size > HISTORY_LIMIT) &&
+        ftruncate(fd, 0) == 0) {
+        struct iovec iov[] = {{HISTORY_MAGIC, sizeof(HISTORY_MAGIC) - 1}, {record->data, record->size}};
+        write_all(fd, iov, 2);
+    } else {
+        struct iovec iov = {record->data, record->size};
+        write_all(fd, &iov, 1);
+    }
+    close(fd);
+}
+
+// Put the changes that led to the contents BUFFER was opened with before
+// the ones made since, as far as the history of its file and UNDO_BUDGET go
+size_t buffer_history_load(Buffer *buffer)
+{
+    Undo *undo = &buffer->undo;
+    if (undo->loaded || !undo->rooted) {
+        undo->loaded = true;
+        return 0;
+    }
+    undo->loaded = true;
+
+    char *path = sidecar_path(buffer->path.data, "undo");
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    struct stat statbuf;
+    if (fd == -1 || fstat(fd, &statbuf) == -1 || (size_t) statbuf.st_size <= sizeof(HISTORY_MAGIC) - 1) {
+        if (fd != -1) close(fd);
+        return 0;
+    }
+
+    char *data = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return 0;
+    }
+
+    // Index the records that are whole, up to the first that is not
+    HistoryRecord *records = NULL;
+    size_t count = 0, capacity = 0;
+    SV view = sv(data, statbuf.st_size);
+    if (!memcmp(data, HISTORY_MAGIC, sizeof(HISTORY_MAGIC) - 1)) {
+        view.data += sizeof(HISTORY_MAGIC) - 1;
+        view.size -= sizeof(HISTORY_MAGIC) - 1;
+    } else {
+        view.size = 0;
+    }
+
+    while (view.size > 2 * sizeof(uint64_t)) {
+        HistoryRecord record;
+        memcpy(&record.parent, view.data, sizeof(uint64_t));
+        memcpy(&record.saved, view.data + sizeof(uint64_t), sizeof(uint64_t));
+        SV rest = sv(view.data + 2 * sizeof(uint64_t), view.size - 2 * sizeof(uint64_t));
+        record.changes = rest;
+
+        uint64_t changes;
+        bool ok = journal_read_varint(&rest, &changes);
+        for (uint64_t i = 0; ok && i < changes; ++i) {
+            Change change;
+            ok = history_read_change(&rest, &change);
+            if (ok) {
+                change_free(&change);
+            }
+        }
+
+        uint64_t hash;
+        if (!ok || rest.size < sizeof(hash)) {
+            break;
+        }
+        memcpy(&hash, rest.data, sizeof(hash));
+        if (hash != hash_line((String) {.data = (char *) view.data, .size = rest.data - view.data})) {
+            break;
+        }
+
+        if (count == capacity) {
+            capacity += INC_CAP;
+            records = realloc(records, capacity * sizeof(HistoryRecord));
+            assert(records);
+        }
+        record.changes.size = rest.data - record.changes.data;
+        records[count++] = record;
+        view = sv(rest.data + sizeof(hash), rest.size - sizeof(hash));
+    }
+
+    // Follow the records back from the contents the buffer was opened with,
+    // checking that each change fits the lines it is undone on
+    size_t lines = buffer->count;
+    for (size_t i = 0; i < undo->current; ++i) {
+        const Change *change = undo->items + i;
+        lines = change->sparse ? lines : lines - change->span + change->count;
+    }
+
+    Change *loaded = NULL;
+    size_t total = 0, room = 0, bytes = 0;
+    size_t next = count;
+    uint64_t hash = undo->root;
+    bool partial = false;
+    while (bytes < UNDO_BUDGET - MIN(undo->bytes, UNDO_BUDGET)) {
+        while (next && records[next - 1].saved != hash) {
+            next--;
+        }
+        if (!next) {
+            break;
+        }
+
+        const HistoryRecord *record = records + --next;
+        SV changes = record->changes;
+        uint64_t size;
+        journal_read_varint(&changes, &size);
+
+        Change *items = calloc(MAX(size, 1), sizeof(Change));
+        assert(items);
+        for (size_t i = 0; i < size; ++i) {
+            history_read_change(&changes, items + i);
+        }
+
+        // Undone from the last one on, each change has to fit the lines it
+        // left behind
+        size_t fit = size, left = lines;
+        for (size_t i = size; i-- > 0;) {
+            const Change *change = items + i;
+            bool ok = change->sparse ? true : change->y + change->span <= left;
+            for (size_t j = 0; change->sparse && j < change->count; ++j) {
+                ok = ok && change->ys[j] < left;
+            }
+            if (!ok) {
+                break;
+            }
+            left = change->sparse ? left : left - change->span + change->count;
+            fit = i;
+        }
+
+        for (size_t i = 0; i < fit; ++i) {
+            change_free(items + i);
+        }
+
+        if (total + size - fit > room) {
+            room = MAX(room + INC_CAP, total + size - fit);
+            loaded = realloc(loaded, room * sizeof(Change));
+            assert(loaded);
+        }
+
+        // LOADED is kept from the newest change to the oldest
+        for (size_t i = size; i-- > fit;) {
+            bytes += items[i].bytes;
+            loaded[total++] = items[i];
+        }
+        free(items);
+
+        lines = left;
+        hash = record->parent;
+        if (fit) {
+            partial = true;
+            break;
+        }
+    }
+
+    free(records);
+    munmap(data, statbuf.st_size);
+
+    if (total) {
+        if (undo->count + total > undo->capacity) {
+            undo->capacity = undo->count + total + INC_CAP;
+            undo->items = realloc(undo->items, undo->capacity * sizeof(Change));
+            assert(undo->items);
+        }
+        memmove(undo->items + total, undo->items, undo->count * sizeof(Change));
+        for (size_t i = 0; i < total; ++i) {
+            undo->items[i] = loaded[total - 1 - i];
+        }
+
+        undo->count += total;
+        undo->current += total;
+        undo->synced += total;
+        undo->saving += total;
+        undo->bytes += bytes;
+        undo->root = hash;
+        undo->rooted = !partial;
+    }
+    free(loaded);
+    return total;
+}
+
+void buffer_anchor_fix(Buffer *buffer)
+{
+    if (term.deferred) {
+        return;
+    }
+
+    const Vector limit = vector_add(buffer->anchor, term.size);
+
+    if (buffer->cursor.y >= limit.y) {
+        buffer->anchor.y += buffer->cursor.y - limit.y + 1;
+    } else if (buffer->cursor.y < buffer->anchor.y) {
+        buffer->anchor.y -= buffer->anchor.y - buffer->cursor.y;
+    }
+
+    if (buffer->cursor.x >= limit.x) {
+        buffer->anchor.x += buffer->cursor.x - limit.x + 1;
+    } else if (buffer->cursor.x < buffer->anchor.x) {
+        buffer->anchor.x -= buffer->anchor.x - buffer->cursor.x;
+    }
+}
+
+// Lines [Y, Y + REMOVED) of BUFFER were replaced by [Y, Y + ADDED)
+void buffer_changed(Buffer *buffer, size_t y, size_t removed, size_t added)
+{
+    if (!buffer->locations) {
+        hashes_changed(&buffer->hashes, buffer->lines, buffer->count, y, removed, added);
+    }
+
+    if (buffer->journal) {
+        journal_record(buffer->journal, buffer->lines, y, removed, added);
+    }
+
+    // Changes made without buffer_record() move the lines the history
+    // refers to, unless they only append to the buffer, and break the chain
+    // of contents it is saved as
+    Undo *undo = &buffer->undo;
+    if (undo->pending) {
+        undo->pending = false;
+        undo->items[undo->current - 1].span += added - removed;
+        undo_trim(undo);
+    } else if (!undo->applying) {
+        if (undo->count && (removed || y + added != buffer->count)) {
+            undo_truncate(undo, 0);
+        }
+        undo->rooted = false;
+        undo->is_synced = false;
+        undo->is_saving = false;
+    }
+
+    if (buffer->trigrams.enabled) {
+        trigrams_changed(&buffer->trigrams, buffer->lines, y, removed, added);
+    }
+
+    Matches *matches = &buffer->matches;
+    if (matches->valid && added > MATCHES_CHUNK) {
+        matches->valid = false;
+    } else if (matches->valid) {
+        const size_t start = matches_find(matches, Vector(0, y));
+        const size_t end = matches_find(matches, Vector(0, y + removed));
+
+        Matches found = {0};
+        for (size_t i = y; i < y + added; ++i) {
+            matches_scan(&found, &matches->pattern, buffer->lines[i], i);
+        }
+
+        const size_t count = matches->count - (end - start) + found.count;
+        matches_grow(matches, count);
+        memmove(matches->items + start + found.count, matches->items + end, (matches->count - end) * sizeof(Match));
+        if (found.count) {
+            memcpy(matches->items + start, found.items, found.count * sizeof(Match));
+        }
+        matches->count = count;
+
+        if (added != removed) {
+            for (size_t i = start + found.count; i < count; ++i) {
+                matches->items[i].position.y += added - removed;
+            }
+        }
+
+        free(found.items);
+    }
+}
+
+// Whether the lines of BUFFER differ from the ones in its file
+bool buffer_modified(Buffer *buffer)
+{
+    return !buffer->locations && !buffer->view && hashes_modified(&buffer->hashes);
+}
+
+// Keep the REMOVED lines from Y, which are about to be replaced, so that the
+// change can be undone. Typing goes on with the change before it for as long
+// as it stays within the lines of that change. Borrowed lines are kept as
+// they are, the buffer holds on to what they borrow from until it is freed.
+//
+// The last DROPPED of the lines are about to go from the buffer rather than
+// be changed, and are moved to the history instead of being copied. Returns
+// whether they were, otherwise they are still the buffer's to free.
+bool buffer_record_dropping(Buffer *buffer, size_t y, size_t removed, size_t dropped, Vector cursor, bool typing)
+{
+    Undo *undo = &buffer->undo;
+    if (buffer->locations) {
+        return false;
+    }
+
+    if (typing && undo->typing && undo->current == undo->count && undo->current) {
+        const Change *last = undo->items + undo->current - 1;
+        if (!last->sparse && y >= last->y && y + removed <= last->y + last->span) {
+            undo->pending = true;
+            return false;
+        }
+    }
+
+    Change *change = undo_push(undo, cursor);
+    change->y = y;
+    change->span = removed;
+    change->count = removed;
+    change->lines = malloc(MAX(removed, 1) * sizeof(String));
+    assert(change->lines);
+    for (size_t i = 0; i < removed; ++i) {
+        String *line = buffer->lines + y + i;
+        if (i >= removed - dropped && (line->capacity & STRING_SHARED)) {
+            string_own(line);
+        }
+
+        const bool borrowed = (line->capacity & STRING_BORROWED) && !buffer->view;
+        change->lines[i] = i >= removed - dropped || borrowed ? *line : string(line->data, line->size);
+    }
+
+    change_measure(change);
+    undo->bytes += change->bytes;
+    undo->typing = typing;
+    return true;
+}
+
+void buffer_record(Buffer *buffer, size_t y, size_t removed, Vector cursor, bool typing)
+{
+    buffer_record_dropping(buffer, y, removed, 0, cursor, typing);
+}
+
+// Swap the lines of CHANGE with the ones standing for it in BUFFER, which
+// undoes it if it was done and redoes it if it was undone
+void buffer_swap_change(Buffer *buffer, Change *change)
+{
+    Undo *undo = &buffer->undo;
+    undo->applying = true;
+    undo->bytes -= change->bytes;
+
+    if (change->sparse) {
+        if (change->count > MATCHES_CHUNK) {
+            buffer->matches.valid = false;
+        }
+        for (size_t i = 0; i < change->count; ++i) {
+            String *line = buffer->lines + change->ys[i];
+            if (line->capacity & STRING_SHARED) {
+                string_own(line);
+            }
+
+            const String swapped = *line;
+            *line = change->lines[i];
+            change->lines[i] = swapped;
+            buffer_changed(buffer, change->ys[i], 1, 1);
+        }
+    } else {
+        String *taken = malloc(MAX(change->span, 1) * sizeof(String));
+        assert(taken);
+        for (size_t i = 0; i < change->span; ++i) {
+            if (buffer->lines[change->y + i].capacity & STRING_SHARED) {
+                string_own(buffer->lines + change->y + i);
+            }
+            taken[i] = buffer->lines[change->y + i];
+        }
+
+        buffer_resize_lines(buffer, change->y, change->span, change->count);
+        if (change->count) {
+            memcpy(buffer->lines + change->y, change->lines, change->count * sizeof(String));
+        }
+        buffer_changed(buffer, change->y, change->span, change->count);
+
+        free(change->lines);
+        change->lines = taken;
+        const size_t span = change->span;
+        change->span = change->count;
+        change->count = span;
+    }
+
+    change_measure(change);
+    undo->bytes += change->bytes;
+    undo->applying = false;
+
+    const Vector cursor = change->cursor;
+    change->cursor = buffer->cursor;
+    buffer->cursor.y = MIN(cursor.y, buffer->count ? buffer->count - 1 : 0);
+    buffer->cursor.x = MIN(cursor.x, buffer->count ? buffer->lines[buffer->cursor.y].size : 0);
+    buffer->region = false;
+    buffer_anchor_fix(buffer);
+}
+
+// Undo the last change of BUFFER that is done, with the ones joined to it
+void buffer_undo(Buffer *buffer)
+{
+    Undo *undo = &buffer->undo;
+    do {
+        buffer_swap_change(buffer, undo->items + --undo->current);
+    } while (undo->current && undo->items[undo->current].joined);
+}
+
+// Redo the first change of BUFFER that is undone, with the ones joined to it
+void buffer_redo(Buffer *buffer)
+{
+    Undo *undo = &buffer->undo;
+    do {
+        buffer_swap_change(buffer, undo->items + undo->current++);
+    } while (undo->current < undo->count && undo->items[undo->current].joined);
+}
+
+void buffer_insert(Buffer *buffer, char ch)
+{
+    buffer_grow(buffer, buffer->count + 1);
+
+    if (buffer->count == 0) {
+        buffer_record(buffer, 0, 0, buffer->cursor, true);
+        memset(buffer->lines, 0, sizeof(String));
+        buffer->count = 1;
+        buffer_changed(buffer, 0, 0, 1);
+    }
+
+    if (isprint(ch) || ch == '\r' || ch == '\t') {
+        buffer_record(buffer, buffer->cursor.y, 1, buffer->cursor, true);
+    }
+
+    if (isprint(ch)) {
+        string_insert(buffer->lines + buffer->cursor.y, buffer->cursor.x++, &ch, 1);
+        buffer_changed(buffer, buffer->cursor.y, 1, 1);
+    } else if (ch == '\r') {
+        String *prev = buffer->lines + buffer->cursor.y;
+
+        memmove(buffer->lines + buffer->cursor.y + 1,
+                buffer->lines + buffer->cursor.y,
+                (buffer->count - buffer->cursor.y) * sizeof(String));
+
+        buffer->lines[++buffer->cursor.y] =
+            string(prev->data + buffer->cursor.x,
+                   prev->size - buffer->cursor.x);
+
+        buffer->count++;
+
+        prev->size = buffer->cursor.x;
+        buffer->cursor.x = 0;
+        buffer_changed(buffer, buffer->cursor.y - 1, 1, 2);
+
+        buffer_anchor_fix(buffer);
+    } else if (ch == '\t') {
+        string_insert(buffer->lines + buffer->cursor.y, buffer->cursor.x, "    ", 4);
+        buffer->cursor.x += 4;
+        buffer_changed(buffer, buffer->cursor.y, 1, 1);
+    }
+}
+
+String buffer_snap_previous_line(Buffer *buffer)
+{
+    const String line = buffer->lines[--buffer->cursor.y];
+    buffer->cursor.x = line.size;
+    return line;
+}
+
+String buffer_snap_next_line(Buffer *buffer)
+{
+    const String line = buffer->lines[++buffer->cursor.y];
+    buffer->cursor.x = 0;
+    return line;
+}
+
+void buffer_anchor_snap(Buffer *buffer)
+{
+    buffer->anchor.x = buffer->cursor.x - buffer->cursor.x % term.size.x;
+}
+
+void buffer_backward_char(Buffer *buffer)
+{
+    if (buffer->count) {
+        if (buffer->cursor.x) {
+            buffer->cursor.x--;
+            buffer_anchor_fix(buffer);
+        } else if (buffer->cursor.y) {
+            buffer_snap_previous_line(buffer);
+            buffer_anchor_snap(buffer);
+        }
+    }
+}
+
+void buffer_forward_char(Buffer *buffer)
+{
+    if (buffer->count) {
+        if (buffer->cursor.x < buffer->lines[buffer->cursor.y].size) {
+            buffer->cursor.x++;
+            buffer_anchor_fix(buffer);
+            buffer_anchor_snap(buffer);
+        }
+    }
+}
+
+void buffer_backward_word(Buffer *buffer)
+{
+    if (buffer->count) {
+        String line = buffer->lines[buffer->cursor.y];
+
+        if (line.size) {
+            if (buffer->cursor.x && syntax_isident(buffer->syntax, line.data[buffer->cursor.x])) {
+                buffer->cursor.x--;
+            }
+
+            while (buffer->cursor.x && !syntax_isident(buffer->syntax, line.data[buffer->cursor.x])) {
+                buffer->cursor.x--;
+            }
+        }
+
+        if (buffer->cursor.x == 0 && buffer->cursor.y) {
+            line = buffer_snap_previous_line(buffer);
+        }
+
+        while (buffer->cursor.x > 1 && syntax_isident(buffer->syntax, line.data[buffer->cursor.x - 1])) {
+            buffer->cursor.x--;
+        }
+
+        if (buffer->cursor.x == 1 && syntax_isident(buffer->syntax, *line.data)) {
+            buffer->cursor.x--;
+        }
+
+        buffer_anchor_snap(buffer);
+        buffer_anchor_fix(buffer);
+    }
+}
+
+void buffer_forward_word(Buffer *buffer)
+{
+    if (buffer->count) {
+        String line = buffer->lines[buffer->cursor.y];
+
+        while (buffer->cursor.x < line.size && !syntax_isident(buffer->syntax, line.data[buffer->cursor.x])) {
+            buffer->cursor.x++;
+        }
+
+        if (buffer->cursor.x == line.size && buffer->cursor.y < buffer->count) {
+            line = buffer_snap_next_line(buffer);
+        }
+
+        while (buffer->cursor.x < line.size && syntax_isident(buffer->syntax, line.data[buffer->cursor.x])) {
+            buffer->cursor.x++;
+        }
+
+        buffer_anchor_snap(buffer);
+        buffer_anchor_fix(buffer);
+    }
+}
+
+void buffer_backward_line(Buffer *buffer)
+{
+    if (buffer->count) {
+        buffer->cursor.x = 0;
+    }
+}
+
+void buffer_forward_line(Buffer *buffer)
+{
+    if (buffer->count) {
+        buffer->cursor.x = buffer->lines[buffer->cursor.y].size;
+    }
+}
+
+void buffer_cursor_fix(Buffer *buffer)
+{
+    if (buffer->count) {
+        buffer->cursor.x = MIN(buffer->cursor.x, buffer->lines[buffer->cursor.y].size);
+    }
+}
+
+void buffer_previous_line(Buffer *buffer)
+{
+    if (buffer->cursor.y) {
+        buffer->cursor.y--;
+        buffer_cursor_fix(buffer);
+        buffer_anchor_snap(buffer);
+        buffer_anchor_fix(buffer);
+    }
+}
+
+void buffer_next_line(Buffer *buffer)
+{
+    if (buffer->cursor.y + 1 < buffer->count) {
+        buffer->cursor.y++;
+        buffer_cursor_fix(buffer);
+        buffer_anchor_snap(buffer);
+        buffer_anchor_fix(buffer);
+    }
+}
+
+void buffer_previous_para(Buffer *buffer)
+{
+    while (buffer->cursor.y && buffer->lines[buffer->cursor.y].size) {
+        buffer->cursor.y--;
+    }
+
+    while (buffer->cursor.y && !buffer->lines[buffer->cursor.y].size) {
+        buffer->cursor.y--;
+    }
+
+    buffer_cursor_fix(buffer);
+    buffer_anchor_snap(buffer);
+    buffer_anchor_fix(buffer);
+}
+
+void buffer_next_para(Buffer *buffer)
+{
+    while (buffer->cursor.y + 1 < buffer->count && buffer->lines[buffer->cursor.y].size) {
+        buffer->cursor.y++;
+    }
+
+    while (buffer->cursor.y + 1 < buffer->count && !buffer->lines[buffer->cursor.y].size) {
+        buffer->cursor.y++;
+    }
+
+    buffer_cursor_fix(buffer);
+    buffer_anchor_snap(buffer);
+    buffer_anchor_fix(buffer);
+}
+
+void buffer_get_region(Buffer buffer, Vector *start, Vector *end)
+{
+    *start = buffer.marker;
+    *end = buffer.cursor;
+
+    if (start->y > end->y || (start->y == end->y && start->x > end->x)) {
+        const Vector temp = *start;
+        *start = *end;
+        *end = temp;
+    }
+}
+
+// The corners of the rectangle between the marker and the cursor, the
+// column of END being just past it
+void buffer_get_rectangle(Buffer buffer, Vector *start, Vector *end)
+{
+    *start = Vector(MIN(buffer.marker.x, buffer.cursor.x), MIN(buffer.marker.y, buffer.cursor.y));
+    *end = Vector(MAX(buffer.marker.x, buffer.cursor.x), MAX(buffer.marker.y, buffer.cursor.y));
+}
+
+// Screen
+typedef struct {
+    String *rows;
+    size_t count;
+
+    String row;
+    String output;
+} Screen;
+
+static Screen screen;
+
+void screen_color(Color color)
+{
+    char escape[COLOR_ESCAPE_MAX];
+    string_insert(&screen.row, screen.row.size, escape, color_format(escape, color));
+}
+
+// Finish the row being rendered. It is only sent to the terminal if it
+// differs from what the terminal is already showing at row Y.
+void screen_commit(size_t y)
+{
+    if (y >= screen.count) {
+        screen.rows = realloc(screen.rows, (y + 1) * sizeof(String));
+        assert(screen.rows);
+        memset(screen.rows + screen.count, 0, (y + 1 - screen.count) * sizeof(String));
+        screen.count = y + 1;
+    }
+
+    String *row = screen.rows + y;
+    if (row->size != screen.row.size || memcmp(row->data, screen.row.data, row->size)) {
+        string_printf(&screen.output, "\x1b[%zu;1H", y + 1);
+        string_insert(&screen.output, screen.output.size, screen.row.data, screen.row.size);
+        string_printf(&screen.output, "\x1b[0m\x1b[K");
+
+        row->size = 0;
+        string_insert(row, 0, screen.row.data, screen.row.size);
+    }
+
+    screen.row.size = 0;
+}
+
+void screen_present(Vector cursor)
+{
+    string_printf(&screen.output, "\x1b[%zu;%zuH", cursor.y + 1, cursor.x + 1);
+    fwrite(screen.output.data, 1, screen.output.size, stdout);
+    fflush(stdout);
+    screen.output.size = 0;
+}
+
+// Draw the visible part of BUFFER, highlighting SIZE characters at MATCH,
+// and every other match in MATCHES if it is not NULL. Only the rows that
+// changed since the last frame are redrawn.
+void buffer_render(Buffer buffer, Vector match, size_t size, const Matches *matches)
+{
+    if (term.deferred) {
+        return;
+    }
+
+    // A rectangle is drawn column by column, a region from its start to its
+    // end
+    const bool rectangle = buffer.region && buffer.rectangle;
+    const bool region = buffer.region && !buffer.rectangle;
+    Vector start, end;
+    if (rectangle) {
+        buffer_get_rectangle(buffer, &start, &end);
+    } else if (region) {
+        buffer_get_region(buffer, &start, &end);
+    }
+
+    size_t next = matches ? matches_find(matches, Vector(0, buffer.anchor.y)) : 0;
+
+    const Cursors cursors = buffer.cursors;
+    size_t cursor = 0;
+    while (cursor < cursors.count && cursors.items[cursor].y < buffer.anchor.y) {
+        cursor++;
+    }
+
+    for (size_t row = 0; row < term.size.y; ++row) {
+        Vector pen = Vector(0, buffer.anchor.y + row);
+        string_insert(&screen.row, 0, "\x1b[0m", 4);
+
+        if (pen.y < buffer.count) {
+            bool visual = region && start.y < pen.y && pen.y <= end.y;
+            const bool columns = rectangle && start.y <= pen.y && pen.y <= end.y && start.x < end.x;
+            if (visual) screen_color(COLOR_VISUAL);
+
+            SV view = {
+                .data = buffer.lines[pen.y].data,
+                .size = buffer.lines[pen.y].size
+            };
+
+            view.size = MIN(view.size, buffer.anchor.x + term.size.x);
+
+            while (view.size) {
+                SyntaxType type;
+                const SV word = syntax_split(buffer.syntax, &view, &type);
+
+                if (type) screen_color(color_syntaxes[type]);
+                for (size_t i = 0; i < word.size; ++i) {
+                    if ((region && vector_eq(pen, start)) || (columns && pen.x == start.x)) {
+                        screen_color(COLOR_VISUAL);
+                        visual = true;
+                    }
+
+                    bool matched = size && pen.y == match.y && pen.x >= match.x && pen.x < match.x + size;
+                    if (matched) {
+                        screen_color(COLOR_SEARCH);
+                    } else if (matches) {
+                        while (next < matches->count && (matches->items[next].position.y < pen.y ||
+                                                         (matches->items[next].position.y == pen.y &&
+                                                          matches->items[next].position.x + matches->items[next].size <= pen.x))) {
+                            next++;
+                        }
+
+                        if (next < matches->count && matches->items[next].position.y == pen.y &&
+                            matches->items[next].position.x <= pen.x) {
+                            screen_color(COLOR_MATCH);
+                            matched = true;
+                        }
+                    }
+
+                    if (cursor < cursors.count && vector_eq(cursors.items[cursor], pen)) {
+                        screen_color(COLOR_CURSOR);
+                        matched = true;
+                        cursor++;
+                    }
+
+                    if (pen.x >= buffer.anchor.x) {
+                        string_insert(&screen.row, screen.row.size, word.data + i, 1);
+                    }
+
+                    if (matched) {
+                        string_insert(&screen.row, screen.row.size, "\x1b[0m", 4);
+                        if (type) screen_color(color_syntaxes[type]);
+                        if (visual) screen_color(COLOR_VISUAL);
+                    }
+
+                    if ((region && vector_eq(pen, end)) || (columns && pen.x + 1 == end.x)) {
+                        screen_color(COLOR_NORMAL);
+                        visual = false;
+                    }
+
+                    pen.x++;
+                }
+                if (type) screen_color(color_syntaxes[SYNTAX_NORMAL]);
+            }
+
+            if (region && vector_eq(pen, start)) {
+                screen_color(COLOR_VISUAL);
+            }
+
+            if (region && vector_eq(pen, end)) {
+                screen_color(COLOR_NORMAL);
+            }
+
+            // The cursors past the end of the line, drawn on a space
+            while (cursor < cursors.count && cursors.items[cursor].y == pen.y) {
+                if (vector_eq(cursors.items[cursor], pen) && pen.x >= buffer.anchor.x &&
+                    pen.x < buffer.anchor.x + term.size.x) {
+                    screen_color(COLOR_CURSOR);
+                    string_insert(&screen.row, screen.row.size, " \x1b[0m", 5);
+                }
+                cursor++;
+            }
+        }
+
+        screen_commit(row);
+    }
+
+    // The bottom line belongs to the prompts, which draw it themselves
+    string_printf(&screen.output, "\x1b[%zu;1H\x1b[0m\x1b[K", term.size.y + 1);
+    screen_present(vector_sub(buffer.cursor, buffer.anchor));
+}
+
+void buffer_print(Buffer buffer)
+{
+    buffer_render(buffer, buffer.cursor, 0, NULL);
+}
+
+void buffer_toggle_region(Buffer *buffer)
+{
+    if (buffer->region) {
+        buffer->region = false;
+    } else {
+        buffer->region = true;
+        buffer->marker = buffer->cursor;
+    }
+    buffer->rectangle = false;
+}
+
+void buffer_toggle_rectangle(Buffer *buffer)
+{
+    const bool rectangle = buffer->region && buffer->rectangle;
+    buffer->region = !rectangle;
+    buffer->rectangle = !rectangle;
+    buffer->marker = buffer->cursor;
+}
+
+typedef void (*BufferAction)(Buffer *);
+
+void buffer_delete(Buffer *buffer, BufferAction motion)
+{
+    if (buffer->count == 0) {
+        return;
+    }
+
+    const Vector cursor = buffer->cursor;
+    if (!buffer->region) {
+        buffer->marker = buffer->cursor;
+        motion(buffer);
+    }
+
+    Vector start, end;
+    buffer_get_region(*buffer, &start, &end);
+
+    if (buffer->region && end.x < buffer->lines[end.y].size) {
+        end.x++;
+    }
+
+    // The lines joined to the first one go to the history as they are
+    const bool typing = !buffer->region && (motion == buffer_backward_char || motion == buffer_forward_char);
+    const bool moved = buffer_record_dropping(buffer, start.y, end.y - start.y + 1, end.y - start.y, cursor, typing);
+
+    if (start.y == end.y) {
+        if (end.x > start.x) {
+            String *string = buffer->lines + start.y;
+            assert(string->size >= end.x);
+
+            string_own(string);
+            memmove(string->data + start.x, string->data + end.x, string->size - end.x);
+            string->size -= end.x - start.x;
+        }
+    } else {
+        String *string_start = buffer->lines + start.y;
+        String string_end = buffer->lines[end.y];
+
+        string_start->size = start.x;
+        string_insert(string_start, start.x, string_end.data + end.x, string_end.size - end.x);
+
+        for (size_t i = start.y + 1; i <= end.y && !moved; ++i) {
+            string_free(buffer->lines + i);
+        }
+        buffer_resize_lines(buffer, start.y + 1, end.y - start.y, 0);
+    }
+
+    buffer_changed(buffer, start.y, end.y - start.y + 1, 1);
+    buffer->region = false;
+    buffer->cursor = start;
+}
+
+// Cursors
+// An edit made at several cursors replaces the text of a splice at each of
+// them, all of which are made in one pass over the lines they span. A splice
+// past the end of its line is padded to it with PAD spaces first.
+typedef struct {
+    Vector start;
+    Vector end;
+    SV text;
+    size_t pad;
+    bool main;
+} Splice;
+
+// The REMOVED lines from Y on that a run of splices replaces with the ADDED
+// ones rebuilt from START on
+typedef struct {
+    size_t y;
+    size_t removed;
+    size_t start;
+    size_t added;
+} SpliceRun;
+
+void cursors_push(Cursors *cursors, Vector cursor)
+{
+    if (cursors->count == cursors->capacity) {
+        cursors->capacity += INC_CAP;
+        cursors->items = realloc(cursors->items, cursors->capacity * sizeof(Vector));
+        assert(cursors->items);
+    }
+    cursors->items[cursors->count++] = cursor;
+}
+
+Vector buffer_clamp(const Buffer *buffer, Vector position)
+{
+    if (!buffer->count) {
+        return Vector(0, 0);
+    }
+    position.y = MIN(position.y, buffer->count - 1);
+    position.x = MIN(position.x, buffer->lines[position.y].size);
+    return position;
+}
+
+// Keep the cursors of BUFFER within it and in order, dropping the ones that
+// ended up on another
+void buffer_cursors_fix(Buffer *buffer)
+{
+    Cursors *cursors = &buffer->cursors;
+    for (size_t i = 0; i < cursors->count; ++i) {
+        cursors->items[i] = buffer_clamp(buffer, cursors->items[i]);
+    }
+    qsort(cursors->items, cursors->count, sizeof(Vector), vector_compare);
+
+    size_t count = 0;
+    for (size_t i = 0; i < cursors->count; ++i) {
+        const Vector cursor = cursors->items[i];
+        if (!vector_eq(cursor, buffer->cursor) && (!count || !vector_eq(cursor, cursors->items[count - 1]))) {
+            cursors->items[count++] = cursor;
+        }
+    }
+    cursors->count = count;
+}
+
+// A splice at each cursor of BUFFER, the main one included, in order
+Splice *buffer_splices(Buffer *buffer, size_t *count)
+{
+    buffer_cursors_fix(buffer);
+    const Cursors *cursors = &buffer->cursors;
+    Splice *splices = malloc((cursors->count + 1) * sizeof(Splice));
+    assert(splices);
+
+    size_t main = 0;
+    while (main < cursors->count && vector_lt(cursors->items[main], buffer->cursor)) {
+        main++;
+    }
+    for (size_t i = 0, j = 0; i <= cursors->count; ++i) {
+        const Vector cursor = i == main ? buffer->cursor : cursors->items[j++];
+        splices[i] = (Splice) {.start = cursor, .end = cursor, .text = sv("", 0), .main = i == main};
+    }
+
+    *count = cursors->count + 1;
+    return splices;
+}
+
+// Put the cursors of BUFFER at the starts of SPLICES
+void buffer_cursors_set(Buffer *buffer, const Splice *splices, size_t count)
+{
+    buffer->cursors.count = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (splices[i].main) {
+            buffer->cursor = splices[i].start;
+        } else {
+            cursors_push(&buffer->cursors, splices[i].start);
+        }
+    }
+    buffer->region = false;
+    buffer_anchor_fix(buffer);
+}
+
+// Replace each of the COUNT SPLICES, which are in order and apart, with its
+// text, leaving the position after it in the start of the splice. Splices
+// within single lines only rebuild those lines, which go to the history as
+// they were, and one typing goes on with the change before it if it was at
+// the same lines. Otherwise the lines from the first splice to the last are
+// rebuilt in runs of splices that are close to each other. Each run goes to
+// the history as a change of its own, joined to the one before, and the lines
+// between runs are left alone.
+void buffer_splice(Buffer *buffer, Splice *splices, size_t count, bool typing)
+{
+    Undo *undo = &buffer->undo;
+    bool within = true;
+    for (size_t i = 0; within && i < count; ++i) {
+        within = splices[i].start.y == splices[i].end.y && !memchr(splices[i].text.data, '\n', splices[i].text.size);
+    }
+
+    if (within) {
+        String *old = malloc(count * sizeof(String));
+        size_t *ys = malloc(count * sizeof(size_t));
+        assert(old && ys);
+
+        size_t changed = 0;
+        for (size_t i = 0; i < count;) {
+            const size_t y = splices[i].start.y;
+            String *line = buffer->lines + y;
+
+            size_t size = line->size, end = i;
+            for (; end < count && splices[end].start.y == y; ++end) {
+                size += splices[end].pad + splices[end].text.size - (splices[end].end.x - splices[end].start.x);
+            }
+
+            // Every splice rebuilds its lines, so there is no point in
+            // leaving room to grow
+            String result = {.data = malloc(MAX(size, 1)), .capacity = MAX(size, 1)};
+            assert(result.data);
+            size_t copied = 0;
+            for (; i < end; ++i) {
+                Splice *splice = splices + i;
+                string_insert(&result, result.size, line->data + copied, splice->start.x - copied);
+                string_pad(&result, splice->pad);
+                string_insert(&result, result.size, splice->text.data, splice->text.size);
+                copied = splice->end.x;
+                splice->start.x = result.size;
+            }
+            string_insert(&result, result.size, line->data + copied, line->size - copied);
+
+            old[changed] = *line;
+            ys[changed++] = y;
+            *line = result;
+        }
+
+        if (changed > MATCHES_CHUNK) {
+            buffer->matches.valid = false;
+        }
+        undo->applying = true;
+        for (size_t i = 0; i < changed; ++i) {
+            buffer_changed(buffer, ys[i], 1, 1);
+        }
+        undo->applying = false;
+
+        const Change *last = undo->current ? undo->items + undo->current - 1 : NULL;
+        const bool going_on = typing && undo->typing && undo->current == undo->count && last && last->sparse &&
+                              last->count == changed && !memcmp(last->ys, ys, changed * sizeof(size_t));
+        if (buffer->locations || going_on) {
+            for (size_t i = 0; i < changed; ++i) {
+                string_free(old + i);
+            }
+            free(old);
+            free(ys);
+        } else {
+            Change *change = undo_push(undo, buffer->cursor);
+            for (size_t i = 0; i < changed; ++i) {
+                if (old[i].capacity & STRING_SHARED) {
+                    string_own(old + i);
+                }
+            }
+            change->sparse = true;
+            change->ys = ys;
+            change->lines = old;
+            change->count = changed;
+            change_measure(change);
+            undo->bytes += change->bytes;
+            undo->pending = false;
+        }
+        undo->typing = typing;
+        undo_trim(undo);
+        return;
+    }
+
+    const size_t first = splices[0].start.y;
+    const size_t last = splices[count - 1].end.y;
+
+    SpliceRun *runs = malloc(count * sizeof(SpliceRun));
+    size_t *gaps = malloc(count * sizeof(size_t));
+    bool *apart = malloc(count * sizeof(bool));
+    assert(runs && gaps && apart);
+    size_t run = 0;
+    runs[0] = (SpliceRun) {.y = first};
+    for (size_t i = 0; i + 1 < count; ++i) {
+        const size_t from = splices[i].end.y, to = splices[i + 1].start.y;
+        gaps[i] = from < to ? to - from - 1 : 0;
+    }
+    ranges_apart(gaps, count - 1, apart);
+
+    // Rebuild the lines of each run, copying the ones within it
+    Buffer rebuilt = {0};
+    size_t between = 0;
+    String line = string(buffer->lines[first].data, splices[0].start.x);
+    for (size_t i = 0; i < count; ++i) {
+        string_pad(&line, splices[i].pad);
+        SV rest = splices[i].text;
+        for (const char *newline; (newline = memchr(rest.data, '\n', rest.size));) {
+            string_insert(&line, line.size, rest.data, newline - rest.data);
+            buffer_push(&rebuilt, line);
+            line = (String) {0};
+            rest = sv(newline + 1, rest.size - (newline + 1 - rest.data));
+        }
+        string_insert(&line, line.size, rest.data, rest.size);
+
+        // Then what is left up to the next splice
+        const Vector from = splices[i].end;
+        const Vector to = i + 1 < count ? splices[i + 1].start : Vector(buffer->lines[last].size, last);
+        splices[i].start = Vector(line.size, first + between + rebuilt.count);
+
+        const String *source = buffer->lines + from.y;
+        if (from.y == to.y) {
+            string_insert(&line, line.size, source->data + from.x, to.x - from.x);
+            continue;
+        }
+
+        string_insert(&line, line.size, source->data + from.x, source->size - from.x);
+        buffer_push(&rebuilt, line);
+        if (apart[i]) {
+            runs[run].removed = from.y + 1 - runs[run].y;
+            runs[run].added = rebuilt.count - runs[run].start;
+            runs[++run] = (SpliceRun) {.y = to.y, .start = rebuilt.count};
+            between += to.y - from.y - 1;
+        } else {
+            for (size_t y = from.y + 1; y < to.y; ++y) {
+                buffer_push(&rebuilt, string(buffer->lines[y].data, buffer->lines[y].size));
+            }
+        }
+        line = string(buffer->lines[to.y].data, to.x);
+    }
+    buffer_push(&rebuilt, line);
+    runs[run].removed = last + 1 - runs[run].y;
+    runs[run].added = rebuilt.count - runs[run].start;
+
+    // Then replace the runs in turn, the lines between them stay where they
+    // are. Each run leaves the lines it replaced to its change.
+    size_t removed = 0, added = 0;
+    for (size_t i = 0; i <= run; ++i) {
+        const size_t y = runs[i].y - removed + added;
+        if (buffer_record_dropping(buffer, y, runs[i].removed, runs[i].removed, buffer->cursor, false)) {
+            undo->items[undo->current - 1].joined = i > 0;
+        } else {
+            for (size_t j = y; j < y + runs[i].removed; ++j) {
+                string_free(buffer->lines + j);
+            }
+        }
+
+        buffer_resize_lines(buffer, y, runs[i].removed, runs[i].added);
+        memcpy(buffer->lines + y, rebuilt.lines + runs[i].start, runs[i].added * sizeof(String));
+        buffer_changed(buffer, y, runs[i].removed, runs[i].added);
+        removed += runs[i].removed;
+        added += runs[i].added;
+    }
+    free(rebuilt.lines);
+    free(runs);
+    free(gaps);
+    free(apart);
+}
+
+// Insert CH at every cursor of BUFFER
+void buffer_insert_cursors(Buffer *buffer, char ch)
+{
+    if (!buffer->count) {
+        buffer_insert(buffer, ch);
+        return;
+    }
+
+    size_t count;
+    Splice *splices = buffer_splices(buffer, &count);
+    const SV text = ch == '\t' ? sv("    ", 4) : ch == '\r' ? sv("\n", 1) : sv(&ch, 1);
+    for (size_t i = 0; i < count; ++i) {
+        splices[i].text = text;
+    }
+    buffer_splice(buffer, splices, count, true);
+    buffer_cursors_set(buffer, splices, count);
+    free(splices);
+}
+
+// Delete from every cursor of BUFFER to where MOTION takes it, as one edit.
+// Deletions that meet are joined.
+void buffer_delete_cursors(Buffer *buffer, BufferAction motion)
+{
+    if (!buffer->count) {
+        return;
+    }
+
+    size_t count;
+    Splice *splices = buffer_splices(buffer, &count);
+    const Vector anchor = buffer->anchor;
+    for (size_t i = 0; i < count; ++i) {
+        buffer->cursor = splices[i].start;
+        motion(buffer);
+        const Vector moved = buffer_clamp(buffer, buffer->cursor);
+        if (vector_lt(moved, splices[i].start)) {
+            splices[i].start = moved;
+        } else {
+            splices[i].end = moved;
+        }
+    }
+    buffer->anchor = anchor;
+
+    size_t merged = 0;
+    for (size_t i = 0; i < count; ++i) {
+        Splice *last = merged ? splices + merged - 1 : NULL;
+        if (last && !vector_lt(last->end, splices[i].start)) {
+            last->end = vector_lt(last->end, splices[i].end) ? splices[i].end : last->end;
+            last->main = last->main || splices[i].main;
+        } else {
+            splices[merged++] = splices[i];
+        }
+    }
+
+    const bool typing = motion == buffer_backward_char || motion == buffer_forward_char;
+    buffer_splice(buffer, splices, merged, typing);
+    buffer_cursors_set(buffer, splices, merged);
+    free(splices);
+}
+
+// Move every cursor of BUFFER with MOTION
+void buffer_move_cursors(Buffer *buffer, BufferAction motion)
+{
+    const Vector cursor = buffer->cursor;
+    const Vector anchor = buffer->anchor;
+    for (size_t i = 0; i < buffer->cursors.count; ++i) {
+        buffer->cursor = buffer->cursors.items[i];
+        motion(buffer);
+        buffer->cursors.items[i] = buffer->cursor;
+    }
+
+    buffer->cursor = cursor;
+    buffer->anchor = anchor;
+    motion(buffer);
+    buffer_cursors_fix(buffer);
+}
+
+// Rectangles
+// The rectangle killed last, its COUNT lines of WIDTH characters one after
+// the other
+static struct {
+    String strips;
+    size_t width;
+    size_t count;
+} killed_rectangle = {0};
+
+// A splice for each line of BUFFER spanned by the rectangle from START to
+// END, cut to the end of its line. With PAD the splices past the end of
+// their line are padded to the column of START.
+Splice *buffer_rectangle_splices(Buffer *buffer, Vector start, Vector end, bool pad, size_t *count)
+{
+    *count = end.y - start.y + 1;
+    Splice *splices = malloc(*count * sizeof(Splice));
+    assert(splices);
+
+    for (size_t i = 0; i < *count; ++i) {
+        const size_t y = start.y + i;
+        const size_t size = buffer->lines[y].size;
+        splices[i] = (Splice) {
+            .start = Vector(MIN(start.x, size), y),
+            .end = Vector(MIN(end.x, size), y),
+            .text = sv("", 0),
+            .pad = pad && start.x > size ? start.x - size : 0,
+        };
+    }
+    return splices;
+}
+
+// Delete the rectangle of the region of BUFFER, keeping it to be yanked
+// if KILL is set, and leave the cursor at its top left corner
+void buffer_delete_rectangle(Buffer *buffer, bool kill)
+{
+    if (!buffer->count) {
+        return;
+    }
+
+    Vector start, end;
+    buffer_get_rectangle(*buffer, &start, &end);
+    size_t count;
+    Splice *splices = buffer_rectangle_splices(buffer, start, end, false, &count);
+
+    if (kill) {
+        String *strips = &killed_rectangle.strips;
+        strips->size = 0;
+        string_grow(strips, count * (end.x - start.x));
+        for (size_t i = 0; i < count; ++i) {
+            const String *line = buffer->lines + splices[i].start.y;
+            const size_t size = splices[i].end.x - splices[i].start.x;
+            string_insert(strips, strips->size, line->data + splices[i].start.x, size);
+            string_pad(strips, end.x - start.x - size);
+        }
+        killed_rectangle.width = end.x - start.x;
+        killed_rectangle.count = count;
+    }
+
+    buffer_splice(buffer, splices, count, false);
+    buffer->cursor = splices[0].start;
+    buffer->region = false;
+    buffer_anchor_fix(buffer);
+    free(splices);
+}
+
+// Replace every line of the rectangle of the region of BUFFER with TEXT,
+// which is only inserted if the rectangle has no width
+void buffer_string_rectangle(Buffer *buffer, SV text)
+{
+    if (!buffer->count) {
+        return;
+    }
+
+    Vector start, end;
+    buffer_get_rectangle(*buffer, &start, &end);
+    size_t count;
+    Splice *splices = buffer_rectangle_splices(buffer, start, end, true, &count);
+    for (size_t i = 0; i < count; ++i) {
+        splices[i].text = text;
+    }
+
+    buffer_splice(buffer, splices, count, false);
+    buffer->cursor = splices[count - 1].start;
+    buffer->region = false;
+    buffer_anchor_fix(buffer);
+    free(splices);
+}
+
+// Insert the rectangle killed last with its top left corner at the cursor
+// of BUFFER, adding the lines it needs past the end
+void buffer_yank_rectangle(Buffer *buffer)
+{
+    if (!killed_rectangle.count) {
+        return;
+    }
+
+    if (buffer->count == 0) {
+        buffer_grow(buffer, 1);
+        buffer_record(buffer, 0, 0, buffer->cursor, false);
+        memset(buffer->lines, 0, sizeof(String));
+        buffer->count = 1;
+        buffer_changed(buffer, 0, 0, 1);
+    }
+
+    const Vector cursor = buffer->cursor;
+    const size_t inside = MIN(killed_rectangle.count, buffer->count - cursor.y);
+    size_t count;
+    Splice *splices = buffer_rectangle_splices(buffer, cursor, Vector(cursor.x, cursor.y + inside - 1), true, &count);
+    const size_t width = killed_rectangle.width;
+    const char *strips = killed_rectangle.strips.data;
+    for (size_t i = 0; i < count; ++i) {
+        splices[i].text = sv(strips + i * width, width);
+    }
+
+    // The lines past the end go after the last one, which makes it a
+    // single edit of every line from the cursor on
+    String rest = {0};
+    for (size_t i = inside; i < killed_rectangle.count; ++i) {
+        string_insert(&rest, rest.size, "\n", 1);
+        string_pad(&rest, cursor.x);
+        string_insert(&rest, rest.size, strips + i * width, width);
+    }
+    if (rest.size) {
+        const size_t y = buffer->count - 1;
+        splices = realloc(splices, (count + 1) * sizeof(Splice));
+        assert(splices);
+        splices[count++] = (Splice) {
+            .start = Vector(buffer->lines[y].size, y),
+            .end = Vector(buffer->lines[y].size, y),
+            .text = sv(rest.data, rest.size),
+        };
+    }
+
+    buffer_splice(buffer, splices, count, false);
+    buffer->cursor = splices[count - 1].start;
+    buffer->region = false;
+    buffer_anchor_fix(buffer);
+    string_free(&rest);
+    free(splices);
+}
+
+// Kills
+// Build with -DKILL_RING=<count> to keep more or fewer kills to yank
+#ifndef KILL_RING
+#define KILL_RING 16
+#endif
+
+// Kills of at least KILL_LEND bytes take the lines from the buffer without
+// copying them, smaller ones are copied
+#define KILL_LEND (1 << 16)
+
+// Killed or copied text, one line after the other. The lines of a large kill
+// borrow from LENDERS.
+typedef struct {
+    String *lines;
+    size_t count;
+    Lenders lenders;
+} Kill;
+
+// The kills to yank, the last one at LAST. Right after a yank, which left the
+// history of its buffer at CURRENT, the kill yanked is the one at AT.
+static struct {
+    Kill items[KILL_RING];
+    size_t count;
+    size_t last;
+
+    bool yanked;
+    size_t at;
+    size_t current;
+} kills = {0};
+
+void kill_free(Kill *kill)
+{
+    for (size_t i = 0; i < kill->count; ++i) {
+        string_free(kill->lines + i);
+    }
+    free(kill->lines);
+    lenders_free(&kill->lenders);
+    memset(kill, 0, sizeof(Kill));
+}
+
+// Hand the data of the COUNT lines of BUFFER from Y over to blocks of a new
+// Chunks, which the lines then borrow from like the ones of a stream, so that
+// a kill can borrow them too. Lines shared with a save are copied first.
+void buffer_lend(Buffer *buffer, size_t y, size_t count)
+{
+    Chunks *chunks = chunks_new();
+    chunks_grow(chunks, count);
+    for (size_t i = y; i < y + count; ++i) {
+        String *line = buffer->lines + i;
+        if (line->capacity & STRING_SHARED) {
+            string_own(line);
+        }
+        if (!(line->capacity & STRING_BORROWED) && line->data) {
+            chunks->items[chunks->count++] = line->data;
+            line->capacity = STRING_BORROWED;
+        }
+    }
+
+    if (chunks->count) {
+        lenders_add(&buffer->lenders, chunks);
+    }
+    chunks_release(chunks);
+}
+
+// Keep the text of BUFFER from START to END to be yanked, as the last kill
+void buffer_kill(Buffer *buffer, Vector start, Vector end)
+{
+    size_t bytes = 0;
+    for (size_t y = start.y; y <= end.y && bytes < KILL_LEND; ++y) {
+        bytes += buffer->lines[y].size + 1;
+    }
+
+    Kill kill = {0};
+    kill.count = end.y - start.y + 1;
+    kill.lines = malloc(kill.count * sizeof(String));
+    assert(kill.lines);
+
+    // A view reads its lines into a window that moves, they are copied
+    const bool lend = bytes >= KILL_LEND && !buffer->view;
+    if (lend) {
+        buffer_lend(buffer, start.y, kill.count);
+        buffer_lenders(buffer, &kill.lenders);
+    }
+
+    for (size_t i = 0; i < kill.count; ++i) {
+        const String line = buffer->lines[start.y + i];
+        const size_t from = i == 0 ? start.x : 0;
+        const size_t to = i == kill.count - 1 ? end.x : line.size;
+        if (lend) {
+            kill.lines[i] = (String) {.data = line.data + from, .size = to - from, .capacity = STRING_BORROWED};
+        } else {
+            kill.lines[i] = string(line.data + from, to - from);
+        }
+    }
+
+    kills.last = kills.count ? (kills.last + 1) % KILL_RING : 0;
+    kills.count = MIN(kills.count + 1, KILL_RING);
+    kill_free(kills.items + kills.last);
+    kills.items[kills.last] = kill;
+}
+
+// The region of BUFFER as buffer_delete() deletes it, up to the character
+// under its end
+void buffer_get_region_inclusive(Buffer *buffer, Vector *start, Vector *end)
+{
+    buffer_get_region(*buffer, start, end);
+    if (end->x < buffer->lines[end->y].size) {
+        end->x++;
+    }
+}
+
+// Insert KILL at the cursor of BUFFER, leaving the cursor after it. The
+// lines in between of a large kill are not copied, the buffer borrows them
+// from where the kill does.
+void buffer_yank(Buffer *buffer, const Kill *kill)
+{
+    const Vector cursor = buffer->cursor;
+    const size_t removed = buffer->count ? 1 : 0;
+    buffer_record(buffer, cursor.y, removed, cursor, false);
+
+    String line = removed ? buffer->lines[cursor.y] : (String) {0};
+    const bool borrow = kill->lenders.count;
+    if (borrow) {
+        lenders_add_all(&buffer->lenders, &kill->lenders);
+    }
+
+    // The lines of the kill go in place of the one at the cursor, which is
+    // kept aside until they are made
+    buffer_resize_lines(buffer, cursor.y, removed, kill->count);
+
+    String *lines = buffer->lines + cursor.y;
+    for (size_t i = 0; i < kill->count; ++i) {
+        const size_t before = i == 0 ? cursor.x : 0;
+        const size_t after = i == kill->count - 1 ? line.size - cursor.x : 0;
+        if (!before && !after) {
+            lines[i] = borrow ? kill->lines[i] : string(kill->lines[i].data, kill->lines[i].size);
+            continue;
+        }
+
+        String result = {0};
+        string_grow(&result, before + kill->lines[i].size + after);
+        string_insert(&result, result.size, line.data, before);
+        string_insert(&result, result.size, kill->lines[i].data, kill->lines[i].size);
+        string_insert(&result, result.size, line.data + cursor.x, after);
+        lines[i] = result;
+    }
+
+    string_free(&line);
+    buffer_changed(buffer, cursor.y, removed, kill->count);
+
+    const size_t last = kill->lines[kill->count - 1].size;
+    buffer->cursor = Vector(kill->count == 1 ? cursor.x + last : last, cursor.y + kill->count - 1);
+    buffer->region = false;
+    buffer_anchor_fix(buffer);
+}
+
+// Read what is ready on the stream of BUFFER and append the lines, which
+// borrow from the blocks they were read into. A line still incomplete at the
+// end of a block is moved to the next one. It is shown as the last line of
+// the buffer, which is replaced as the rest of it arrives.
+StreamState buffer_stream_read(Buffer *buffer)
+{
+    Stream *stream = buffer->stream;
+    Chunks *chunks = buffer->chunks;
+    const size_t removed = stream->partial;
+    if (stream->partial) {
+        string_free(buffer->lines + --buffer->count);
+        stream->partial = false;
+    }
+    const size_t first = buffer->count;
+    StreamState state = STREAM_MORE;
+
+    for (size_t i = 0; i < STREAM_READS; ++i) {
+        if (chunks->used == chunks->size) {
+            const size_t keep = chunks->used - stream->start;
+            chunks_next(chunks, keep, MAX(CHUNK_SIZE, 2 * keep));
+            stream->start = 0;
+        }
+
+        char *block = chunks->items[chunks->count - 1];
+        const ssize_t size = read(stream->fd, block + chunks->used, chunks->size - chunks->used);
+        if (size == -1 && (errno == EAGAIN || errno == EINTR)) {
+            state = STREAM_WAIT;
+            break;
+        }
+
+        if (size <= 0) {
+            state = STREAM_END;
+            break;
+        }
+
+        char *end = block + chunks->used + size;
+        for (char *p = block + chunks->used; (p = memchr(p, '\n', end - p)); ++p) {
+            const String line = {
+                .data = block + stream->start,
+                .size = p - block - stream->start,
+                .capacity = STRING_BORROWED,
+            };
+            buffer_push(buffer, line);
+            stream->start = p + 1 - block;
+        }
+        chunks->used += size;
+    }
+
+    if (chunks->used > stream->start) {
+        const String line = {
+            .data = chunks->items[chunks->count - 1] + stream->start,
+            .size = chunks->used - stream->start,
+            .capacity = STRING_BORROWED,
+        };
+        buffer_push(buffer, line);
+        stream->partial = true;
+    }
+
+    if (removed || buffer->count > first) {
+        buffer_changed(buffer, first, removed, buffer->count - first);
+    }
+    return state;
+}
+
+// Keep the incomplete line at the end of the stream of BUFFER, if any, as it
+// is, the stream being read no further or starting a line of its own
+void buffer_stream_flush(Buffer *buffer)
+{
+    buffer->stream->start = buffer->chunks->used;
+    buffer->stream->partial = false;
+}
+
+// Make BUFFER hold the lines of DATA, the new contents of its file, changing
+// only the lines that differ. The lines that still match at both ends are
+// compared directly, and the ones left in between are diffed by their hashes.
+// Positions move along with the lines they are on.
+void buffer_reload(Buffer *buffer, const char *data, size_t size, Hunks *hunks)
+{
+    Hashes *hashes = &buffer->hashes;
+    if (hashes->count != buffer->count) {
+        hashes_reset(hashes, buffer->lines, buffer->count);
+    }
+
+    size_t prefix = 0, start = 0;
+    while (prefix < buffer->count && start < size) {
+        const String line = buffer->lines[prefix];
+        if (start + line.size > size ||
+            (line.size && memcmp(data + start, line.data, line.size)) ||
+            (start + line.size < size && data[start + line.size] != '\n')) {
+            break;
+        }
+        start += line.size + 1;
+        prefix++;
+    }
+
+    size_t suffix = 0, limit = size;
+    ptrdiff_t end = size && data[size - 1] == '\n' ? size - 1 : size;
+    while (suffix < buffer->count - prefix) {
+        const String line = buffer->lines[buffer->count - 1 - suffix];
+        const ptrdiff_t from = end - line.size;
+        if (from < (ptrdiff_t) start || (size_t) from >= size ||
+            (line.size && memcmp(data + from, line.data, line.size)) ||
+            (from > 0 && data[from - 1] != '\n')) {
+            break;
+        }
+        limit = from;
+        end = from - 1;
+        suffix++;
+    }
+
+    SV *lines = NULL;
+    uint64_t *added = NULL;
+    size_t count = 0, capacity = 0;
+    for (size_t at = start; at < limit;) {
+        const char *newline = memchr(data + at, '\n', limit - at);
+        const size_t next = newline ? (size_t) (newline - data) : limit;
+        if (count == capacity) {
+            capacity += INC_CAP;
+            lines = realloc(lines, capacity * sizeof(SV));
+            added = realloc(added, capacity * sizeof(uint64_t));
+            assert(lines && added);
+        }
+
+        lines[count] = sv(data + at, next - at);
+        added[count++] = hash_line((String) {.data = (char *) data + at, .size = next - at});
+        at = next + 1;
+    }
+
+    const size_t removed = buffer->count - prefix - suffix;
+    if (!diff_hashes(hashes->items + prefix, removed, added, count, hunks)) {
+        // Too different to be worth diffing, replace the whole middle
+        for (size_t i = 0; i < removed; ++i) {
+            hunks_push(hunks, (Edit) {.x = i, .y = 0});
+        }
+        for (size_t i = 0; i < count; ++i) {
+            hunks_push(hunks, (Edit) {.x = removed, .y = i, .insert = true});
+        }
+    }
+
+    if (!hunks->count) {
+        free(lines);
+        free(added);
+        return;
+    }
+
+    // Each range of hunks close to each other replaces its lines in turn, as a
+    // change joined to the one before. A hunk starts at the same line of the
+    // buffer as in the new contents, the ones before it being done.
+    size_t *gaps = malloc(hunks->count * sizeof(size_t));
+    bool *apart = malloc(hunks->count * sizeof(bool));
+    assert(gaps && apart);
+    for (size_t i = 0; i + 1 < hunks->count; ++i) {
+        gaps[i] = hunks->items[i + 1].old_start - hunks->items[i].old_start - hunks->items[i].old_count;
+    }
+    ranges_apart(gaps, hunks->count - 1, apart);
+
+    for (size_t i = 0; i < hunks->count;) {
+        const Hunk *hunk = hunks->items + i;
+        size_t end = i + 1;
+        while (end < hunks->count && !apart[end - 1]) {
+            end++;
+        }
+
+        const Hunk *last = hunks->items + end - 1;
+        const size_t y = prefix + hunk->new_start;
+        const size_t replaced = last->old_start + last->old_count - hunk->old_start;
+        const size_t inserted = last->new_start + last->new_count - hunk->new_start;
+        if (buffer_record_dropping(buffer, y, replaced, replaced, buffer->cursor, false)) {
+            buffer->undo.items[buffer->undo.current - 1].joined = i > 0;
+        } else {
+            for (size_t k = y; k < y + replaced; ++k) {
+                string_free(buffer->lines + k);
+            }
+        }
+
+        buffer_resize_lines(buffer, y, replaced, inserted);
+        for (size_t k = 0; k < inserted; ++k) {
+            const SV line = lines[hunk->new_start + k];
+            buffer->lines[y + k] = string(line.data, line.size);
+        }
+        buffer_changed(buffer, y, replaced, inserted);
+        i = end;
+    }
+    free(gaps);
+    free(apart);
+
+    for (size_t i = 0; i < hunks->count; ++i) {
+        hunks->items[i].old_start += prefix;
+        hunks->items[i].new_start += prefix;
+    }
+    free(lines);
+    free(added);
+
+    uint64_t *saved = malloc(MAX(hashes->count, 1) * sizeof(uint64_t));
+    assert(saved);
+    if (hashes->count) {
+        memcpy(saved, hashes->items, hashes->count * sizeof(uint64_t));
+    }
+    hashes_save(hashes, saved, hashes->count);
+
+    const size_t total = buffer->count;
+    Vector *positions[] = {&buffer->cursor, &buffer->marker, &buffer->anchor};
+    for (size_t i = 0; i < sizeof(positions) / sizeof(positions[0]); ++i) {
+        Vector *position = positions[i];
+        position->y = MIN(hunks_map(hunks, position->y), total ? total - 1 : 0);
+        position->x = MIN(position->x, total ? buffer->lines[position->y].size : 0);
+    }
+    buffer_anchor_fix(buffer);
+}
+
+// Apply the records of the journal DATA to BUFFER, stopping at the first one
+// that is torn or does not fit. Returns the size of the journal up to there,
+// and the number of records applied in RECORDS.
+size_t buffer_replay(Buffer *buffer, const char *data, size_t size, size_t *records)
+{
+    SV view = sv(data + sizeof(JournalHeader), size - sizeof(JournalHeader));
+    size_t valid = sizeof(JournalHeader);
+    while (view.size) {
+        const char *start = view.data;
+        uint64_t y, removed, added;
+        if (!journal_read_varint(&view, &y) || !journal_read_varint(&view, &removed) ||
+            !journal_read_varint(&view, &added) || y > buffer->count || removed > buffer->count - y) {
+            break;
+        }
+
+        // Check the whole record before changing anything
+        SV rest = view;
+        bool ok = true;
+        for (uint64_t i = 0; ok && i < added; ++i) {
+            uint64_t length;
+            ok = journal_read_varint(&rest, &length) && length <= rest.size;
+            if (ok) {
+                rest.data += length;
+                rest.size -= length;
+            }
+        }
+
+        uint64_t hash;
+        if (!ok || rest.size < sizeof(hash)) {
+            break;
+        }
+        memcpy(&hash, rest.data, sizeof(hash));
+        if (hash != hash_line((String) {.data = (char *) start, .size = rest.data - start})) {
+            break;
+        }
+
+        for (size_t i = y; i < y + removed; ++i) {
+            string_free(buffer->lines + i);
+        }
+        buffer_resize_lines(buffer, y, removed, added);
+        for (size_t i = y; i < y + added; ++i) {
+            uint64_t length;
+            journal_read_varint(&view, &length);
+            buffer->lines[i] = string(view.data, length);
+            view.data += length;
+            view.size -= length;
+        }
+        buffer_changed(buffer, y, removed, added);
+
+        view.data += sizeof(hash);
+        view.size -= sizeof(hash);
+        valid = view.data - data;
+        buffer->cursor = Vector(0, MIN(y, buffer->count ? buffer->count - 1 : 0));
+        ++*records;
+    }
+    return valid;
+}
+
+// Index some more lines of BUFFER. Returns whether any are left.
+bool buffer_index_step(Buffer *buffer)
+{
+    if (buffer->view) {
+        return view_index_step(buffer->view);
+    }
+
+    Trigrams *trigrams = &buffer->trigrams;
+    if (!trigrams->enabled) {
+        return false;
+    }
+
+    if (trigrams->lines != buffer->count) {
+        trigrams_reset(trigrams, buffer->count);
+    }
+    return trigrams_step(trigrams, buffer->lines);
+}
+
+// The lines of BUFFER which may contain a match of PATTERN. If the buffer
+// has a trigram index, it rules out lines for patterns of literal text.
+void buffer_candidates(Buffer *buffer, Pattern *pattern, Ranges *ranges)
+{
+    ranges->count = 0;
+    ranges->current = 0;
+
+    Trigrams *trigrams = &buffer->trigrams;
+    if (trigrams->enabled && trigrams->lines != buffer->count) {
+        // Lines were pushed without buffer_changed()
+        trigrams_reset(trigrams, buffer->count);
+    }
+
+    const String source = pattern->source;
+    if (trigrams->enabled && source.size >= 3 && (!pattern->regex || !pattern_special(source))) {
+        trigrams_ranges(trigrams, source, ranges);
+    } else {
+        ranges_push(ranges, 0, buffer->count);
+    }
+}
+
+// Read the window of the view of BUFFER again if the cursor got near either
+// end of it, keeping the cursor where it is on the screen
+void buffer_view_slide(Buffer *buffer)
+{
+    View *view = buffer->view;
+    if (!buffer->count) {
+        return;
+    }
+
+    const bool forward = buffer->cursor.y + term.size.y >= buffer->count && view->end < view->size;
+    const bool backward = buffer->cursor.y < term.size.y && view->start > 0;
+    if (forward || backward) {
+        const size_t row = buffer->cursor.y - buffer->anchor.y;
+        buffer_view_seek(buffer, buffer_view_offset(buffer, buffer->cursor.y), buffer->cursor.x);
+        buffer->anchor.y = buffer->cursor.y > row ? buffer->cursor.y - row : 0;
+        buffer_anchor_fix(buffer);
+    }
+}
+
+// Search the window of the view of BUFFER from FROM, then the rest of the
+// file in that direction. Searches in views do not wrap around.
+bool buffer_view_search(Buffer *buffer, Pattern *pattern, Vector from, bool forward)
+{
+    View *view = buffer->view;
+    if (forward) {
+        for (size_t y = from.y; y < buffer->count; ++y) {
+            size_t x = y == from.y ? from.x : 0;
+            if (pattern_search_forward(pattern, buffer->lines[y], &x)) {
+                buffer->cursor = Vector(x, y);
+                return true;
+            }
+        }
+
+        size_t x;
+        const off_t offset = view_search_forward(view, pattern, view->end, &x);
+        if (offset != -1) {
+            buffer_view_seek(buffer, offset, x);
+            return true;
+        }
+    } else {
+        for (size_t y = MIN(from.y + 1, buffer->count); y-- > 0;) {
+            size_t x = y == from.y ? from.x : buffer->lines[y].size;
+            if (pattern_search_backward(pattern, buffer->lines[y], &x)) {
+                buffer->cursor = Vector(x, y);
+                return true;
+            }
+        }
+
+        size_t x;
+        const off_t offset = view_search_backward(view, pattern, view->start, &x);
+        if (offset != -1) {
+            buffer_view_seek(buffer, offset, x);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Find the first match at or after FROM, or the last one at or before it if
+// searching backward, wrapping around the ends of the buffer. Only the
+// lines which may contain a match are searched.
+bool buffer_search_from(Buffer *buffer, Pattern *pattern, Vector from, bool forward)
+{
+    if (buffer->view) {
+        if (!buffer_view_search(buffer, pattern, from, forward)) {
+            return false;
+        }
+        buffer_anchor_snap(buffer);
+        buffer_anchor_fix(buffer);
+        return true;
+    }
+
+    if (!buffer->count) {
+        return false;
+    }
+
+    Ranges ranges = {0};
+    buffer_candidates(buffer, pattern, &ranges);
+
+    if (forward) {
+        size_t x = from.x;
+
+        for (size_t y = ranges_next(&ranges, from.y); y != RANGES_NONE; y = ranges_next(&ranges, y + 1)) {
+            if (y != from.y) {
+                x = 0;
+            }
+
+            if (pattern_search_forward(pattern, buffer->lines[y], &x)) {
+                buffer->cursor = Vector(x, y);
+                goto found;
+            }
+        }
+
+        for (size_t y = ranges_next(&ranges, 0); y != RANGES_NONE && y <= from.y; y = ranges_next(&ranges, y + 1)) {
+            x = 0;
+            if (pattern_search_forward(pattern, buffer->lines[y], &x)) {
+                buffer->cursor = Vector(x, y);
+                goto found;
+            }
+        }
+    } else {
+        size_t x = from.x;
+
+        for (size_t y = ranges_previous(&ranges, from.y); y != RANGES_NONE; y = ranges_previous(&ranges, y - 1)) {
+            const String line = buffer->lines[y];
+
+            if (y != from.y) {
+                x = line.size;
+            }
+
+            if (pattern_search_backward(pattern, line, &x)) {
+                buffer->cursor = Vector(x, y);
+                goto found;
+            }
+        }
+
+        for (size_t y = ranges_previous(&ranges, buffer->count - 1); y != RANGES_NONE && y >= from.y; y = ranges_previous(&ranges, y - 1)) {
+            const String line = buffer->lines[y];
             x = line.size;
 
-            if (string_search_backward(line, query, &x)) {
-                buffer->cursor = Vector(x, y - 1);
-                goto found;
+            if (pattern_search_backward(pattern, line, &x)) {
+                buffer->cursor = Vector(x, y);
+                goto found;
+            }
+        }
+    }
+
+    free(ranges.items);
+    return false;
+
+found:
+    free(ranges.items);
+    buffer_anchor_snap(buffer);
+    buffer_anchor_fix(buffer);
+    return true;
+}
+
+bool buffer_search(Buffer *buffer, Pattern *pattern, bool forward)
+{
+    Vector from = buffer->cursor;
+    if (forward) {
+        from.x++;
+    } else if (from.x) {
+        from.x--;
+    }
+
+    return buffer_search_from(buffer, pattern, from, forward);
+}
+
+// Like buffer_search(), but only searches forward from FROM, inclusive, and
+// does not wrap around at the end of the buffer
+bool buffer_search_next(Buffer *buffer, Pattern *pattern, Vector from)
+{
+    Ranges ranges = {0};
+    buffer_candidates(buffer, pattern, &ranges);
+
+    bool found = false;
+    size_t x = from.x;
+    for (size_t y = ranges_next(&ranges, from.y); !found && y != RANGES_NONE; y = ranges_next(&ranges, y + 1)) {
+        if (y != from.y) {
+            x = 0;
+        }
+
+        if (pattern_search_forward(pattern, buffer->lines[y], &x)) {
+            buffer->cursor = Vector(x, y);
+            buffer_anchor_snap(buffer);
+            buffer_anchor_fix(buffer);
+            found = true;
+        }
+    }
+
+    free(ranges.items);
+    return found;
+}
+
+typedef struct {
+    Buffer *buffer;
+    Pattern *source;
+    size_t start;
+    size_t end;
+    Matches result;
+} MatchesChunk;
+
+void matches_chunk_task(void *arg)
+{
+    MatchesChunk *chunk = (MatchesChunk *) arg;
+
+    Pattern pattern = {0};
+    pattern_compile(&pattern, chunk->source->source, chunk->source->regex);
+    for (size_t y = chunk->start; y < chunk->end; ++y) {
+        matches_scan(&chunk->result, &pattern, chunk->buffer->lines[y], y);
+    }
+    pattern_free(&pattern);
+}
+
+// Index every match of PATTERN in BUFFER. Large buffers are split into line
+// ranges which are scanned in parallel, and the results joined in order.
+void buffer_index_matches(Buffer *buffer, Pattern *pattern)
+{
+    Matches *matches = &buffer->matches;
+    matches_free(matches);
+    pattern_compile(&matches->pattern, pattern->source, pattern->regex);
+    matches->valid = true;
+
+    Ranges ranges = {0};
+    buffer_candidates(buffer, pattern, &ranges);
+
+    size_t count = 0;
+    for (size_t i = 0; i < ranges.count; ++i) {
+        count += (ranges.items[i].end - ranges.items[i].start + MATCHES_CHUNK - 1) / MATCHES_CHUNK;
+    }
+
+    if (count <= 1) {
+        for (size_t i = 0; i < ranges.count; ++i) {
+            for (size_t y = ranges.items[i].start; y < ranges.items[i].end; ++y) {
+                matches_scan(matches, &matches->pattern, buffer->lines[y], y);
+            }
+        }
+        free(ranges.items);
+        return;
+    }
+
+    MatchesChunk *chunks = calloc(count, sizeof(MatchesChunk));
+    assert(chunks);
+
+    size_t pending = 0, index = 0;
+    for (size_t i = 0; i < ranges.count; ++i) {
+        for (size_t y = ranges.items[i].start; y < ranges.items[i].end; y += MATCHES_CHUNK) {
+            MatchesChunk *chunk = chunks + index++;
+            chunk->buffer = buffer;
+            chunk->source = pattern;
+            chunk->start = y;
+            chunk->end = MIN(ranges.items[i].end, y + MATCHES_CHUNK);
+            pool_submit(matches_chunk_task, chunk, &pending);
+        }
+    }
+    pool_wait(&pending);
+    free(ranges.items);
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        total += chunks[i].result.count;
+    }
+
+    matches_grow(matches, total);
+    for (size_t i = 0; i < count; ++i) {
+        if (chunks[i].result.count) {
+            memcpy(matches->items + matches->count, chunks[i].result.items, chunks[i].result.count * sizeof(Match));
+            matches->count += chunks[i].result.count;
+        }
+        free(chunks[i].result.items);
+    }
+    free(chunks);
+}
+
+typedef struct {
+    Buffer *buffer;
+    Pattern *source;
+    String with;
+    Vector start;
+    size_t end;
+    size_t count;
+
+    // The lines changed and what they held, to be undone
+    size_t *ys;
+    String *lines;
+    size_t changed;
+    size_t capacity;
+} ReplaceChunk;
+
+void replace_chunk_task(void *arg)
+{
+    ReplaceChunk *chunk = (ReplaceChunk *) arg;
+
+    Pattern pattern = {0};
+    String expanded = {0};
+    pattern_compile(&pattern, chunk->source->source, chunk->source->regex);
+
+    size_t x = chunk->start.x;
+    for (size_t y = chunk->start.y; y < chunk->end; ++y, x = 0) {
+        if (chunk->changed == chunk->capacity) {
+            chunk->capacity += INC_CAP;
+            chunk->ys = realloc(chunk->ys, chunk->capacity * sizeof(size_t));
+            chunk->lines = realloc(chunk->lines, chunk->capacity * sizeof(String));
+            assert(chunk->ys && chunk->lines);
+        }
+
+        const size_t count = string_replace_all(chunk->buffer->lines + y, &pattern, x, chunk->with, &expanded,
+                                                chunk->lines + chunk->changed);
+        if (count) {
+            chunk->ys[chunk->changed++] = y;
+            chunk->count += count;
+        }
+    }
+
+    string_free(&expanded);
+    pattern_free(&pattern);
+}
+
+// Replace every match of PATTERN from START to the end of BUFFER. Each line
+// is rebuilt at most once, and large buffers are processed in parallel over
+// line ranges. Returns the number of replacements.
+size_t buffer_replace_all(Buffer *buffer, Pattern *pattern, String with, Vector start)
+{
+    if (start.y >= buffer->count) {
+        return 0;
+    }
+
+    const size_t lines = buffer->count - start.y;
+    const size_t count = (lines + MATCHES_CHUNK - 1) / MATCHES_CHUNK;
+
+    ReplaceChunk *chunks = calloc(count, sizeof(ReplaceChunk));
+    assert(chunks);
+
+    for (size_t i = 0; i < count; ++i) {
+        chunks[i].buffer = buffer;
+        chunks[i].source = pattern;
+        chunks[i].with = with;
+        chunks[i].start = i ? Vector(0, start.y + i * MATCHES_CHUNK) : start;
+        chunks[i].end = MIN(buffer->count, start.y + (i + 1) * MATCHES_CHUNK);
+    }
+
+    if (count == 1) {
+        replace_chunk_task(chunks);
+    } else {
+        size_t pending = 0;
+        for (size_t i = 0; i < count; ++i) {
+            pool_submit(replace_chunk_task, chunks + i, &pending);
+        }
+        pool_wait(&pending);
+    }
+
+    // The history keeps only the lines that changed, in one sparse change
+    size_t total = 0, changed = 0;
+    for (size_t i = 0; i < count; ++i) {
+        total += chunks[i].count;
+        changed += chunks[i].changed;
+    }
+
+    Change *change = NULL;
+    if (changed && !buffer->locations) {
+        change = undo_push(&buffer->undo, buffer->cursor);
+        change->sparse = true;
+        change->ys = malloc(changed * sizeof(size_t));
+        change->lines = malloc(changed * sizeof(String));
+        assert(change->ys && change->lines);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        ReplaceChunk *chunk = chunks + i;
+        if (change) {
+            memcpy(change->ys + change->count, chunk->ys, chunk->changed * sizeof(size_t));
+            memcpy(change->lines + change->count, chunk->lines, chunk->changed * sizeof(String));
+            change->count += chunk->changed;
+        } else {
+            for (size_t j = 0; j < chunk->changed; ++j) {
+                string_free(chunk->lines + j);
+            }
+        }
+        free(chunk->lines);
+    }
+
+    if (change) {
+        change_measure(change);
+        buffer->undo.bytes += change->bytes;
+        buffer->undo.typing = false;
+    }
+
+    // Only the lines that changed are journaled and indexed again, as in
+    // buffer_splice()
+    if (changed > MATCHES_CHUNK) {
+        buffer->matches.valid = false;
+    }
+    buffer->undo.applying = true;
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t j = 0; j < chunks[i].changed; ++j) {
+            buffer_changed(buffer, chunks[i].ys[j], 1, 1);
+        }
+        free(chunks[i].ys);
+    }
+    buffer->undo.applying = false;
+    free(chunks);
+    return total;
+}
+
+// Collect the matches of PATTERN on the visible lines of BUFFER
+void buffer_visible_matches(Buffer *buffer, Pattern *pattern, Matches *matches)
+{
+    matches->count = 0;
+    const size_t end = MIN(buffer->count, buffer->anchor.y + term.size.y);
+    for (size_t y = buffer->anchor.y; y < end; ++y) {
+        matches_scan(matches, pattern, buffer->lines[y], y);
+    }
+}
+
+// Files
+#define FILES_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+// Every file under the current directory, relative to it. The tree is
+// walked once in the background, and then kept up to date with inotify
+// events for each of its directories.
+typedef struct {
+    String *items;
+    size_t count;
+    size_t capacity;
+
+    // The directory of each watch descriptor
+    String *watches;
+    size_t watches_count;
+
+    int inotify;
+    bool complete;
+    bool loading;
+    size_t generation;
+} Files;
+
+static Files files = {.inotify = -1};
+
+void files_free(Files *files)
+{
+    for (size_t i = 0; i < files->count; ++i) {
+        string_free(&files->items[i]);
+    }
+    free(files->items);
+
+    for (size_t i = 0; i < files->watches_count; ++i) {
+        string_free(&files->watches[i]);
+    }
+    free(files->watches);
+
+    files->items = files->watches = NULL;
+    files->count = files->capacity = files->watches_count = 0;
+}
+
+void files_push(Files *files, String path)
+{
+    if (files->count == files->capacity) {
+        files->capacity += INC_CAP;
+        files->items = realloc(files->items, files->capacity * sizeof(String));
+        assert(files->items);
+    }
+    files->items[files->count++] = path;
+}
+
+// The paths are kept in exactly sized allocations, as there are many of
+// them and each is scanned on every keystroke of the fuzzy finder
+String files_join(const char *directory, const char *name)
+{
+    const size_t size = strlen(directory) + !!*directory + strlen(name);
+    String path = {.data = malloc(size + 1), .size = size, .capacity = size + 1};
+    assert(path.data);
+    snprintf(path.data, size + 1, *directory ? "%s/%s" : "%s%s", directory, name);
+    return path;
+}
+
+// Add the files under DIRECTORY, "" being the current one, watching it and
+// each directory below it
+void files_walk(Files *files, const char *directory)
+{
+    const char *path = *directory ? directory : ".";
+    const int wd = files->inotify < 0 ? -1 : inotify_add_watch(files->inotify, path, FILES_EVENTS);
+    if (wd < 0) {
+        files->complete = false;
+    } else {
+        if ((size_t) wd >= files->watches_count) {
+            files->watches = realloc(files->watches, (wd + 1) * sizeof(String));
+            assert(files->watches);
+            memset(files->watches + files->watches_count, 0, (wd + 1 - files->watches_count) * sizeof(String));
+            files->watches_count = wd + 1;
+        }
+        string_free(&files->watches[wd]);
+        files->watches[wd] = files_join("", directory);
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        String child = files_join(directory, entry->d_name);
+
+        unsigned char type = entry->d_type;
+        struct stat info;
+        if (type == DT_UNKNOWN && lstat(child.data, &info) == 0) {
+            type = S_ISDIR(info.st_mode) ? DT_DIR : S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if (type == DT_DIR) {
+            files_walk(files, child.data);
+            string_free(&child);
+        } else if (type == DT_REG) {
+            files_push(files, child);
+        } else {
+            string_free(&child);
+        }
+    }
+    closedir(dir);
+}
+
+void files_changed(void *arg);
+
+void files_loaded(void *arg)
+{
+    Files *load = (Files *) arg;
+    if (files.inotify >= 0) {
+        events_unwatch(files.inotify);
+        close(files.inotify);
+    }
+    files_free(&files);
+
+    load->generation = files.generation + 1;
+    files = *load;
+    free(load);
+
+    if (files.inotify >= 0) {
+        events_watch(files.inotify, files_changed, NULL);
+    }
+}
+
+void files_load_task(void *arg)
+{
+    files_walk((Files *) arg, "");
+    events_post(files_loaded, arg);
+}
+
+// Walk the tree again in the background. The events of the new watches are
+// only read once it is done, so none of the changes made meanwhile are lost.
+void files_reload(void)
+{
+    if (files.loading) {
+        return;
+    }
+    files.loading = true;
+
+    Files *load = calloc(1, sizeof(Files));
+    assert(load);
+    load->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    load->complete = load->inotify >= 0;
+    pool_submit(files_load_task, load, NULL);
+}
+
+// Remove PATH, or everything under it if it is a directory
+void files_remove(String path, bool directory)
+{
+    for (size_t i = 0; i < files.count;) {
+        const String item = files.items[i];
+        const bool removed = directory
+            ? item.size > path.size && item.data[path.size] == '/' && !memcmp(item.data, path.data, path.size)
+            : item.size == path.size && !memcmp(item.data, path.data, path.size);
+
+        if (removed) {
+            string_free(&files.items[i]);
+            files.items[i] = files.items[--files.count];
+        } else {
+            i++;
+        }
+    }
+
+    // A directory moved away is still watched under its old path
+    for (size_t wd = 0; directory && wd < files.watches_count; ++wd) {
+        const String watch = files.watches[wd];
+        if (watch.size >= path.size && !memcmp(watch.data, path.data, path.size) &&
+            (watch.size == path.size || watch.data[path.size] == '/')) {
+            inotify_rm_watch(files.inotify, wd);
+            string_free(&files.watches[wd]);
+        }
+    }
+}
+
+bool files_contains(String path)
+{
+    for (size_t i = 0; i < files.count; ++i) {
+        if (files.items[i].size == path.size && !memcmp(files.items[i].data, path.data, path.size)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void files_event(const struct inotify_event *event)
+{
+    if (event->mask & IN_IGNORED) {
+        if ((size_t) event->wd < files.watches_count) {
+            string_free(&files.watches[event->wd]);
+        }
+        return;
+    }
+
+    if ((size_t) event->wd >= files.watches_count || !files.watches[event->wd].data ||
+        !event->len || event->name[0] == '.') {
+        return;
+    }
+
+    String path = files_join(files.watches[event->wd].data, event->name);
+    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        struct stat info;
+        if (event->mask & IN_ISDIR) {
+            files_walk(&files, path.data);
+        } else if (lstat(path.data, &info) == 0 && S_ISREG(info.st_mode) && !files_contains(path)) {
+            files_push(&files, path);
+            path = (String) {0};
+        }
+    } else {
+        files_remove(path, event->mask & IN_ISDIR);
+    }
+
+    string_free(&path);
+    files.generation++;
+}
+
+void files_changed(void *arg)
+{
+    (void) arg;
+
+    union {
+        struct inotify_event event;
+        char data[4096];
+    } buffer;
+
+    ssize_t size;
+    while ((size = read(files.inotify, buffer.data, sizeof(buffer))) > 0) {
+        for (const char *event = buffer.data; event < buffer.data + size;) {
+            const struct inotify_event *current = (const struct inotify_event *) event;
+            if (current->mask & IN_Q_OVERFLOW) {
+                files_reload();
+                return;
+            }
+
+            files_event(current);
+            event += sizeof(struct inotify_event) + current->len;
+        }
+    }
+}
+
+// Fuzzy
+#define FUZZY_BOUNDARY 8
+#define FUZZY_CONSECUTIVE 4
+#define FUZZY_BASENAME 2
+
+#define FINDER_ROWS 10
+#define FINDER_CHUNK 16384
+
+static size_t fuzzy_find(String path, size_t from, char ch)
+{
+    const char lower = tolower(ch);
+    const char upper = toupper(ch);
+    while (from < path.size && path.data[from] != lower && path.data[from] != upper) {
+        from++;
+    }
+    return from;
+}
+
+// Match QUERY as a subsequence of PATH, ignoring case. Of the matches ending
+// where the first one does, the shortest is scored by how many characters
+// start a word or follow the previous one, less the characters skipped.
+// POSITIONS, if not NULL, receives where each character of QUERY matched.
+bool fuzzy_match(String path, String query, int *score, size_t *positions)
+{
+    size_t end = 0;
+    for (size_t i = 0; i < query.size; ++i) {
+        end = fuzzy_find(path, end, query.data[i]);
+        if (end == path.size) {
+            return false;
+        }
+        end++;
+    }
+
+    size_t start = end;
+    for (size_t i = query.size; i > 0; --i) {
+        do {
+            start--;
+        } while (tolower(path.data[start]) != tolower(query.data[i - 1]));
+    }
+
+    size_t base = path.size;
+    while (base > 0 && path.data[base - 1] != '/') {
+        base--;
+    }
+
+    *score = -(int) (end - start - query.size);
+    size_t at = start;
+    for (size_t i = 0; i < query.size; ++i) {
+        const size_t previous = at;
+        at = fuzzy_find(path, i ? at + 1 : at, query.data[i]);
+
+        if (!at || strchr("/_-. ", path.data[at - 1])) *score += FUZZY_BOUNDARY;
+        if (i && at == previous + 1) *score += FUZZY_CONSECUTIVE;
+        if (at >= base) *score += FUZZY_BASENAME;
+        if (positions) positions[i] = at;
+    }
+
+    return true;
+}
+
+typedef struct {
+    size_t index;
+    int score;
+} Candidate;
+
+typedef struct {
+    Candidate *items;
+    size_t count;
+    size_t capacity;
+} Candidates;
+
+void candidates_push(Candidates *candidates, Candidate candidate)
+{
+    if (candidates->count == candidates->capacity) {
+        candidates->capacity += INC_CAP;
+        candidates->items = realloc(candidates->items, candidates->capacity * sizeof(Candidate));
+        assert(candidates->items);
+    }
+    candidates->items[candidates->count++] = candidate;
+}
+
+// Higher scores first, then shorter paths
+bool candidate_better(Candidate a, Candidate b)
+{
+    if (a.score != b.score) {
+        return a.score > b.score;
+    }
+
+    const size_t size_a = files.items[a.index].size;
+    const size_t size_b = files.items[b.index].size;
+    return size_a != size_b ? size_a < size_b : a.index < b.index;
+}
+
+// Keep the best FINDER_ROWS candidates in TOP, best first
+void candidates_top(Candidate *top, size_t *count, Candidate candidate)
+{
+    size_t i = *count;
+    if (i == FINDER_ROWS) {
+        if (!candidate_better(candidate, top[i - 1])) {
+            return;
+        }
+        i--;
+    } else {
+        (*count)++;
+    }
+
+    while (i > 0 && candidate_better(candidate, top[i - 1])) {
+        top[i] = top[i - 1];
+        i--;
+    }
+    top[i] = candidate;
+}
+
+typedef struct {
+    const Candidates *from;
+    size_t start;
+    size_t end;
+    String query;
+
+    Candidates matched;
+    Candidate top[FINDER_ROWS];
+    size_t top_count;
+    size_t pending;
+} FinderChunk;
+
+void finder_chunk_task(void *arg)
+{
+    FinderChunk *chunk = (FinderChunk *) arg;
+    chunk->matched.capacity = chunk->end - chunk->start;
+    chunk->matched.items = malloc(MAX(chunk->matched.capacity, 1) * sizeof(Candidate));
+    assert(chunk->matched.items);
+
+    for (size_t i = chunk->start; i < chunk->end; ++i) {
+        Candidate candidate = {.index = chunk->from ? chunk->from->items[i].index : i};
+        if (fuzzy_match(files.items[candidate.index], chunk->query, &candidate.score, NULL)) {
+            candidates_push(&chunk->matched, candidate);
+            candidates_top(chunk->top, &chunk->top_count, candidate);
+        }
+    }
+}
+
+// The files matching a query, and the best of them
+typedef struct {
+    Candidates matched;
+    String query;
+    size_t generation;
+    bool valid;
+
+    Candidate top[FINDER_ROWS];
+    size_t top_count;
+    size_t selected;
+} Finder;
+
+void finder_free(Finder *finder)
+{
+    free(finder->matched.items);
+    string_free(&finder->query);
+}
+
+// Match QUERY against every file. The files are scored in parallel over
+// chunks, and typing one more character only rescores those that matched
+// before, as nothing else can match the longer query.
+void finder_update(Finder *finder, String query)
+{
+    const bool current = finder->valid && finder->generation == files.generation;
+    if (current && query.size == finder->query.size && !memcmp(query.data, finder->query.data, query.size)) {
+        return;
+    }
+
+    const bool narrow = current && query.size > finder->query.size &&
+        !memcmp(query.data, finder->query.data, finder->query.size);
+    const size_t count = narrow ? finder->matched.count : files.count;
+    const size_t chunks_count = MAX(1, (count + FINDER_CHUNK - 1) / FINDER_CHUNK);
+
+    FinderChunk *chunks = calloc(chunks_count, sizeof(FinderChunk));
+    assert(chunks);
+
+    for (size_t i = 0; i < chunks_count; ++i) {
+        FinderChunk *chunk = chunks + i;
+        chunk->from = narrow ? &finder->matched : NULL;
+        chunk->start = i * FINDER_CHUNK;
+        chunk->end = MIN(count, chunk->start + FINDER_CHUNK);
+        chunk->query = query;
+
+        if (chunks_count == 1) {
+            finder_chunk_task(chunk);
+        } else {
+            pool_submit(finder_chunk_task, chunk, &chunk->pending);
+        }
+    }
+
+    Candidates matched = {0};
+    finder->top_count = 0;
+    for (size_t i = 0; i < chunks_count; ++i) {
+        FinderChunk *chunk = chunks + i;
+        pool_wait(&chunk->pending);
+
+        for (size_t j = 0; j < chunk->top_count; ++j) {
+            candidates_top(finder->top, &finder->top_count, chunk->top[j]);
+        }
+
+        if (matched.count + chunk->matched.count > matched.capacity) {
+            matched.capacity = matched.count + chunk->matched.count;
+            matched.items = realloc(matched.items, matched.capacity * sizeof(Candidate));
+            assert(matched.items);
+        }
+        if (chunk->matched.count) {
+            memcpy(matched.items + matched.count, chunk->matched.items, chunk->matched.count * sizeof(Candidate));
+        }
+        matched.count += chunk->matched.count;
+        free(chunk->matched.items);
+    }
+    free(chunks);
+
+    free(finder->matched.items);
+    finder->matched = matched;
+    finder->query.size = 0;
+    string_insert(&finder->query, 0, query.data, query.size);
+    finder->generation = files.generation;
+    finder->valid = true;
+    finder->selected = 0;
+}
+
+// Editor
+typedef struct {
+    Buffer *buffers;
+    size_t count;
+    size_t capacity;
+
+    bool escape;
+    Buffer *buffer;
+
+    String query;
+    Pattern search;
+
+    bool highlight;
+    String status;
+
+    bool idle;
+    struct Grep *grep;
+
+    // The prompt being read, and the last key read for it
+    const char *prompt;
+    void (*callback)(void *userdata);
+    void *userdata;
+    char key;
+
+    // The keys of the last macro. While it is replayed they are read from
+    // it, up to NEXT, until a command fails.
+    String macro;
+    bool recording;
+    bool replaying;
+    size_t next;
+    bool failed;
+
+    // The keys of the script of a batch run, read up to AT in place of the
+    // terminal, the files it saved and the errors it ran into
+    bool batch;
+    String script;
+    size_t at;
+    size_t saved;
+    size_t errors;
+} Editor;
+
+static Editor editor;
+
+void editor_new_buffer(void)
+{
+    if (editor.count == editor.capacity) {
+        editor.capacity = editor.capacity + INC_CAP;
+        editor.buffers = realloc(editor.buffers, editor.capacity * sizeof(Buffer));
+        assert(editor.buffers);
+    }
+
+    editor.buffer = editor.buffers + editor.count++;
+    memset(editor.buffer, 0, sizeof(Buffer));
+}
+
+void editor_delete_buffer(void)
+{
+    if (!editor.count) return;
+
+    if (editor.buffer) {
+        size_t index = editor.buffer - editor.buffers;
+        if (editor.buffer->journal) {
+            journal_discard(editor.buffer->journal, &editor.buffer->disk);
+        }
+        string_free(&editor.buffer->path);
+        buffer_free(editor.buffer);
+        memmove(editor.buffers + index, editor.buffers + index + 1, (editor.count - index - 1) * sizeof(Buffer));
+        editor.count--;
+
+        if (index) index--;
+        editor.buffer = editor.buffers + index;
+    }
+}
+
+void editor_status(const char *format, ...)
+{
+    editor.status.size = 0;
+
+    va_list ap;
+    va_start(ap, format);
+    string_vprintf(&editor.status, format, ap);
+    va_end(ap);
+}
+
+// The matches of the last search in the current buffer, indexed on demand
+Matches *editor_matches(void)
+{
+    Matches *matches = &editor.buffer->matches;
+    if (!matches_of(matches, &editor.search)) {
+        buffer_index_matches(editor.buffer, &editor.search);
+    }
+    return matches;
+}
+
+// Highlight the matches of the last search and show which one the cursor
+// is on
+void editor_show_match(void)
+{
+    if (term.deferred) {
+        return;
+    }
+
+    Matches *matches = editor_matches();
+    const size_t index = matches_find(matches, editor.buffer->cursor);
+
+    editor.highlight = true;
+    if (index < matches->count && vector_eq(matches->items[index].position, editor.buffer->cursor)) {
+        editor_status("Match %zu of %zu", index + 1, matches->count);
+    } else {
+        editor_status("%zu matches", matches->count);
+    }
+}
+
+void editor_render(void)
+{
+    if (term.deferred) {
+        return;
+    }
+
+    Buffer *buffer = editor.buffer;
+    if (editor.highlight && editor.search.source.size) {
+        Matches *matches = editor_matches();
+        const size_t index = matches_find(matches, buffer->cursor);
+
+        size_t size = 0;
+        if (index < matches->count && vector_eq(matches->items[index].position, buffer->cursor)) {
+            size = matches->items[index].size;
+        }
+        buffer_render(*buffer, buffer->cursor, size, matches);
+    } else {
+        buffer_print(*buffer);
+    }
+
+    if (editor.status.size) {
+        term_move(Vector(0, term.size.y + 1));
+        fwrite(editor.status.data, 1, editor.status.size, stdout);
+        term_move(vector_sub(buffer->cursor, buffer->anchor));
+    }
+}
+
+// The callback of the prompt follows every key typed at it, also when the
+// screen is not drawn, and then only keeps its state without drawing
+void editor_prompt_draw(void)
+{
+    if (term.deferred) {
+        if (editor.callback) editor.callback(editor.userdata);
+        return;
+    }
+
+    term_move(Vector(0, term.size.y + 1));
+    fprintf(stdout, "\x1b[J");
+    term_color(COLOR_PROMPT);
+    printf(editor.prompt);
+    term_color_reset();
+    fprintf(stdout, "%.*s", (int) editor.query.size, editor.query.data);
+    term_color_reset();
+
+    if (editor.callback) editor.callback(editor.userdata);
+}
+
+void editor_view_status(void);
+
+void editor_index_status(void)
+{
+    const Buffer *buffer = editor.buffer;
+    if (buffer->view) {
+        editor_view_status();
+        return;
+    }
+
+    const Trigrams *trigrams = &buffer->trigrams;
+    if (!trigrams->enabled) {
+        editor_status("Trigram index off");
+        return;
+    }
+
+    size_t text = 0;
+    for (size_t i = 0; i < buffer->count; ++i) {
+        text += buffer->lines[i].size + 1;
+    }
+
+    const size_t pending = trigrams->blocks[trigrams->count - 1].count;
+    editor_status("Trigram index%s: %zu trigrams in %zu blocks, %.1f MB, %.0f%% of the text",
+                  pending ? " (indexing)" : "", trigrams->postings_count, trigrams->count - 1,
+                  trigrams->memory / 1048576.0, text ? 100.0 * trigrams->memory / text : 0.0);
+}
+
+// A buffer with lines left to index, if any
+Buffer *editor_indexing(void)
+{
+    for (size_t i = 0; i < editor.count; ++i) {
+        const View *view = editor.buffers[i].view;
+        if (view && view->indexed < view->size) {
+            return editor.buffers + i;
+        }
+
+        const Trigrams *trigrams = &editor.buffers[i].trigrams;
+        if (trigrams->enabled && (trigrams->blocks[trigrams->count - 1].count ||
+                                  trigrams->lines != editor.buffers[i].count)) {
+            return editor.buffers + i;
+        }
+    }
+    return NULL;
+}
+
+int editor_journal_sync(void);
+
+// Wait for the next key, running the tasks posted by workers and those of
+// the watched file descriptors meanwhile. The screen or the prompt being
+// read is redrawn after them. Trigram indexes are built while waiting.
+char editor_getchar(void)
+{
+    // A macro that ends in the middle of a command cancels it
+    if (editor.replaying) {
+        if (editor.next < editor.macro.size) {
+            return editor.macro.data[editor.next++];
+        }
+        editor.failed = true;
+        return 27;
+    }
+
+    if (editor.batch) {
+        char ch = 27;
+        if (editor.at < editor.script.size) {
+            ch = editor.script.data[editor.at++];
+        } else {
+            editor.failed = true;
+        }
+        if (editor.recording) {
+            string_insert(&editor.macro, editor.macro.size, &ch, 1);
+        }
+        return ch;
+    }
+
+    fflush(stdout);
+    while (true) {
+        const size_t count = 2 + events.watches_count;
+        struct pollfd fds[count];
+        fds[0] = (struct pollfd) {.fd = STDIN_FILENO, .events = POLLIN};
+        fds[1] = (struct pollfd) {.fd = events.wake[0], .events = POLLIN};
+        for (size_t i = 0; i < events.watches_count; ++i) {
+            fds[i + 2] = (struct pollfd) {.fd = events.watches[i].fd, .events = POLLIN};
+        }
+
+        Buffer *indexing = editor_indexing();
+        const int timeout = editor_journal_sync();
+        const int ready = poll(fds, count, indexing ? 0 : timeout);
+        if (ready < 0) {
+            assert(errno == EINTR);
+            continue;
+        }
+
+        if (!ready) {
+            if (indexing && !buffer_index_step(indexing) && indexing == editor.buffer && editor.idle) {
+                editor_index_status();
+                editor_render();
+                fflush(stdout);
+            }
+            continue;
+        }
+
+        bool ran = false;
+        for (size_t i = 2; i < count; ++i) {
+            if (fds[i].revents) {
+                // The task may unwatch any descriptor, so look it up again
+                for (size_t j = 0; j < events.watches_count; ++j) {
+                    const Watch watch = events.watches[j];
+                    if (watch.fd == fds[i].fd) {
+                        watch.task(watch.arg);
+                        ran = true;
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            events_run();
+            ran = true;
+        }
+
+        if (ran) {
+            if (editor.idle) {
+                editor_render();
+            } else if (editor.prompt) {
+                editor_prompt_draw();
+            }
+            fflush(stdout);
+        }
+
+        char ch;
+        if ((fds[0].revents & POLLIN) && read(STDIN_FILENO, &ch, 1) == 1) {
+            if (editor.recording) {
+                string_insert(&editor.macro, editor.macro.size, &ch, 1);
+            }
+            return ch;
+        }
+    }
+}
+
+String editor_prompt(const char *prompt, void (*callback)(void *userdata), void *userdata)
+{
+    editor.query.size = 0;
+    editor.prompt = prompt;
+    editor.callback = callback;
+    editor.userdata = userdata;
+    editor.key = 0;
+
+    while (true) {
+        editor_prompt_draw();
+
+        const char ch = editor.key = editor_getchar();
+        switch (ch) {
+        case 27:
+        case CTRL('c'):
+            editor.prompt = NULL;
+            return (String) {0};
+
+        case '\r':
+            editor.prompt = NULL;
+            return editor.query;
+
+        case 127:
+            if (editor.query.size) {
+                editor.query.size--;
+            }
+            break;
+
+        default:
+            if (isprint(ch)) {
+                string_insert(&editor.query, editor.query.size, &ch, 1);
+            }
+            break;
+        }
+    }
+}
+
+// The result of searching for the first N characters of the query
+typedef struct {
+    Vector cursor;
+    size_t size;
+    bool found;
+} SearchState;
+
+typedef struct {
+    Vector start;
+    bool forward;
+    bool regex;
+    bool found;
+    Pattern pattern;
+
+    SearchState *states;
+    size_t count;
+    size_t capacity;
+
+    Matches visible;
+} Search;
+
+// Search for the query typed so far. Deleting a character goes back to the
+// result remembered for the shorter query. Typing one continues from the
+// match of the shorter query, since for literal queries any match of the
+// longer one is also a match of the shorter one, and there cannot be one
+// between the start and that match.
+void editor_search_update(Search *search)
+{
+    const size_t depth = editor.query.size;
+    Buffer *buffer = editor.buffer;
+
+    const bool compiled = pattern_compile(&search->pattern, editor.query, search->regex);
+    if (depth < search->count) {
+        search->count = depth + 1;
+        buffer->cursor = search->states[depth].cursor;
+        buffer_anchor_snap(buffer);
+        buffer_anchor_fix(buffer);
+        return;
+    }
+
+    bool found = false;
+    const SearchState previous = search->states[search->count - 1];
+    if (!compiled) {
+        buffer->cursor = search->start;
+    } else if (!search->regex && depth == search->count && depth > 1) {
+        buffer->cursor = search->start;
+        found = previous.found && buffer_search_from(buffer, &search->pattern, previous.cursor, search->forward);
+    } else {
+        buffer->cursor = search->start;
+        found = buffer_search(buffer, &search->pattern, search->forward);
+    }
+
+    if (depth >= search->capacity) {
+        search->capacity = MAX(search->capacity + INC_CAP, depth + 1);
+        search->states = realloc(search->states, search->capacity * sizeof(SearchState));
+        assert(search->states);
+    }
+
+    search->states[depth] = (SearchState) {
+        .cursor = buffer->cursor,
+        .size = found ? pattern_size(&search->pattern) : 0,
+        .found = found,
+    };
+    search->count = depth + 1;
+}
+
+void editor_search_callback(void *userdata)
+{
+    Search *search = (Search *) userdata;
+    editor_search_update(search);
+
+    const SearchState state = search->states[search->count - 1];
+    search->found = state.found;
+
+    if (term.deferred) {
+        return;
+    }
+
+    search->visible.count = 0;
+    if (state.found) {
+        buffer_visible_matches(editor.buffer, &search->pattern, &search->visible);
+    }
+    buffer_render(*editor.buffer, state.cursor, state.size, &search->visible);
+
+    term_move(Vector(0, term.size.y + 1));
+    term_color(COLOR_PROMPT);
+    printf(search->regex ? "Regex search: " : "Search: ");
+
+    if (search->found) {
+        term_color_reset();
+    } else {
+        term_color(COLOR_FAILED);
+    }
+
+    fprintf(stdout, "%.*s", (int) editor.query.size, editor.query.data);
+    term_color_reset();
+}
+
+void editor_error(const char *format, ...);
+
+bool editor_search(bool forward, bool regex)
+{
+    if (!editor.count) return false;
+
+    pattern_free(&editor.search);
+
+    Search search = {
+        .start = editor.buffer->cursor,
+        .found = false,
+        .regex = regex,
+        .forward = forward
+    };
+
+    search.capacity = INC_CAP;
+    search.states = malloc(search.capacity * sizeof(SearchState));
+    assert(search.states);
+    search.states[search.count++] = (SearchState) {.cursor = search.start};
+
+    const String query = editor_prompt(regex ? "Regex search: " : "Search: ", editor_search_callback, &search);
+    free(search.states);
+    matches_free(&search.visible);
+
+    // A macro is replayed until its search fails, which includes wrapping
+    // around the buffer, and a batch script stops there
+    const Vector cursor = editor.buffer->cursor;
+    if ((editor.replaying || editor.batch) && (!query.size || !search.found ||
+                             (forward ? !vector_lt(search.start, cursor) : !vector_lt(cursor, search.start)))) {
+        // Unless the keys ran out in the middle of the prompt, which is
+        // reported once the script stops
+        search.found = false;
+        if (!editor.failed && query.size) {
+            editor_error("No more matches for '%.*s'", (int) query.size, query.data);
+        } else if (!editor.failed) {
+            editor_error("Nothing to search for");
+        }
+    }
+
+    if (query.size && search.found) {
+        editor.search = search.pattern;
+        editor_show_match();
+        return true;
+    }
+
+    pattern_free(&search.pattern);
+    editor.buffer->cursor = search.start;
+    return false;
+}
+
+void editor_search_further(bool forward)
+{
+    if (!editor.count) return;
+    if (editor.replaying || editor.batch) {
+        // A macro searches on its own rather than through the matches, which
+        // are not kept while it is replayed, and fails instead of wrapping
+        Buffer *buffer = editor.buffer;
+        const Vector cursor = buffer->cursor;
+        if (!editor.search.source.size || !buffer_search(buffer, &editor.search, forward) ||
+            (forward ? !vector_lt(cursor, buffer->cursor) : !vector_lt(buffer->cursor, cursor))) {
+            buffer->cursor = cursor;
+            if (editor.search.source.size) {
+                editor_error("No more matches for '%.*s'", (int) editor.search.source.size,
+                             editor.search.source.data);
+            } else {
+                editor_error("Nothing to search for");
+            }
+        }
+    } else if (editor.search.source.size) {
+        Buffer *buffer = editor.buffer;
+        Matches *matches = editor_matches();
+        if (!matches->count) {
+            editor_status("No matches for '%.*s'", (int) editor.search.source.size, editor.search.source.data);
+            return;
+        }
+
+        size_t index;
+        if (forward) {
+            index = matches_find(matches, vector_add(buffer->cursor, Vector(1, 0)));
+            if (index == matches->count) index = 0;
+        } else {
+            index = matches_find(matches, buffer->cursor);
+            index = index ? index - 1 : matches->count - 1;
+        }
+
+        buffer->cursor = matches->items[index].position;
+        buffer_anchor_snap(buffer);
+        buffer_anchor_fix(buffer);
+        editor_show_match();
+    }
+}
+
+void editor_search_forward(void)
+{
+    editor_search(true, false);
+}
+
+void editor_search_further_forward(void)
+{
+    editor_search_further(true);
+}
+
+void editor_search_backward(void)
+{
+    editor_search(false, false);
+}
+
+void editor_search_further_backward(void)
+{
+    editor_search_further(false);
+}
+
+void editor_search_regex_forward(void)
+{
+    editor_search(true, true);
+}
+
+void editor_search_regex_backward(void)
+{
+    editor_search(false, true);
+}
+
+char editor_prompt_char(const char *prompt, const char *valid)
+{
+    if (!term.deferred) {
+        term_move(Vector(0, term.size.y + 1));
+        fprintf(stdout, "\x1b[J");
+        term_color(COLOR_PROMPT);
+        printf("%s (%s): ", prompt, valid);
+        term_color_reset();
+    }
+
+    while (true) {
+        const char ch = tolower(editor_getchar());
+        if (ch == 27 || ch == CTRL('c')) {
+            return '\0';
+        } else if (strchr(valid, ch)) {
+            return ch;
+        }
+    }
+}
+
+void editor_replace_internal(bool regex)
+{
+    if (!editor.count) return;
+
+    if (editor.buffer->view) {
+        editor_status("%s is a read-only view", editor.buffer->path.data);
+        return;
+    }
+
+    if (editor.buffer->load) {
+        editor_status("%s is still loading", editor.buffer->path.data);
+        return;
+    }
+
+    const Pattern search_save = editor.search;
+    memset(&editor.search, 0, sizeof(Pattern));
+
+    if (editor_search(true, regex)) {
+        const String replace_with = editor_prompt("Replace: ", NULL, NULL);
+        String replacement = {0};
+
+        while (true) {
+            Buffer *buffer = editor.buffer;
+            String *line = buffer->lines + buffer->cursor.y;
+            const size_t size = pattern_size(&editor.search);
+
+            buffer_render(*buffer, buffer->cursor, size, NULL);
+
+            const char ch = tolower(editor_prompt_char("Replace", "ynaq"));
+            if (!ch || ch == 'q') {
+                break;
+            }
+
+            if (ch == 'a') {
+                const size_t count = buffer_replace_all(buffer, &editor.search, replace_with, buffer->cursor);
+                editor_status("Replaced %zu occurrences", count);
+                break;
+            }
+
+            const bool replace = ch == 'y';
+
+            // Continue after the match, or after the replacement so it is
+            // never matched again. Empty matches move on by one character.
+            Vector next = vector_add(buffer->cursor, Vector(size + (size == 0), 0));
+            if (replace) {
+                pattern_expand(&editor.search, *line, replace_with, &replacement);
+                buffer_record(buffer, buffer->cursor.y, 1, buffer->cursor, false);
+                string_replace(line, buffer->cursor.x, size, replacement);
+                buffer_changed(buffer, buffer->cursor.y, 1, 1);
+                next.x = buffer->cursor.x + replacement.size + (size == 0);
+            }
+
+            if (!buffer_search_next(buffer, &editor.search, next)) {
+                break;
+            }
+        }
+
+        string_free(&replacement);
+    }
+
+    pattern_free(&editor.search);
+    editor.search = search_save;
+    editor.highlight = false;
+}
+
+void editor_replace(void)
+{
+    editor_replace_internal(false);
+}
+
+void editor_replace_regex(void)
+{
+    editor_replace_internal(true);
+}
+
+void editor_escape_map(void)
+{
+    editor.escape = true;
+}
+
+void editor_error(const char *format, ...)
+{
+    // An error stops the macro being replayed, instead of waiting for a key
+    if (editor.replaying) {
+        editor.failed = true;
+        return;
+    }
+
+    // And a batch run goes on with the next file
+    if (editor.batch) {
+        fprintf(stderr, "meno: %s: ", editor.buffer->path.data);
+        va_list ap;
+        va_start(ap, format);
+        vfprintf(stderr, format, ap);
+        va_end(ap);
+        fputc('\n', stderr);
+
+        editor.failed = true;
+        editor.errors++;
+        return;
+    }
+
+    term_move(Vector(0, term.size.y + 1));
+    term_color(COLOR_FAILED);
+    printf("Error: ");
+
+    va_list ap;
+    va_start(ap, format);
+    vprintf(format, ap);
+    va_end(ap);
+
+    term_color_reset();
+    editor_getchar();
+
+    // The key that dismissed the error is not part of the macro
+    if (editor.recording) {
+        editor.macro.size--;
+    }
+}
+
+// Save
+// A snapshot of the lines of a buffer written to its file on a thread of its
+// own. The snapshot takes the lines as they are and marks them shared in the
+// buffer, which copies a line before changing it, so editing can go on.
+typedef struct Save {
+    char *path;
+    String *lines;
+    uint64_t *hashes;
+    size_t count;
+    Lenders lenders;
+
+    // The changes saved along, and the hash of the contents, see History
+    String history;
+    uint64_t content;
+
+    bool ok;
+    int error;
+    size_t bytes;
+    uint64_t elapsed;
+} Save;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    size_t count;
+} saving = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+void save_done(void *arg);
+void editor_watch(Buffer *buffer);
+void editor_journal_restart(Buffer *buffer);
+
+void *save_thread(void *arg)
+{
+    Save *save = (Save *) arg;
+
+    const uint64_t start = clock_ns();
+    save->ok = save_file(save->path, save->lines, save->count);
+    save->error = errno;
+    save->elapsed = clock_ns() - start;
+
+    if (save->ok) {
+        save->content = hashes_content(save->hashes, save->count);
+        if (save->history.size) {
+            history_append(save->path, &save->history, save->content);
+        }
+    }
+
+    events_post(save_done, save);
+
+    pthread_mutex_lock(&saving.lock);
+    saving.count--;
+    pthread_cond_broadcast(&saving.done);
+    pthread_mutex_unlock(&saving.lock);
+    return NULL;
+}
+
+// Wait until fewer than COUNT saves are still being written
+void save_wait_below(size_t count)
+{
+    pthread_mutex_lock(&saving.lock);
+    while (saving.count >= count) {
+        pthread_cond_wait(&saving.done, &saving.lock);
+    }
+    pthread_mutex_unlock(&saving.lock);
+}
+
+// Wait for the saves still being written
+void save_wait(void)
+{
+    save_wait_below(1);
+}
+
+// Runs on the main thread once the snapshot is written. The lines the buffer
+// still shares go back to it, the others were replaced since and are freed.
+void save_done(void *arg)
+{
+    Save *save = (Save *) arg;
+
+    Buffer *buffer = NULL;
+    for (size_t i = 0; i < editor.count; ++i) {
+        if (editor.buffers[i].save == save) {
+            buffer = editor.buffers + i;
+        }
+    }
+
+    if (buffer) {
+        for (size_t y = 0; y < buffer->count; ++y) {
+            String *line = buffer->lines + y;
+            if (line->capacity & STRING_SHARED) {
+                String *shared = save->lines + (line->capacity & ~STRING_SHARED);
+                line->capacity = shared->capacity;
+                shared->data = NULL;
+            }
+        }
+
+        buffer->save = NULL;
+        Undo *undo = &buffer->undo;
+        if (save->ok) {
+            undo->synced = undo->saving;
+            undo->synced_hash = save->content;
+            undo->is_synced = undo->is_saving;
+        }
+        undo->is_saving = false;
+
+        if (save->ok) {
+            hashes_save(&buffer->hashes, save->hashes, save->count);
+            save->hashes = NULL;
+            stat(buffer->path.data, &buffer->disk);
+            editor_watch(buffer);
+            editor_journal_restart(buffer);
+        }
+
+        // The save replaced the followed file, go on from the end of the new one
+        if (save->ok && buffer->follow) {
+            struct stat statbuf;
+            const int fd = open(buffer->path.data, O_RDONLY | O_CLOEXEC);
+            if (fd != -1 && fstat(fd, &statbuf) == 0) {
+                close(buffer->stream->fd);
+                buffer->stream->fd = fd;
+                buffer->follow->dev = statbuf.st_dev;
+                buffer->follow->ino = statbuf.st_ino;
+                buffer->follow->offset = lseek(fd, 0, SEEK_END);
+            } else if (fd != -1) {
+                close(fd);
+            }
+        }
+    }
+
+    if (editor.batch && save->ok) {
+        editor.saved++;
+    } else if (editor.batch) {
+        fprintf(stderr, "meno: could not save to file '%s': %s\n", save->path, strerror(save->error));
+        editor.errors++;
+    }
+
+    if (save->ok) {
+        editor_status("Saved %s, %zu lines, %.1f MB in %.2fs", save->path, save->count,
+                      save->bytes / 1048576.0, save->elapsed / 1e9);
+    } else {
+        editor_status("Could not save to file '%s': %s", save->path, strerror(save->error));
+    }
+
+    for (size_t i = 0; i < save->count; ++i) {
+        if (!(save->lines[i].capacity & STRING_BORROWED)) {
+            free(save->lines[i].data);
+        }
+    }
+    lenders_free(&save->lenders);
+    string_free(&save->history);
+    free(save->lines);
+    free(save->hashes);
+    free(save->path);
+    free(save);
+}
+
+// Start writing BUFFER to its file in the background
+bool buffer_save(Buffer *buffer)
+{
+    if (buffer->load) {
+        editor_status("Still loading %s", buffer->path.data);
+        return false;
+    }
+
+    if (buffer->save) {
+        editor_status("Still saving %s", buffer->path.data);
+        return false;
+    }
+
+    if (!buffer_modified(buffer)) {
+        editor_status("No changes need to be saved");
+        return true;
+    }
+
+    Save *save = calloc(1, sizeof(Save));
+    assert(save);
+    save->path = strdup(buffer->path.data);
+    assert(save->path);
+    save->count = buffer->count;
+
+    save->hashes = malloc(MAX(buffer->count, 1) * sizeof(uint64_t));
+    assert(save->hashes);
+    memcpy(save->hashes, buffer->hashes.items, buffer->count * sizeof(uint64_t));
+
+    save->lines = malloc(MAX(buffer->count, 1) * sizeof(String));
+    assert(save->lines);
+    for (size_t y = 0; y < buffer->count; ++y) {
+        String *line = buffer->lines + y;
+        save->lines[y] = *line;
+        save->bytes += line->size + 1;
+        if (!(line->capacity & STRING_BORROWED)) {
+            line->capacity = STRING_SHARED | y;
+        }
+    }
+
+    buffer_lenders(buffer, &save->lenders);
+
+    Undo *undo = &buffer->undo;
+    save->history = history_record(undo);
+    undo->saving = undo->current;
+    undo->is_saving = true;
+    buffer->save = save;
+
+    pthread_mutex_lock(&saving.lock);
+    saving.count++;
+    pthread_mutex_unlock(&saving.lock);
+
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, save_thread, save) == 0);
+    pthread_detach(thread);
+
+    editor_status("Saving %s...", save->path);
+    return true;
+}
+
+// Buffers named like *grep* are not backed by a file
+bool buffer_visits_file(const Buffer *buffer)
+{
+    return buffer->path.size && buffer->path.data[0] != '*';
+}
+
+bool editor_save_internal(void)
+{
+    if (!buffer_visits_file(editor.buffer)) {
+        const String path = editor_prompt("Save to: ", NULL, NULL);
+        if (!path.size) {
+            return false;
+        }
+
+        string_free(&editor.buffer->path);
+        editor.buffer->path = string(path.data, path.size);
+        string_insert(&editor.buffer->path, editor.buffer->path.size, "\0", 1);
+    }
+
+    return buffer_save(editor.buffer);
+}
+
+void editor_save(void)
+{
+    if (!editor.count) return;
+    editor_save_internal();
+}
+
+// Save every buffer visiting a file that differs from it
+void editor_save_all(void)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < editor.count; ++i) {
+        Buffer *buffer = editor.buffers + i;
+        if (buffer_visits_file(buffer) && !buffer->save && !buffer->load && buffer_modified(buffer)) {
+            count += buffer_save(buffer);
+        }
+    }
+
+    if (count) {
+        editor_status("Saving %zu buffer%s...", count, count == 1 ? "" : "s");
+    } else {
+        editor_status("No buffers need saving");
+    }
+}
+
+// Append the lines that arrived on the stream of a buffer
+void editor_stream_read(void *arg)
+{
+    Stream *stream = (Stream *) arg;
+
+    Buffer *buffer = NULL;
+    for (size_t i = 0; i < editor.count; ++i) {
+        if (editor.buffers[i].stream == stream) {
+            buffer = editor.buffers + i;
+        }
+    }
+    assert(buffer);
+
+    if (buffer_stream_read(buffer) != STREAM_END) {
+        return;
+    }
+    buffer_stream_flush(buffer);
+
+    const bool command = stream->pid > 0;
+    const int status = stream_close(stream, 0);
+    buffer->stream = NULL;
+
+    if (!command) {
+        editor_status("%s: %zu lines", buffer->path.data, buffer->count);
+    } else if (WIFEXITED(status)) {
+        editor_status("%s: %zu lines, exited with status %d", buffer->path.data, buffer->count, WEXITSTATUS(status));
+    } else {
+        editor_status("%s: %zu lines, killed by signal %d", buffer->path.data, buffer->count, WTERMSIG(status));
+    }
+}
+
+Buffer *editor_find_buffer(String path);
+
+// Show what arrives on FD in the buffer NAME, replacing what it held. PID is
+// the command writing to it, if any.
+void editor_open_stream(const char *name, int fd, pid_t pid)
+{
+    Buffer *buffer = editor_find_buffer((String) {.data = (char *) name, .size = strlen(name)});
+    if (buffer) {
+        buffer_free(buffer);
+    } else {
+        editor_new_buffer();
+        buffer = editor.buffer;
+    }
+
+    buffer->path = string(name, strlen(name) + 1);
+    buffer->chunks = chunks_new();
+    buffer->stream = calloc(1, sizeof(Stream));
+    assert(buffer->stream);
+    buffer->stream->fd = fd;
+    buffer->stream->pid = pid;
+    editor.buffer = buffer;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    events_watch(fd, editor_stream_read, buffer->stream);
+}
+
+// Read what was appended to a followed file. A file that got shorter was
+// truncated and is read again from the start. When another file took its
+// place, the old one is read to the end before switching to the new one.
+void editor_follow_read(void *arg)
+{
+    Buffer *buffer = NULL;
+    for (size_t i = 0; i < editor.count; ++i) {
+        if (editor.buffers[i].follow == arg) {
+            buffer = editor.buffers + i;
+        }
+    }
+
+    // Stopped following meanwhile
+    if (!buffer) {
+        return;
+    }
+
+    Follow *follow = buffer->follow;
+    Stream *stream = buffer->stream;
+    const char *path = buffer->path.data;
+
+    struct stat statbuf;
+    if (fstat(stream->fd, &statbuf) == 0 && statbuf.st_size < follow->offset) {
+        lseek(stream->fd, 0, SEEK_SET);
+        buffer_stream_flush(buffer);
+        hashes_save(&buffer->hashes, NULL, 0);
+        editor_status("%s: file truncated", path);
+    }
+
+    // The incomplete last line is read again along with the lines after it
+    const bool end = buffer->cursor.y + 1 >= buffer->count;
+    const size_t first = buffer->count - stream->partial;
+    if (stream->partial && buffer->hashes.saved_count == buffer->count) {
+        buffer->hashes.saved_count--;
+    }
+    const StreamState state = buffer_stream_read(buffer);
+    follow->offset = lseek(stream->fd, 0, SEEK_CUR);
+    hashes_append_saved(&buffer->hashes, first);
+
+    if (state == STREAM_MORE) {
+        events_post(editor_follow_read, follow);
+    } else if (stat(path, &statbuf) == 0 && (statbuf.st_dev != follow->dev || statbuf.st_ino != follow->ino)) {
+        const int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            buffer_stream_flush(buffer);
+            close(stream->fd);
+            stream->fd = fd;
+            follow->dev = statbuf.st_dev;
+            follow->ino = statbuf.st_ino;
+            follow->offset = 0;
+            hashes_save(&buffer->hashes, NULL, 0);
+            editor_status("%s: file rotated", path);
+            events_post(editor_follow_read, follow);
+        }
+    }
+
+    if (end && buffer->count) {
+        buffer->cursor = Vector(0, buffer->count - 1);
+        buffer_anchor_fix(buffer);
+    }
+}
+
+// Only look at the changes to the followed file among the ones in its
+// directory
+void editor_follow_changed(void *arg)
+{
+    Follow *follow = (Follow *) arg;
+
+    union {
+        struct inotify_event event;
+        char data[4096];
+    } events;
+
+    bool changed = false;
+    ssize_t size;
+    while ((size = read(follow->inotify, events.data, sizeof(events))) > 0) {
+        for (char *p = events.data; p < events.data + size;) {
+            const struct inotify_event *event = (const struct inotify_event *) p;
+            if ((event->mask & IN_Q_OVERFLOW) || (event->len && !strcmp(event->name, follow->name))) {
+                changed = true;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    if (changed) {
+        editor_follow_read(follow);
+    }
+}
+
+// Toggle appending to the buffer whatever is written to the end of its file
+void editor_follow(void)
+{
+    Buffer *buffer = editor.buffer;
+    if (buffer->follow) {
+        buffer_stream_flush(buffer);
+        follow_close(buffer->follow);
+        stream_close(buffer->stream, 0);
+        buffer->follow = NULL;
+        buffer->stream = NULL;
+        editor_status("Stopped following %s", buffer->path.data);
+        return;
+    }
+
+    if (buffer->stream) {
+        editor_error("buffer is already reading a stream");
+        return;
+    }
+
+    if (buffer->load) {
+        editor_error("buffer is still loading");
+        return;
+    }
+
+    if (!buffer_visits_file(buffer)) {
+        editor_error("buffer is not visiting a file");
+        return;
+    }
+
+    if (buffer->view) {
+        editor_error("buffer is a read-only view");
+        return;
+    }
+
+    const char *path = buffer->path.data;
+    const char *slash = strrchr(path, '/');
+    char *directory = slash ? strndup(path, slash - path + 1) : strdup(".");
+    assert(directory);
+
+    struct stat statbuf;
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    const int inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    const bool ok = fd != -1 && fstat(fd, &statbuf) == 0 && inotify != -1 &&
+        inotify_add_watch(inotify, directory, FOLLOW_EVENTS) != -1;
+    free(directory);
+
+    if (!ok) {
+        const int error = errno;
+        if (fd != -1) close(fd);
+        if (inotify != -1) close(inotify);
+        editor_error("could not follow '%s': %s", path, strerror(error));
+        return;
+    }
+
+    // The lines appended from now on are not changes to the file
+    if (buffer->journal) {
+        journal_discard(buffer->journal, &buffer->disk);
+        journal_free(buffer->journal);
+        buffer->journal = NULL;
+    }
+
+    Follow *follow = calloc(1, sizeof(Follow));
+    assert(follow);
+    follow->inotify = inotify;
+    follow->name = strdup(slash ? slash + 1 : path);
+    assert(follow->name);
+    follow->dev = statbuf.st_dev;
+    follow->ino = statbuf.st_ino;
+    follow->offset = statbuf.st_size;
+    lseek(fd, statbuf.st_size, SEEK_SET);
+
+    if (!buffer->chunks) {
+        buffer->chunks = chunks_new();
+    }
+    Chunks *chunks = buffer->chunks;
+
+    buffer->stream = calloc(1, sizeof(Stream));
+    assert(buffer->stream);
+    buffer->stream->fd = fd;
+    buffer->stream->pid = -1;
+    buffer->stream->start = chunks->used;
+    buffer->follow = follow;
+
+    // A file ending in the middle of a line goes on with that line, which
+    // stays on the screen until the rest of it arrives
+    char last;
+    if (statbuf.st_size && pread(fd, &last, 1, statbuf.st_size - 1) == 1 && last != '\n' && buffer->count) {
+        const String *line = buffer->lines + buffer->count - 1;
+        chunks_next(chunks, 0, MAX(CHUNK_SIZE, 2 * line->size));
+        memcpy(chunks->items[chunks->count - 1], line->data, line->size);
+        chunks->used = line->size;
+        buffer->stream->start = 0;
+        buffer->stream->partial = true;
+    }
+
+    buffer->cursor = Vector(0, buffer->count ? buffer->count - 1 : 0);
+    buffer_anchor_fix(buffer);
+
+    events_watch(inotify, editor_follow_changed, follow);
+    editor_status("Following %s", path);
+}
+
+// Start journaling the changes to BUFFER, first replaying the ones left in
+// its journal by a session that did not end cleanly
+void editor_journal(Buffer *buffer)
+{
+    if (!buffer_visits_file(buffer) || buffer->view) {
+        return;
+    }
+
+    Journal *journal = journal_new(buffer->path.data, &buffer->disk);
+    const int fd = open(journal->path, O_RDWR | O_CLOEXEC);
+    struct stat statbuf;
+    if (fd != -1 && fstat(fd, &statbuf) == 0 && statbuf.st_size) {
+        const char *data = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        const JournalHeader header = journal_header(&buffer->disk);
+        size_t records = 0;
+        if (data == MAP_FAILED) {
+            editor_error("could not read '%s': %s", journal->path, strerror(errno));
+        } else if ((size_t) statbuf.st_size < sizeof(header) || memcmp(data, &header, sizeof(header))) {
+            editor_status("Discarded %s, the file changed since it was written", journal->path);
+        } else {
+            const size_t valid = buffer_replay(buffer, data, statbuf.st_size, &records);
+            if (records && ftruncate(fd, valid) == 0 && lseek(fd, 0, SEEK_END) != -1) {
+                journal->fd = fd;
+                buffer_anchor_fix(buffer);
+                editor_status("Recovered %zu change%s to %s from %s", records, records == 1 ? "" : "s",
+                              buffer->path.data, journal->path);
+            }
+        }
+
+        if (data != MAP_FAILED) {
+            munmap((void *) data, statbuf.st_size);
+        }
+    }
+
+    if (fd != -1 && journal->fd != fd) {
+        close(fd);
+        unlink(journal->path);
+    }
+    buffer->journal = journal;
+}
+
+// The file of BUFFER was just written, the journal goes on from it with the
+// changes made while it was being written, if any
+void editor_journal_restart(Buffer *buffer)
+{
+    if (!buffer->journal) {
+        buffer->journal = journal_new(buffer->path.data, &buffer->disk);
+    }
+    journal_discard(buffer->journal, &buffer->disk);
+
+    Hashes *hashes = &buffer->hashes;
+    if (buffer_modified(buffer)) {
+        const size_t common = MIN(hashes->count, hashes->saved_count);
+        size_t first = 0, last = 0;
+        while (first < common && hashes->items[first] == hashes->saved[first]) {
+            first++;
+        }
+        while (last < common - first &&
+               hashes->items[hashes->count - 1 - last] == hashes->saved[hashes->saved_count - 1 - last]) {
+            last++;
+        }
+        journal_record(buffer->journal, buffer->lines, first, hashes->saved_count - first - last,
+                       hashes->count - first - last);
+    }
+}
+
+// Write the journals that are due. Returns the milliseconds until the next
+// one is, or -1.
+int editor_journal_sync(void)
+{
+    const uint64_t now = clock_ns();
+    uint64_t next = UINT64_MAX;
+    for (size_t i = 0; i < editor.count; ++i) {
+        Journal *journal = editor.buffers[i].journal;
+        if (journal && journal->since) {
+            const uint64_t due = journal->since + JOURNAL_INTERVAL * 1000000ull;
+            if (due <= now) {
+                journal_write(journal);
+            } else {
+                next = MIN(next, due);
+            }
+        }
+    }
+    return next == UINT64_MAX ? -1 : (int) ((next - now) / 1000000 + 1);
+}
+
+// Load
+// The files given on the command line are read on the pool, each into a
+// buffer of its own that is moved into the buffer waiting for it once done,
+// so that the workers never point into editor.buffers.
+typedef struct Load {
+    Buffer buffer;
+} Load;
+
+static struct {
+    size_t pending;
+    size_t count;
+    uint64_t start;
+} loading;
+
+void load_done(void *arg);
+
+void load_task(void *arg)
+{
+    Load *load = (Load *) arg;
+    buffer_open(&load->buffer);
+    buffer_detect_syntax(&load->buffer);
+    events_post(load_done, load);
+}
+
+void load_done(void *arg)
+{
+    Load *load = (Load *) arg;
+
+    Buffer *buffer = NULL;
+    for (size_t i = 0; i < editor.count; ++i) {
+        if (editor.buffers[i].load == load) {
+            buffer = editor.buffers + i;
+        }
+    }
+
+    string_free(&load->buffer.path);
+    if (buffer) {
+        load->buffer.path = buffer->path;
+        *buffer = load->buffer;
+        editor_watch(buffer);
+        editor_journal(buffer);
+    } else {
+        buffer_free(&load->buffer);
+    }
+    free(load);
+
+    if (--loading.pending == 0 && loading.count > 1 && !editor.status.size) {
+        editor_status("Loaded %zu files in %.2fs", loading.count, (clock_ns() - loading.start) / 1e9);
+    }
+}
+
+// Read the file of BUFFER on the pool, it stays empty and read-only until then
+void editor_load(Buffer *buffer)
+{
+    if (!loading.pending) {
+        loading.count = 0;
+        loading.start = clock_ns();
+    }
+    loading.pending++;
+    loading.count++;
+
+    Load *load = calloc(1, sizeof(Load));
+    assert(load);
+    load->buffer.path = string(buffer->path.data, buffer->path.size);
+    buffer->load = load;
+    pool_submit(load_task, load, NULL);
+}
+
+// Reload
+#define RELOAD_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO)
+
+// The directories of the files visited by buffers are watched, so that the
+// buffers can be brought up to date when other programs change the files
+static struct {
+    int inotify;
+} reload = {.inotify = -1};
+
+bool stat_same(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+        a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// Bring BUFFER up to date with its file if another program changed it, as
+// long as it has no changes of its own
+void editor_reload(Buffer *buffer)
+{
+    const char *path = buffer->path.data;
+    if (buffer->save || buffer->stream || buffer->view || !buffer_visits_file(buffer)) {
+        return;
+    }
+
+    struct stat statbuf;
+    if (stat(path, &statbuf) == -1 || stat_same(&statbuf, &buffer->disk)) {
+        return;
+    }
+
+    if (buffer_modified(buffer)) {
+        editor_status("%s changed on disk, not reloading over unsaved changes", path);
+        return;
+    }
+
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+
+    const char *data = "";
+    if (fstat(fd, &statbuf) == 0 && statbuf.st_size) {
+        data = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        return;
+    }
+
+    const uint64_t start = clock_ns();
+    Hunks hunks = {0};
+    buffer_reload(buffer, data, statbuf.st_size, &hunks);
+    buffer->disk = statbuf;
+    if (buffer->journal) {
+        journal_discard(buffer->journal, &buffer->disk);
+    }
+
+    if (statbuf.st_size) {
+        munmap((void *) data, statbuf.st_size);
+    }
+
+    editor_status("Reloaded %s, %zu hunk%s changed in %.1fms", path, hunks.count,
+                  hunks.count == 1 ? "" : "s", (clock_ns() - start) / 1e6);
+    free(hunks.items);
+}
+
+void editor_reload_changed(void *arg)
+{
+    (void) arg;
+
+    union {
+        struct inotify_event event;
+        char data[4096];
+    } events;
+
+    ssize_t size;
+    while ((size = read(reload.inotify, events.data, sizeof(events))) > 0) {
+        for (char *p = events.data; p < events.data + size;) {
+            const struct inotify_event *event = (const struct inotify_event *) p;
+            for (size_t i = 0; i < editor.count; ++i) {
+                Buffer *buffer = editor.buffers + i;
+                const char *slash = strrchr(buffer->path.data ? buffer->path.data : "", '/');
+                const char *name = slash ? slash + 1 : buffer->path.data;
+                if ((event->mask & IN_Q_OVERFLOW) ||
+                    (buffer->watch == event->wd && event->len && !strcmp(name, event->name))) {
+                    editor_reload(buffer);
+                }
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+// Watch the directory of the file BUFFER visits
+void editor_watch(Buffer *buffer)
+{
+    if (!buffer_visits_file(buffer)) {
+        return;
+    }
+
+    if (reload.inotify == -1) {
+        reload.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (reload.inotify == -1) {
+            return;
+        }
+        events_watch(reload.inotify, editor_reload_changed, NULL);
+    }
+
+    const char *path = buffer->path.data;
+    const char *slash = strrchr(path, '/');
+    char *directory = slash ? strndup(path, slash - path + 1) : strdup(".");
+    assert(directory);
+
+    const int watch = inotify_add_watch(reload.inotify, directory, RELOAD_EVENTS);
+    buffer->watch = watch == -1 ? 0 : watch;
+    free(directory);
+}
+
+// Run a command with the shell, its output streamed into *shell*
+void editor_shell_command(void)
+{
+    const String command = editor_prompt("Shell command: ", NULL, NULL);
+    if (!command.size) {
+        return;
+    }
+
+    int fds[2];
+    if (pipe(fds) == -1) {
+        editor_error("could not run command: %s", strerror(errno));
+        return;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    char *line = strndup(command.data, command.size);
+    assert(line);
+
+    const pid_t pid = fork();
+    if (pid == 0) {
+        // Its own process group, so the whole pipeline can be killed
+        setpgid(0, 0);
+        const int null = open("/dev/null", O_RDONLY);
+        dup2(null, STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        execl("/bin/sh", "sh", "-c", line, (char *) NULL);
+        _exit(127);
+    }
+
+    free(line);
+    close(fds[1]);
+    if (pid == -1) {
+        close(fds[0]);
+        editor_error("could not run command: %s", strerror(errno));
+        return;
+    }
+
+    editor_open_stream("*shell*", fds[0], pid);
+}
+
+bool cstr_string_eq(const char *a, String b)
+{
+    return strlen(a) == b.size && !memcmp(a, b.data, b.size);
+}
+
+Buffer *editor_find_buffer(String path)
+{
+    for (size_t i = 0; i < editor.count; ++i) {
+        if (editor.buffers[i].path.data && cstr_string_eq(editor.buffers[i].path.data, path)) {
+            return editor.buffers + i;
+        }
+    }
+    return NULL;
+}
+
+bool editor_switch_buffer_internal(String path)
+{
+    Buffer *buffer = editor_find_buffer(path);
+    if (buffer) {
+        editor.buffer = buffer;
+    }
+    return buffer;
+}
+
+void editor_switch_buffer(void)
+{
+    const String path = editor_prompt("Switch buffer: ", NULL, NULL);
+    if (!path.size) {
+        return;
+    }
+
+    if (!editor_switch_buffer_internal(path)) {
+        editor_error("no such buffer '%.*s'", (int) path.size, path.data);
+    }
+}
+
+void editor_open_file(String path)
+{
+    if (!editor_switch_buffer_internal(path)) {
+        editor_new_buffer();
+        editor.buffer->path = string(path.data, path.size);
+        string_insert(&editor.buffer->path, editor.buffer->path.size, "\0", 1);
+        buffer_open(editor.buffer);
+        buffer_detect_syntax(editor.buffer);
+        editor_watch(editor.buffer);
+        editor_journal(editor.buffer);
+    }
+}
+
+void editor_find_file_callback(void *userdata)
+{
+    Finder *finder = (Finder *) userdata;
+    const String query = editor.query;
+
+    // Paths starting like these are opened as typed
+    const bool literal = query.size && (query.data[0] == '/' || query.data[0] == '~' ||
+                                        (query.size > 1 && !memcmp(query.data, "./", 2)));
+    if (literal) {
+        finder->valid = false;
+        finder->matched.count = finder->top_count = 0;
+    } else {
+        finder_update(finder, query);
+    }
+
+    if (editor.key == CTRL('n') && finder->selected + 1 < finder->top_count) {
+        finder->selected++;
+    } else if (editor.key == CTRL('p') && finder->selected) {
+        finder->selected--;
+    }
+    editor.key = 0;
+
+    if (term.deferred) {
+        return;
+    }
+
+    size_t positions[query.size + 1];
+    for (size_t i = 0; i < MIN(FINDER_ROWS, term.size.y); ++i) {
+        string_insert(&screen.row, 0, "\x1b[0m", 4);
+
+        if (i < finder->top_count) {
+            const bool selected = i == finder->selected;
+            const String path = files.items[finder->top[i].index];
+
+            int score;
+            fuzzy_match(path, query, &score, positions);
+            if (selected) screen_color(COLOR_VISUAL);
+
+            size_t next = 0;
+            for (size_t x = 0; x < MIN(path.size, term.size.x); ++x) {
+                const bool matched = next < query.size && positions[next] == x;
+                if (matched) {
+                    screen_color(COLOR_PROMPT);
+                    next++;
+                }
+
+                string_insert(&screen.row, screen.row.size, path.data + x, 1);
+
+                if (matched) {
+                    string_insert(&screen.row, screen.row.size, "\x1b[0m", 4);
+                    if (selected) screen_color(COLOR_VISUAL);
+                }
             }
         }
+
+        screen_commit(term.size.y - 1 - i);
     }
 
-    return false;
+    if (files.loading) {
+        printf("  [indexing]");
+    } else if (!literal) {
+        printf("  [%zu/%zu]", finder->matched.count, files.count);
+    }
+    screen_present(Vector(strlen(editor.prompt) + query.size, term.size.y));
+}
 
-found:
-    buffer_anchor_snap(buffer);
-    buffer_anchor_fix(buffer);
+// PATH with a leading ~ or ~user replaced by the home directory, as a shell
+// would do, when there is one
+String path_expand_home(String path)
+{
+    const char *slash = memchr(path.data, '/', path.size);
+    const size_t prefix = path.size && path.data[0] == '~' ? (slash ? (size_t) (slash - path.data) : path.size) : 0;
+
+    const char *home = NULL;
+    if (prefix == 1) {
+        home = getenv("HOME");
+    } else if (prefix > 1) {
+        char user[prefix];
+        memcpy(user, path.data + 1, prefix - 1);
+        user[prefix - 1] = '\0';
+        const struct passwd *entry = getpwnam(user);
+        home = entry ? entry->pw_dir : NULL;
+    }
+
+    String result = {0};
+    const size_t skipped = home ? prefix : 0;
+    if (home) {
+        string_insert(&result, 0, home, strlen(home));
+    }
+    string_insert(&result, result.size, path.data + skipped, path.size - skipped);
+    return result;
+}
+
+// Open a file picked by fuzzy matching the query against the files under
+// the current directory, or the one typed if none match. C-n and C-p move
+// between the best matches.
+void editor_find_file(void)
+{
+    if (!files.complete) {
+        files_reload();
+    }
+
+    Finder finder = {0};
+    const String query = editor_prompt("Find file: ", editor_find_file_callback, &finder);
+
+    if (editor.key == '\r' && finder.top_count) {
+        editor_open_file(files.items[finder.top[finder.selected].index]);
+    } else if (query.size) {
+        String path = path_expand_home(query);
+        editor_open_file(path);
+        string_free(&path);
+    }
+
+    finder_free(&finder);
+}
+
+// Switch to the buffer called NAME, creating it if needed, and empty it.
+// Its lines are locations of the form "path:line:column: text".
+Buffer *editor_locations_buffer(const char *name)
+{
+    const String path = {.data = (char *) name, .size = strlen(name)};
+    if (editor_switch_buffer_internal(path)) {
+        const String save = editor.buffer->path;
+        buffer_free(editor.buffer);
+        editor.buffer->path = save;
+    } else {
+        editor_new_buffer();
+        editor.buffer->path = string(name, path.size + 1);
+    }
+
+    editor.buffer->locations = true;
+    return editor.buffer;
+}
+
+static bool location_number(SV *view, size_t *number)
+{
+    size_t size = 0;
+    *number = 0;
+    while (size < view->size && isdigit(view->data[size])) {
+        *number = *number * 10 + view->data[size++] - '0';
+    }
+
+    if (!size || size == view->size || view->data[size] != ':') {
+        return false;
+    }
+
+    sv_advance(view, size + 1);
     return true;
 }
 
-// Editor
-typedef struct {
-    Buffer *buffers;
-    size_t count;
-    size_t capacity;
+// Parse a location line. The path is whatever comes before the first
+// ":line:column:" which follows it.
+bool location_parse(String line, SV *path, Vector *position)
+{
+    for (size_t i = 0; i < line.size; ++i) {
+        if (line.data[i] == ':') {
+            SV view = sv(line.data + i + 1, line.size - i - 1);
+            size_t y, x;
+            if (location_number(&view, &y) && location_number(&view, &x) && y && x) {
+                *path = sv(line.data, i);
+                *position = Vector(x - 1, y - 1);
+                return true;
+            }
+        }
+    }
+    return false;
+}
 
-    bool escape;
+// Jump to the location under the cursor in a locations buffer
+void editor_visit_location(void)
+{
+    const Buffer *buffer = editor.buffer;
+    if (buffer->cursor.y >= buffer->count) {
+        return;
+    }
+
+    SV path;
+    Vector position;
+    if (!location_parse(buffer->lines[buffer->cursor.y], &path, &position)) {
+        editor_error("no location on this line");
+        return;
+    }
+
+    editor_open_file((String) {.data = (char *) path.data, .size = path.size});
+
+    Buffer *target = editor.buffer;
+    if (target->count) {
+        target->cursor.y = MIN(position.y, target->count - 1);
+        target->cursor.x = MIN(position.x, target->lines[target->cursor.y].size);
+        buffer_anchor_snap(target);
+        buffer_anchor_fix(target);
+    }
+}
+
+typedef struct {
     Buffer *buffer;
+    String *query;
+    size_t start;
+    size_t end;
 
-    String query;
-    String search;
-} Editor;
+    Buffer result;
+    size_t pending;
+} OccurChunk;
 
-static Editor editor;
+void occur_chunk_task(void *arg)
+{
+    OccurChunk *chunk = (OccurChunk *) arg;
+    const Buffer *buffer = chunk->buffer;
+    const SV path = sv_rtrim(sv(buffer->path.data, buffer->path.size), '\0');
 
-void editor_new_buffer(void)
+    Pattern pattern = {0};
+    pattern_compile(&pattern, *chunk->query, true);
+
+    for (size_t y = chunk->start; y < chunk->end; ++y) {
+        const String line = buffer->lines[y];
+
+        size_t x = 0;
+        while (x <= line.size && pattern_search_forward(&pattern, line, &x)) {
+            String location = {0};
+            string_printf(&location, SVFmt":%zu:%zu: %.*s", SVArg(path), y + 1, x + 1, (int) line.size, line.data);
+            buffer_push(&chunk->result, location);
+
+            const size_t size = pattern_size(&pattern);
+            x += size ? size : 1;
+        }
+    }
+
+    pattern_free(&pattern);
+}
+
+// Search every open buffer for a regex. Each buffer is split into chunks of
+// lines which are searched on the worker pool, and the results are added to
+// the *occur* buffer in order as soon as each chunk is done.
+void editor_occur(void)
 {
-    if (editor.count == editor.capacity) {
-        editor.capacity = editor.capacity + INC_CAP;
-        editor.buffers = realloc(editor.buffers, editor.capacity * sizeof(Buffer));
-        assert(editor.buffers);
+    const String query = editor_prompt("Search buffers: ", NULL, NULL);
+    if (!query.size) {
+        return;
     }
 
-    editor.buffer = editor.buffers + editor.count++;
-    memset(editor.buffer, 0, sizeof(Buffer));
+    Pattern check = {0};
+    if (!pattern_compile(&check, query, true)) {
+        editor_error("invalid regex: %s", check.compiled.error);
+        pattern_free(&check);
+        return;
+    }
+
+    // The results buffer must exist before the workers get pointers into
+    // editor.buffers, as creating it may move them
+    Buffer *results = editor_locations_buffer("*occur*");
+
+    size_t count = 0;
+    for (size_t i = 0; i < editor.count; ++i) {
+        if (editor.buffers + i != results) {
+            count += MAX(1, (editor.buffers[i].count + MATCHES_CHUNK - 1) / MATCHES_CHUNK);
+        }
+    }
+
+    OccurChunk *chunks = calloc(MAX(count, 1), sizeof(OccurChunk));
+    assert(chunks);
+
+    size_t index = 0;
+    for (size_t i = 0; i < editor.count; ++i) {
+        Buffer *buffer = editor.buffers + i;
+        if (buffer == results) {
+            continue;
+        }
+
+        size_t start = 0;
+        do {
+            OccurChunk *chunk = chunks + index++;
+            chunk->buffer = buffer;
+            chunk->query = &check.source;
+            chunk->start = start;
+            chunk->end = MIN(buffer->count, start + MATCHES_CHUNK);
+            pool_submit(occur_chunk_task, chunk, &chunk->pending);
+            start = chunk->end;
+        } while (start < buffer->count);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        pool_wait(&chunks[i].pending);
+
+        Buffer *result = &chunks[i].result;
+        for (size_t j = 0; j < result->count; ++j) {
+            buffer_push(results, result->lines[j]);
+        }
+        free(result->lines);
+
+        if (result->count) {
+            editor_status("Searching... %zu matches", results->count);
+            editor_render();
+        }
+    }
+
+    free(chunks);
+    pattern_free(&check);
+
+    editor_status("%zu matches", results->count);
 }
 
-void editor_delete_buffer(void)
+// Grep
+#define GREP_BINARY_CHECK 8192
+
+// A search of every file under the current directory, running in the
+// background. Directories are walked and files searched on the worker pool,
+// and the matches of each file are posted to the main thread, which adds them
+// to the *grep* buffer. A newer search cancels the running one.
+typedef struct Grep {
+    String source;
+    bool regex;
+
+    pthread_mutex_t lock;
+    bool cancelled;
+    size_t pending;
+
+    size_t files;
+    size_t binary;
+    size_t matches;
+    uint64_t open_ns;
+    uint64_t started;
+} Grep;
+
+typedef struct {
+    Grep *grep;
+    char *path;
+} GrepPath;
+
+typedef struct {
+    Grep *grep;
+    Buffer result;
+} GrepResult;
+
+bool grep_cancelled(Grep *grep)
 {
-    if (!editor.count) return;
+    pthread_mutex_lock(&grep->lock);
+    const bool cancelled = grep->cancelled;
+    pthread_mutex_unlock(&grep->lock);
+    return cancelled;
+}
 
-    if (editor.buffer) {
-        size_t index = editor.buffer - editor.buffers;
-        buffer_free(editor.buffer);
-        string_free(&editor.buffer->path);
-        memmove(editor.buffers + index, editor.buffer + index + 1, (editor.count - index) * sizeof(Buffer));
+void grep_spawn(Grep *grep, Task task, char *path)
+{
+    GrepPath *arg = malloc(sizeof(GrepPath));
+    assert(arg);
+    arg->grep = grep;
+    arg->path = path;
 
-        if (index) index--;
-        editor.buffer = editor.buffers + index;
+    pthread_mutex_lock(&grep->lock);
+    grep->pending++;
+    pthread_mutex_unlock(&grep->lock);
+
+    pool_submit(task, arg, NULL);
+}
+
+void grep_done(void *arg);
+
+// Called at the end of every task. The last one reports the search as done,
+// after all the results, since events run in the order they were posted.
+void grep_finish(GrepPath *arg)
+{
+    Grep *grep = arg->grep;
+    free(arg->path);
+    free(arg);
+
+    pthread_mutex_lock(&grep->lock);
+    const bool last = --grep->pending == 0;
+    pthread_mutex_unlock(&grep->lock);
+
+    if (last) {
+        events_post(grep_done, grep);
     }
 }
 
-String editor_prompt(const char *prompt, void (*callback)(void *userdata), void *userdata)
+// Add a location for every match of PATTERN in the SIZE bytes at DATA.
+// Literal patterns skip straight to the next match in the whole file, and
+// only count the lines they skip over. Regex patterns try each line.
+void grep_scan(Pattern *pattern, const char *path, const char *data, size_t size, Buffer *result)
 {
-    editor.query.size = 0;
+    size_t start = 0;
+    size_t number = 1;
+    while (start < size) {
+        if (!pattern->regex) {
+            const char *found = memifind(data + start, size - start, pattern->source.data, pattern->source.size);
+            if (!found) {
+                break;
+            }
 
-    while (true) {
-        term_move(Vector(0, term.size.y + 1));
-        fprintf(stdout, "\x1b[J");
-        term_color(COLOR_PROMPT);
-        printf(prompt);
-        term_color_reset();
-        fprintf(stdout, "%.*s", (int) editor.query.size, editor.query.data);
-        term_color_reset();
+            const char *newline;
+            while ((newline = memchr(data + start, '\n', found - data - start))) {
+                start = newline - data + 1;
+                number++;
+            }
+        }
 
-        if (callback) callback(userdata);
+        const char *newline = memchr(data + start, '\n', size - start);
+        const size_t end = newline ? (size_t) (newline - data) : size;
+        const String line = {.data = (char *) data + start, .size = end - start};
 
-        const char ch = getchar();
-        switch (ch) {
-        case 27:
-        case CTRL('c'):
-            return (String) {0};
+        size_t x = 0;
+        while (x <= line.size && pattern_search_forward(pattern, line, &x)) {
+            String location = {0};
+            string_printf(&location, "%s:%zu:%zu: %.*s", path, number, x + 1, (int) line.size, line.data);
+            buffer_push(result, location);
 
-        case '\r':
-            return editor.query;
+            const size_t size = pattern_size(pattern);
+            x += size ? size : 1;
+        }
 
-        case 127:
-            if (editor.query.size) {
-                editor.query.size--;
+        start = end + 1;
+        number++;
+    }
+}
+
+void grep_deliver(void *arg)
+{
+    GrepResult *result = (GrepResult *) arg;
+    const String name = {.data = "*grep*", .size = 6};
+    Buffer *results = editor.grep == result->grep ? editor_find_buffer(name) : NULL;
+    const size_t first = results ? results->count : 0;
+
+    for (size_t i = 0; i < result->result.count; ++i) {
+        if (results) {
+            buffer_push(results, result->result.lines[i]);
+        } else {
+            string_free(&result->result.lines[i]);
+        }
+    }
+    free(result->result.lines);
+    free(result);
+
+    if (results) {
+        buffer_changed(results, first, 0, results->count - first);
+        editor_status("Grep: %zu matches...", results->count);
+    }
+}
+
+void grep_file_task(void *arg)
+{
+    GrepPath *file = (GrepPath *) arg;
+    Grep *grep = file->grep;
+    if (grep_cancelled(grep)) {
+        grep_finish(file);
+        return;
+    }
+
+    const uint64_t start = clock_ns();
+    const int fd = open(file->path, O_RDONLY);
+    struct stat info;
+    char *data = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0) {
+        data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    const uint64_t elapsed = clock_ns() - start;
+
+    if (data == MAP_FAILED) {
+        grep_finish(file);
+        return;
+    }
+
+    const size_t size = info.st_size;
+    const bool binary = memchr(data, '\0', MIN(size, GREP_BINARY_CHECK));
+
+    GrepResult *result = calloc(1, sizeof(GrepResult));
+    assert(result);
+    result->grep = grep;
+
+    if (!binary) {
+        Pattern pattern = {0};
+        pattern_compile(&pattern, grep->source, grep->regex);
+        const char *path = strncmp(file->path, "./", 2) ? file->path : file->path + 2;
+        grep_scan(&pattern, path, data, size, &result->result);
+        pattern_free(&pattern);
+    }
+    munmap(data, size);
+
+    pthread_mutex_lock(&grep->lock);
+    grep->files++;
+    grep->binary += binary;
+    grep->matches += result->result.count;
+    grep->open_ns += elapsed;
+    pthread_mutex_unlock(&grep->lock);
+
+    if (result->result.count) {
+        events_post(grep_deliver, result);
+    } else {
+        free(result);
+    }
+    grep_finish(file);
+}
+
+void grep_directory_task(void *arg)
+{
+    GrepPath *directory = (GrepPath *) arg;
+    Grep *grep = directory->grep;
+
+    DIR *dir = grep_cancelled(grep) ? NULL : opendir(directory->path);
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir))) {
+            // Skip hidden files and directories, which includes . and ..
+            if (entry->d_name[0] == '.') {
+                continue;
             }
-            break;
 
-        default:
-            if (isprint(ch)) {
-                string_insert(&editor.query, editor.query.size, &ch, 1);
+            String path = {0};
+            string_printf(&path, "%s/%s", directory->path, entry->d_name);
+
+            unsigned char type = entry->d_type;
+            struct stat info;
+            if (type == DT_UNKNOWN && lstat(path.data, &info) == 0) {
+                type = S_ISDIR(info.st_mode) ? DT_DIR : S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+
+            if (type == DT_DIR) {
+                grep_spawn(grep, grep_directory_task, path.data);
+            } else if (type == DT_REG) {
+                grep_spawn(grep, grep_file_task, path.data);
+            } else {
+                string_free(&path);
             }
-            break;
         }
+        closedir(dir);
     }
+
+    grep_finish(directory);
 }
 
-typedef struct {
-    Vector start;
-    bool forward;
-    bool found;
-} Search;
+void grep_done(void *arg)
+{
+    Grep *grep = (Grep *) arg;
+    if (editor.grep == grep) {
+        editor.grep = NULL;
+        editor_status("Grep: %zu matches in %zu files in %.2fs, %zu binary skipped, %.1fus per file to open",
+                      grep->matches, grep->files, (clock_ns() - grep->started) / 1e9, grep->binary,
+                      grep->files ? grep->open_ns / 1000.0 / grep->files : 0.0);
+    }
 
-void editor_search_callback(void *userdata)
+    string_free(&grep->source);
+    pthread_mutex_destroy(&grep->lock);
+    free(grep);
+}
+
+// Search the files under the current directory. The query is a regex, but
+// one without special characters is searched for as a literal.
+void editor_grep(void)
 {
-    Search *search = (Search *) userdata;
-    editor.buffer->cursor = search->start;
-    search->found = buffer_search(editor.buffer, editor.query, search->forward);
-    buffer_print(*editor.buffer);
+    const String query = editor_prompt("Grep: ", NULL, NULL);
+    if (!query.size) {
+        return;
+    }
 
-    if (search->found) {
-        term_color(COLOR_SEARCH);
-        printf("%.*s", (int) editor.query.size, editor.buffer->lines[editor.buffer->cursor.y].data + editor.buffer->cursor.x);
-        term_color_reset();
+    const bool regex = pattern_special(query);
+
+    Pattern check = {0};
+    if (!pattern_compile(&check, query, regex)) {
+        editor_error("invalid regex: %s", check.compiled.error);
+        pattern_free(&check);
+        return;
     }
+    pattern_free(&check);
 
-    term_move(Vector(0, term.size.y + 1));
-    term_color(COLOR_PROMPT);
-    printf("Search: ");
+    if (editor.grep) {
+        pthread_mutex_lock(&editor.grep->lock);
+        editor.grep->cancelled = true;
+        pthread_mutex_unlock(&editor.grep->lock);
+    }
 
-    if (search->found) {
-        term_color_reset();
+    Grep *grep = calloc(1, sizeof(Grep));
+    assert(grep);
+    grep->source = string(query.data, query.size);
+    grep->regex = regex;
+    grep->started = clock_ns();
+    pthread_mutex_init(&grep->lock, NULL);
+    editor.grep = grep;
+
+    editor_locations_buffer("*grep*");
+    editor_status("Grep: searching...");
+
+    char *root = strdup(".");
+    assert(root);
+    grep_spawn(grep, grep_directory_task, root);
+}
+
+// Turn the trigram index of the current buffer on or off
+void editor_toggle_index(void)
+{
+    if (editor.buffer->view) {
+        editor_view_status();
+        return;
+    }
+
+    Trigrams *trigrams = &editor.buffer->trigrams;
+    if (trigrams->enabled) {
+        trigrams_free(trigrams);
     } else {
-        term_color(COLOR_FAILED);
+        trigrams_reset(trigrams, editor.buffer->count);
+    }
+    editor_index_status();
+}
+
+// Where the cursor is in the file of a view
+void editor_view_status(void)
+{
+    Buffer *buffer = editor.buffer;
+    View *view = buffer->view;
+
+    char line[32] = "?";
+    if (view->line != VIEW_UNKNOWN) {
+        snprintf(line, sizeof(line), "%zu", view->line + buffer->cursor.y + 1);
     }
 
-    fprintf(stdout, "%.*s", (int) editor.query.size, editor.query.data);
-    term_color_reset();
+    char total[32];
+    if (view->indexed < view->size) {
+        snprintf(total, sizeof(total), "%zu+ (indexing, %d%%)", view->lines,
+                 (int) (100.0 * view->indexed / view->size));
+    } else {
+        const bool partial = view->size && view->end == view->size && buffer->count &&
+            view->window[view->end - view->base - 1] != '\n';
+        snprintf(total, sizeof(total), "%zu", view->lines + partial);
+    }
+
+    const off_t offset = buffer_view_offset(buffer, buffer->cursor.y);
+    editor_status("%s (read-only view): line %s of %s, %d%%", buffer->path.data, line, total,
+                  view->size ? (int) (100.0 * offset / view->size) : 100);
+}
+
+// Go to a line, or to N% of the way through the buffer
+void editor_goto(void)
+{
+    if (!editor.count) return;
+
+    const String query = editor_prompt("Go to line: ", NULL, NULL);
+    if (!query.size) {
+        return;
+    }
+
+    char number[32];
+    snprintf(number, sizeof(number), "%.*s", (int) query.size, query.data);
+    char *end;
+    const unsigned long long value = strtoull(number, &end, 10);
+    const bool percent = *end == '%';
+    if (end == number || (*end && !percent)) {
+        editor_error("not a line number or percentage '%s'", number);
+        return;
+    }
+
+    Buffer *buffer = editor.buffer;
+    if (buffer->view) {
+        View *view = buffer->view;
+        if (percent) {
+            buffer_view_seek(buffer, (off_t) (MIN(value, 100) / 100.0 * view->size), 0);
+        } else {
+            buffer_view_seek(buffer, view_line_offset(view, value ? value - 1 : 0), 0);
+        }
+    } else if (buffer->count) {
+        const size_t last = buffer->count - 1;
+        const size_t y = percent ? last * MIN(value, 100) / 100 : (value ? value - 1 : 0);
+        buffer->cursor = Vector(0, MIN(y, last));
+    }
+
+    buffer->anchor = Vector(0, buffer->cursor.y > term.size.y / 2 ? buffer->cursor.y - term.size.y / 2 : 0);
+    buffer_anchor_fix(buffer);
 }
 
-void editor_search(bool forward)
+void editor_undo(void)
 {
     if (!editor.count) return;
 
-    editor.search.size = 0;
-
-    Search search = {
-        .start = editor.buffer->cursor,
-        .found = false,
-        .forward = forward
-    };
+    Undo *undo = &editor.buffer->undo;
+    if (!undo->current) {
+        buffer_history_load(editor.buffer);
+    }
 
-    const String query = editor_prompt("Search: ", editor_search_callback, &search);
-    if (query.size && !vector_eq(editor.buffer->cursor, search.start)) {
-        string_insert(&editor.search, 0, query.data, query.size);
-    } else {
-        editor.buffer->cursor = search.start;
+    if (!undo->current) {
+        editor_status("No further undo information");
+        return;
     }
+    buffer_undo(editor.buffer);
+    editor_status("Undo %zu of %zu", undo->count - undo->current, undo->count);
 }
 
-void editor_search_further(bool forward)
+void editor_redo(void)
 {
     if (!editor.count) return;
-    if (editor.search.size) {
-        buffer_search(editor.buffer, editor.search, forward);
+
+    Undo *undo = &editor.buffer->undo;
+    if (undo->current == undo->count) {
+        editor_status("No further redo information");
+        return;
     }
+    buffer_redo(editor.buffer);
+    editor_status("Redo %zu of %zu", undo->current, undo->count);
 }
 
-void editor_search_forward(void)
+// Add a cursor at every match of the last search, within the region if
+// there is one
+void editor_cursors_matches(void)
 {
-    editor_search(true);
-}
+    if (!editor.count) return;
 
-void editor_search_further_forward(void)
-{
-    editor_search_further(true);
-}
+    Buffer *buffer = editor.buffer;
+    if (!editor.search.source.size) {
+        editor_error("nothing was searched for yet");
+        return;
+    }
 
-void editor_search_backward(void)
-{
-    editor_search(false);
-}
+    Vector start = Vector(0, 0), end = Vector(0, buffer->count);
+    if (buffer->region) {
+        buffer_get_region(*buffer, &start, &end);
+    }
 
-void editor_search_further_backward(void)
-{
-    editor_search_further(false);
+    Matches found = {0};
+    for (size_t y = start.y; y < MIN(end.y + 1, buffer->count); ++y) {
+        matches_scan(&found, &editor.search, buffer->lines[y], y);
+    }
+    for (size_t i = 0; i < found.count; ++i) {
+        const Vector position = found.items[i].position;
+        if (!vector_lt(position, start) && vector_lt(position, end)) {
+            cursors_push(&buffer->cursors, position);
+        }
+    }
+    free(found.items);
+
+    buffer->region = false;
+    buffer_cursors_fix(buffer);
+    editor_status("%zu cursors", buffer->cursors.count + 1);
 }
 
-char editor_prompt_char(const char *prompt, const char *valid)
+// Add a cursor at the column of the cursor on every line of the region
+void editor_cursors_lines(void)
 {
-    term_move(Vector(0, term.size.y + 1));
-    fprintf(stdout, "\x1b[J");
-    term_color(COLOR_PROMPT);
-    printf("%s (%s): ", prompt, valid);
-    term_color_reset();
+    if (!editor.count) return;
 
-    while (true) {
-        const char ch = tolower(getchar());
-        if (ch == 27 || ch == CTRL('c')) {
-            return '\0';
-        } else if (strchr(valid, ch)) {
-            return ch;
-        }
+    Buffer *buffer = editor.buffer;
+    if (!buffer->region) {
+        editor_error("no region to add cursors on");
+        return;
+    }
+
+    Vector start, end;
+    buffer_get_region(*buffer, &start, &end);
+    for (size_t y = start.y; y <= end.y && y < buffer->count; ++y) {
+        cursors_push(&buffer->cursors, Vector(buffer->cursor.x, y));
     }
+
+    buffer->region = false;
+    buffer_cursors_fix(buffer);
+    editor_status("%zu cursors", buffer->cursors.count + 1);
 }
 
-static String search_save;
+// Keep only the main cursor
+void editor_cursors_clear(void)
+{
+    if (!editor.count) return;
+    editor.buffer->cursors.count = 0;
+}
 
-void editor_replace(void)
+// The rectangle commands, behind C-x r
+void editor_rectangle(void)
 {
     if (!editor.count) return;
 
-    search_save.size = 0;
-    string_insert(&search_save, 0, editor.search.data, editor.search.size);
+    Buffer *buffer = editor.buffer;
+    if (!term.deferred) {
+        term_move(Vector(0, term.size.y + 1));
+        printf("C-x r");
+        term_move(vector_sub(buffer->cursor, buffer->anchor));
+    }
 
-    editor_search_forward();
+    const char ch = editor_getchar();
+    if (!ch || !strchr("kdty", ch)) {
+        return;
+    }
 
-    String replace_with = editor_prompt("Replace: ", NULL, NULL);
-    bool replace_all = false;
-    while (editor.search.size) {
-        buffer_print(*editor.buffer);
-        term_color(COLOR_SEARCH);
-        printf("%.*s", (int) editor.search.size, editor.buffer->lines[editor.buffer->cursor.y].data + editor.buffer->cursor.x);
-        term_color_reset();
+    if (buffer->view) {
+        editor_error("%s is a read-only view", buffer->path.data);
+        return;
+    }
 
-        bool replace = true;
-        if (!replace_all) {
-            const char ch = tolower(editor_prompt_char("Replace", "ynaq"));
-            if (ch && ch != 'q') {
-                if (ch == 'a') {
-                    replace_all = true;
-                } else {
-                    replace = ch == 'y';
-                }
-            } else {
-                break;
-            }
-        }
+    if (buffer->load) {
+        editor_error("%s is still loading", buffer->path.data);
+        return;
+    }
 
-        if (replace) {
-            string_replace(editor.buffer->lines + editor.buffer->cursor.y,
-                           editor.buffer->cursor.x, editor.search.size, replace_with);
-        }
+    if (ch == 'y') {
+        buffer_yank_rectangle(buffer);
+        return;
+    }
 
-        if (!buffer_search(editor.buffer, editor.search, true)) {
-            break;
-        }
+    if (!buffer->region) {
+        editor_error("no rectangle to edit");
+        return;
     }
 
-    editor.search.size = 0;
-    string_insert(&editor.search, 0, search_save.data, search_save.size);
+    if (ch == 't') {
+        const String text = editor_prompt("String rectangle: ", NULL, NULL);
+        if (text.size) {
+            buffer_string_rectangle(buffer, sv(text.data, text.size));
+        }
+    } else {
+        buffer_delete_rectangle(buffer, ch == 'k');
+    }
 }
 
-void editor_escape_map(void)
+// Kill the region, or the rectangle of a rectangle selection
+void editor_kill_region(void)
 {
-    editor.escape = true;
+    if (!editor.count) return;
+
+    Buffer *buffer = editor.buffer;
+    if (buffer->view) {
+        editor_error("%s is a read-only view", buffer->path.data);
+        return;
+    }
+
+    if (buffer->load) {
+        editor_error("%s is still loading", buffer->path.data);
+        return;
+    }
+
+    if (!buffer->region || !buffer->count) {
+        editor_error("no region to kill");
+        return;
+    }
+
+    if (buffer->rectangle) {
+        buffer_delete_rectangle(buffer, true);
+        return;
+    }
+
+    Vector start, end;
+    buffer_get_region_inclusive(buffer, &start, &end);
+    buffer_kill(buffer, start, end);
+    buffer_delete(buffer, buffer_forward_char);
 }
 
-void editor_error(const char *format, ...)
+void editor_copy_region(void)
 {
-    term_move(Vector(0, term.size.y + 1));
-    term_color(COLOR_FAILED);
-    printf("Error: ");
+    if (!editor.count) return;
 
-    va_list ap;
-    va_start(ap, format);
-    vprintf(format, ap);
-    va_end(ap);
+    Buffer *buffer = editor.buffer;
+    if (!buffer->region || buffer->rectangle || !buffer->count) {
+        editor_error("no region to copy");
+        return;
+    }
 
-    term_color_reset();
-    getchar();
+    Vector start, end;
+    buffer_get_region_inclusive(buffer, &start, &end);
+    buffer_kill(buffer, start, end);
+    buffer->region = false;
 }
 
-bool editor_save_internal(void)
+void editor_yank(void)
 {
-    if (!editor.buffer->path.size) {
-        const String path = editor_prompt("Save to: ", NULL, NULL);
-        if (!path.size) {
-            return false;
-        }
+    if (!editor.count) return;
 
-        editor.buffer->path = string(path.data, path.size);
+    Buffer *buffer = editor.buffer;
+    if (buffer->view) {
+        editor_error("%s is a read-only view", buffer->path.data);
+        return;
     }
 
-    if (!buffer_save(editor.buffer)) {
-        editor_error("could not save to file '%s': %s", editor.buffer->path.data, strerror(errno));
-        return false;
+    if (buffer->load) {
+        editor_error("%s is still loading", buffer->path.data);
+        return;
     }
 
-    return true;
+    if (!kills.count) {
+        editor_error("nothing was killed yet");
+        return;
+    }
+
+    buffer_yank(buffer, kills.items + kills.last);
+    kills.yanked = !buffer->locations;
+    kills.at = kills.last;
+    kills.current = buffer->undo.current;
 }
 
-void editor_save(void)
+// Replace the text yanked right before with the kill before it, which the
+// history sees as undoing the yank and yanking that one
+void editor_yank_pop(void)
 {
     if (!editor.count) return;
-    editor_save_internal();
-}
 
-bool cstr_string_eq(const char *a, String b)
-{
-    return strlen(a) == b.size && !memcmp(a, b.data, b.size);
+    Buffer *buffer = editor.buffer;
+    Undo *undo = &buffer->undo;
+    if (!kills.yanked || !undo->current || undo->current != kills.current) {
+        editor_error("the last command was not a yank");
+        return;
+    }
+
+    buffer_swap_change(buffer, undo->items + --undo->current);
+    kills.at = (kills.at + kills.count - 1) % kills.count;
+    buffer_yank(buffer, kills.items + kills.at);
+    kills.yanked = true;
+    kills.current = undo->current;
 }
 
-bool editor_switch_buffer_internal(String path)
+void editor_quit(void)
 {
+    save_wait();
+
+    // Leaving on purpose throws the unsaved changes away
     for (size_t i = 0; i < editor.count; ++i) {
-        if (cstr_string_eq(editor.buffers[i].path.data, path)) {
-            editor.buffer = editor.buffers + i;
-            return true;
+        if (editor.buffers[i].journal) {
+            journal_discard(editor.buffers[i].journal, &editor.buffers[i].disk);
         }
     }
-    return false;
+    pattern_free(&editor.search);
+    string_free(&editor.query);
+    string_free(&editor.status);
+    term_reset();
+    exit(0);
 }
 
-void editor_switch_buffer(void)
+// Macros
+#define MACRO_POLL 1024
+
+void editor_key(char ch);
+
+void editor_macro_start(void)
 {
-    const String path = editor_prompt("Switch buffer: ", NULL, NULL);
-    if (!path.size) {
-        return;
-    }
+    if (editor.recording || editor.replaying) return;
 
-    if (!editor_switch_buffer_internal(path)) {
-        editor_error("no such buffer '%.*s'", (int) path.size, path.data);
-    }
+    editor.macro.size = 0;
+    editor.recording = true;
+    editor_status("Defining macro...");
 }
 
-void editor_find_file(void)
+void editor_macro_end(void)
 {
-    const String path = editor_prompt("Find file: ", NULL, NULL);
-    if (!path.size) {
+    if (!editor.recording) return;
+
+    // The keys that ended it are not part of it
+    editor.recording = false;
+    editor.macro.size -= 2;
+    editor_status("Macro of %zu keys defined", editor.macro.size);
+}
+
+// Replay the last macro TIMES times, or until a command of it fails if
+// TIMES is 0. Nothing is drawn until it is done, and a key typed meanwhile
+// interrupts it.
+void editor_macro_replay(size_t times)
+{
+    if (editor.recording || editor.replaying) return;
+
+    if (!editor.macro.size) {
+        editor_error("no macro defined");
         return;
     }
 
-    if (!editor_switch_buffer_internal(path)) {
-        editor_new_buffer();
-        editor.buffer->path = string(path.data, path.size);
-        string_insert(&editor.buffer->path, editor.buffer->path.size, "\0", 1);
-        buffer_open(editor.buffer);
-        buffer_detect_syntax(editor.buffer);
-        editor.buffer->modified = true;
+    const bool deferred = term.deferred;
+    editor.replaying = true;
+    editor.failed = false;
+    term.deferred = true;
+
+    // The matches of the last search would be kept through every edit, they
+    // are found again when next shown instead
+    for (size_t i = 0; i < editor.count; ++i) {
+        editor.buffers[i].matches.valid = false;
+    }
+
+    size_t count = 0;
+    bool interrupted = false;
+    while ((!times || count < times) && !editor.failed && !interrupted) {
+        editor.next = 0;
+        while (editor.next < editor.macro.size && !editor.failed) {
+            editor_key(editor_getchar());
+        }
+        count += !editor.failed;
+
+        struct pollfd fd = {.fd = STDIN_FILENO, .events = POLLIN};
+        char ch;
+        if (!editor.batch && count % MACRO_POLL == 0 && poll(&fd, 1, 0) > 0) {
+            interrupted = read(STDIN_FILENO, &ch, 1) == 1;
+        }
+    }
+
+    // Failing is how a macro ends, what replayed it goes on
+    editor.replaying = false;
+    editor.failed = false;
+    term.deferred = deferred;
+    editor.escape = false;
+    buffer_anchor_snap(editor.buffer);
+    buffer_anchor_fix(editor.buffer);
+    if (!editor.status.size || times != 1) {
+        editor_status("Macro replayed %zu time%s%s", count, count == 1 ? "" : "s", interrupted ? ", interrupted" : "");
     }
 }
 
-void editor_quit(void)
+void editor_macro_replay_once(void)
 {
-    string_free(&editor.search);
-    string_free(&editor.query);
-    string_free(&search_save);
-    term_reset();
-    exit(0);
+    editor_macro_replay(1);
+}
+
+void editor_macro_replay_times(void)
+{
+    if (editor.recording || editor.replaying) return;
+
+    const String query = editor_prompt("Replay macro times (0 until it fails): ", NULL, NULL);
+    if (!query.size) {
+        return;
+    }
+
+    char number[32];
+    snprintf(number, sizeof(number), "%.*s", (int) query.size, query.data);
+    char *end;
+    const unsigned long long times = strtoull(number, &end, 10);
+    if (end == number || *end) {
+        editor_error("not a number of times '%s'", number);
+        return;
+    }
+    editor_macro_replay(times);
 }
 
 void editor_ctrl_x(void)
 {
-    term_move(Vector(0, term.size.y + 1));
-    printf("C-x");
-    term_move(vector_sub(editor.buffer->cursor, editor.buffer->anchor));
+    if (!term.deferred) {
+        term_move(Vector(0, term.size.y + 1));
+        printf("C-x");
+        term_move(vector_sub(editor.buffer->cursor, editor.buffer->anchor));
+    }
 
-    switch (getchar()) {
+    switch (editor_getchar()) {
     case CTRL('r'): editor_replace(); break;
     case CTRL('c'): editor_quit(); break;
     case CTRL('s'): editor_save(); break;
+    case 's': editor_save_all(); break;
     case CTRL('k'): editor_delete_buffer(); break;
     case CTRL('b'): editor_switch_buffer(); break;
     case CTRL('f'): editor_find_file(); break;
+    case CTRL('o'): editor_occur(); break;
+    case CTRL('g'): editor_grep(); break;
+    case ' ': buffer_toggle_rectangle(editor.buffer); break;
+    case 'r': editor_rectangle(); break;
+    case '(': editor_macro_start(); break;
+    case ')': editor_macro_end(); break;
+    case 'e': editor_macro_replay_once(); break;
+    case 'E': editor_macro_replay_times(); break;
     }
 }
 
@@ -1229,12 +8411,28 @@ static const Mapping normal_mappings[KEY_MAX] = {
     [CTRL('e')] = {.buffer = buffer_forward_line},
 
     [CTRL('k')] = {.delete = buffer_forward_line},
+    [CTRL('w')] = {.editor = editor_kill_region},
+    [CTRL('y')] = {.editor = editor_yank},
+    [CTRL('_')] = {.editor = editor_undo},
+    [CTRL('g')] = {.editor = editor_cursors_clear},
 };
 
 static const Mapping escape_mappings[KEY_MAX] = {
     ['s'] = {.editor = editor_search_further_forward},
     ['r'] = {.editor = editor_search_further_backward},
+    ['%'] = {.editor = editor_replace_regex},
+    [CTRL('s')] = {.editor = editor_search_regex_forward},
+    [CTRL('r')] = {.editor = editor_search_regex_backward},
     ['x'] = {.editor = editor_switch_syntax},
+    ['i'] = {.editor = editor_toggle_index},
+    ['!'] = {.editor = editor_shell_command},
+    ['t'] = {.editor = editor_follow},
+    ['g'] = {.editor = editor_goto},
+    ['_'] = {.editor = editor_redo},
+    ['m'] = {.editor = editor_cursors_matches},
+    ['l'] = {.editor = editor_cursors_lines},
+    ['w'] = {.editor = editor_copy_region},
+    ['y'] = {.editor = editor_yank_pop},
 
     ['b'] = {.buffer = buffer_backward_word},
     ['f'] = {.buffer = buffer_forward_word},
@@ -1245,39 +8443,215 @@ static const Mapping escape_mappings[KEY_MAX] = {
     [127] = {.delete = buffer_backward_word},
 };
 
+// Run the command bound to CH
+void editor_key(char ch)
+{
+    const Mapping mapping = editor.escape ? escape_mappings[(size_t) ch] : normal_mappings[(size_t) ch];
+    editor.escape = false;
+
+    if (mapping.editor != editor_escape_map) {
+        editor.highlight = false;
+        editor.status.size = 0;
+    }
+
+    // M-y only goes on from the yank right before it
+    if (mapping.editor != editor_yank_pop && mapping.editor != editor_escape_map) {
+        kills.yanked = false;
+    }
+
+    // Only typing goes on with the change before it, moving or any other
+    // command starts a new one
+    if (mapping.editor || mapping.buffer) {
+        editor.buffer->undo.typing = false;
+    }
+
+    if (mapping.editor) {
+        mapping.editor();
+    } else if (mapping.buffer && editor.buffer->cursors.count && mapping.buffer != buffer_toggle_region) {
+        buffer_move_cursors(editor.buffer, mapping.buffer);
+    } else if (mapping.buffer) {
+        mapping.buffer(editor.buffer);
+    } else if (editor.buffer->view && (mapping.delete || isprint(ch) || ch == '\r' || ch == '\t')) {
+        editor_error("%s is a read-only view", editor.buffer->path.data);
+    } else if (editor.buffer->load && (mapping.delete || isprint(ch) || ch == '\r' || ch == '\t')) {
+        editor_error("%s is still loading", editor.buffer->path.data);
+    } else if (mapping.delete && editor.buffer->region && editor.buffer->rectangle) {
+        buffer_delete_rectangle(editor.buffer, false);
+    } else if (mapping.delete && editor.buffer->cursors.count && !editor.buffer->region) {
+        buffer_delete_cursors(editor.buffer, mapping.delete);
+    } else if (mapping.delete) {
+        buffer_delete(editor.buffer, mapping.delete);
+    } else if (ch == '\r' && editor.buffer->locations) {
+        editor_visit_location();
+    } else if ((isprint(ch) || ch == '\r' || ch == '\t') && editor.buffer->cursors.count) {
+        buffer_insert_cursors(editor.buffer, ch);
+    } else if (isprint(ch) || ch == '\r' || ch == '\t') {
+        buffer_insert(editor.buffer, ch);
+    }
+
+    if (editor.buffer->view) {
+        buffer_view_slide(editor.buffer);
+        if (!editor.status.size) {
+            editor_view_status();
+        }
+    }
+}
+
+// Batch
+#define BATCH_SAVES 64
+
+// A batch run types the keys of a script into each file in turn, with no
+// terminal and nothing drawn, then saves what it changed. The script stops
+// at the first search that fails or error, and the file is saved as it is.
+int editor_batch(const char *script, char **files, int count)
+{
+    const int fd = strcmp(script, "-") ? open(script, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+    if (fd == -1) {
+        fprintf(stderr, "meno: could not read '%s': %s\n", script, strerror(errno));
+        return 1;
+    }
+
+    char block[4096];
+    ssize_t size;
+    while ((size = read(fd, block, sizeof(block))) > 0) {
+        string_insert(&editor.script, editor.script.size, block, size);
+    }
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+
+    events_init();
+    editor.batch = true;
+    term.deferred = true;
+
+    // The size of a usual terminal, for the commands that move by screens
+    term.size = Vector(80, 24);
+
+    const uint64_t start = clock_ns();
+    for (int i = 0; i < count; ++i) {
+        struct stat statbuf;
+        if (stat(files[i], &statbuf) == -1) {
+            fprintf(stderr, "meno: %s: %s\n", files[i], strerror(errno));
+            editor.errors++;
+            continue;
+        }
+
+        editor.count = 0;
+        editor_new_buffer();
+        editor.buffer->path = string(files[i], strlen(files[i]));
+        string_insert(&editor.buffer->path, editor.buffer->path.size, "\0", 1);
+        buffer_open(editor.buffer);
+        buffer_detect_syntax(editor.buffer);
+
+        editor.at = 0;
+        editor.failed = false;
+        const size_t errors = editor.errors;
+        while (editor.at < editor.script.size && !editor.failed) {
+            editor_key(editor_getchar());
+        }
+        editor.recording = false;
+        editor.escape = false;
+
+        // A script that stops partway, like one that ends in the middle of a
+        // command, leaves the files as they were
+        if (editor.failed && editor.errors == errors) {
+            fprintf(stderr, "meno: %s: the script stopped at key %zu\n", files[i], editor.at);
+            editor.errors++;
+        }
+
+        // The script may have visited other files too. Their history is not
+        // kept, a batch run leaves nothing but the files behind. The files
+        // are written while the next ones are edited, the buffers can go
+        // as the saves hold on to the lines they write.
+        for (size_t j = 0; j < editor.count; ++j) {
+            if (editor.buffers[j].save) {
+                save_wait();
+                events_run();
+                break;
+            }
+        }
+        for (size_t j = 0; j < editor.count; ++j) {
+            Buffer *buffer = editor.buffers + j;
+            if (!editor.failed && buffer_visits_file(buffer) && buffer_modified(buffer)) {
+                undo_free(&buffer->undo);
+                buffer_save(buffer);
+            }
+            string_free(&buffer->path);
+            buffer_free(buffer);
+        }
+        save_wait_below(BATCH_SAVES);
+        events_run();
+    }
+
+    save_wait();
+    events_run();
+    fprintf(stderr, "meno: %zu of %d file%s changed in %.2fs\n", editor.saved, count, count == 1 ? "" : "s",
+            (clock_ns() - start) / 1e9);
+    return editor.errors ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
+    if (argc > 1 && !strcmp(argv[1], "--batch")) {
+        if (argc < 3) {
+            fprintf(stderr, "usage: %s --batch SCRIPT FILE...\n", argv[0]);
+            return 1;
+        }
+        return editor_batch(argv[2], argv + 3, argc - 3);
+    }
+
+    // Keep a piped stdin to be read by "-" and take the keys from the terminal
+    int input = -1;
+    if (!isatty(STDIN_FILENO)) {
+        input = dup(STDIN_FILENO);
+        const int tty = open("/dev/tty", O_RDWR);
+        assert(input != -1 && tty != -1);
+        dup2(tty, STDIN_FILENO);
+        close(tty);
+        fcntl(input, F_SETFD, FD_CLOEXEC);
+    }
+
     term_init();
+    events_init();
 
+    // All the buffers exist before any file is loaded, the one shown first
+    // is loaded first
+    bool *files = calloc(argc, sizeof(bool));
+    assert(files);
     for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-") && input != -1) {
+            editor_open_stream("*stdin*", input, -1);
+            input = -1;
+            continue;
+        }
+
         editor_new_buffer();
         editor.buffer->path = string(argv[i], strlen(argv[i]));
         string_insert(&editor.buffer->path, editor.buffer->path.size, "\0", 1);
-        buffer_open(editor.buffer);
-        buffer_detect_syntax(editor.buffer);
-        editor.buffer->modified = true;
+        files[editor.count - 1] = true;
+    }
+
+    if (editor.count && files[editor.count - 1]) {
+        editor_load(editor.buffer);
+    }
+    for (size_t i = 0; i + 1 < editor.count; ++i) {
+        if (files[i]) {
+            editor_load(editor.buffers + i);
+        }
     }
+    free(files);
 
     if (argc == 1) {
         editor_new_buffer();
     }
 
     while (true) {
-        buffer_print(*editor.buffer);
-
-        const char ch = getchar();
-        const Mapping mapping = editor.escape ? escape_mappings[(size_t) ch] : normal_mappings[(size_t) ch];
-        editor.escape = false;
+        editor_render();
 
-        if (mapping.editor) {
-            mapping.editor();
-        } else if (mapping.buffer) {
-            mapping.buffer(editor.buffer);
-        } else if (mapping.delete) {
-            buffer_delete(editor.buffer, mapping.delete);
-        } else if (isprint(ch) || ch == '\r' || ch == '\t') {
-            buffer_insert(editor.buffer, ch);
-        }
+        editor.idle = true;
+        const char ch = editor_getchar();
+        editor.idle = false;
+        editor_key(ch);
     }
     return 0;
 }
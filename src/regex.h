@@ -0,0 +1,862 @@
+#ifndef REGEX_H
+#define REGEX_H
+
+#include <ctype.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// Regex - A non-backtracking regular expression engine
+//
+// Patterns are compiled to a Thompson NFA. A lazily built DFA answers "is
+// there any match in this line" and rejects most input in a single pass,
+// while the lines that do match are run through a Pike VM to recover the
+// match and its capture groups. Both are linear in the size of the input,
+// no matter how the pattern is written.
+//
+// Syntax:
+//   .  [abc]  [^a-z]  \d \w \s \D \W \S  \t  \x (literal x)
+//   ^  $
+//   *  +  ?  *?  +?  ??
+//   (group)  (?:group)  a|b
+
+#define REGEX_GROUPS 10
+#define REGEX_STATES 256
+#define REGEX_UNSET ((size_t) -1)
+
+// The span of a match and its groups. The N-th group starts at groups[2*N]
+// and ends at groups[2*N + 1]. Groups that did not take part in the match
+// are set to REGEX_UNSET.
+typedef struct {
+    size_t groups[REGEX_GROUPS * 2];
+} RegexMatch;
+
+typedef enum {
+    REGEX_CHAR,
+    REGEX_ANY,
+    REGEX_CLASS,
+    REGEX_BOL,
+    REGEX_EOL,
+    REGEX_SAVE,
+    REGEX_SPLIT,
+    REGEX_JUMP,
+    REGEX_MATCH
+} RegexOp;
+
+typedef struct {
+    RegexOp op;
+    size_t x, y;
+} RegexInst;
+
+typedef struct {
+    size_t pc;
+    size_t *groups;
+} RegexThread;
+
+typedef struct {
+    RegexThread *items;
+    size_t *groups;
+    size_t count;
+} RegexList;
+
+typedef struct {
+    size_t *pcs;
+    size_t count;
+    bool match;
+    int next[256];
+} RegexState;
+
+typedef struct {
+    RegexInst *insts;
+    size_t count;
+    size_t capacity;
+
+    unsigned char (*classes)[32];
+    size_t classes_count;
+
+    size_t groups;
+    bool icase;
+    const char *error;
+
+    size_t *marks;
+    size_t mark;
+    size_t *stack;
+    size_t *set;
+    RegexList lists[2];
+
+    RegexState *states;
+    size_t states_count;
+    int table[REGEX_STATES * 2];
+    int start[2];
+} Regex;
+
+// Compile PATTERN into REGEX. If ICASE is set, letters match regardless of
+// their case. Returns false and sets regex->error if the pattern is invalid.
+// The regex must be freed with regex_free() in either case.
+//
+// Example:
+//   Regex regex = {0};
+//   regex_compile(&regex, "(\\w+)=(\\d+)", 11, false) => true
+bool regex_compile(Regex *regex, const char *pattern, size_t size, bool icase);
+
+// Free the program and the DFA cache of a compiled regex.
+void regex_free(Regex *regex);
+
+// Check if there is a match starting at or after POSITION in DATA. This only
+// runs the DFA and does not compute the bounds of the match.
+//
+// Examples:
+//   regex_matches(&regex, "foo=69", 6, 0) => true
+//   regex_matches(&regex, "foo=69", 6, 4) => false
+bool regex_matches(Regex *regex, const char *data, size_t size, size_t position);
+
+// Find the first match starting at or after *POSITION. On success, *POSITION
+// is set to the start of the match and MATCH to its groups.
+//
+// Example:
+//   size_t position = 0;
+//   regex_search_forward(&regex, "  foo=69", 8, &position, &match) => true
+//   position                                                       => 2
+//   match.groups[4], match.groups[5]                               => 6, 8
+bool regex_search_forward(Regex *regex, const char *data, size_t size, size_t *position, RegexMatch *match);
+
+// Like regex_search_forward(), but finds the last match starting at or before
+// *POSITION.
+bool regex_search_backward(Regex *regex, const char *data, size_t size, size_t *position, RegexMatch *match);
+
+///////////////////////////////////////////////////////
+
+typedef struct {
+    Regex *regex;
+    const char *data;
+    size_t size;
+    size_t index;
+} RegexParser;
+
+static size_t regex_emit(Regex *regex, RegexOp op, size_t x, size_t y)
+{
+    if (regex->count == regex->capacity) {
+        regex->capacity = regex->capacity ? regex->capacity * 2 : 16;
+        regex->insts = realloc(regex->insts, regex->capacity * sizeof(RegexInst));
+        assert(regex->insts);
+    }
+
+    regex->insts[regex->count] = (RegexInst) {.op = op, .x = x, .y = y};
+    return regex->count++;
+}
+
+// Insert an instruction before the code starting at AT, moving the targets
+// of the jumps in that code along with it.
+static void regex_insert(Regex *regex, size_t at, RegexOp op, size_t x, size_t y)
+{
+    regex_emit(regex, REGEX_MATCH, 0, 0);
+    memmove(regex->insts + at + 1, regex->insts + at, (regex->count - at - 1) * sizeof(RegexInst));
+
+    for (size_t i = at + 1; i < regex->count; ++i) {
+        RegexInst *inst = regex->insts + i;
+        if (inst->op == REGEX_SPLIT || inst->op == REGEX_JUMP) {
+            if (inst->x >= at) inst->x++;
+            if (inst->op == REGEX_SPLIT && inst->y >= at) inst->y++;
+        }
+    }
+
+    regex->insts[at] = (RegexInst) {.op = op, .x = x, .y = y};
+}
+
+static size_t regex_class(Regex *regex)
+{
+    regex->classes = realloc(regex->classes, (regex->classes_count + 1) * sizeof(*regex->classes));
+    assert(regex->classes);
+    memset(regex->classes[regex->classes_count], 0, sizeof(*regex->classes));
+    return regex->classes_count++;
+}
+
+static inline void regex_class_set(unsigned char *bits, unsigned char ch)
+{
+    bits[ch / 8] |= 1 << (ch % 8);
+}
+
+static inline bool regex_class_get(const unsigned char *bits, unsigned char ch)
+{
+    return bits[ch / 8] & (1 << (ch % 8));
+}
+
+// Add the characters of the escape class CH (one of dDwWsS) to BITS.
+// Returns false if CH does not name a class.
+static bool regex_class_escape(unsigned char *bits, char ch)
+{
+    const bool negate = ch == 'D' || ch == 'S' || ch == 'W';
+    const char name = negate ? ch - 'A' + 'a' : ch;
+    if (name != 'd' && name != 's' && name != 'w') {
+        return false;
+    }
+
+    for (size_t i = 0; i < 256; ++i) {
+        bool member = false;
+        switch (name) {
+        case 'd': member = isdigit(i); break;
+        case 's': member = isspace(i); break;
+        case 'w': member = isalnum(i) || i == '_'; break;
+        }
+
+        if (member != negate) {
+            regex_class_set(bits, i);
+        }
+    }
+    return true;
+}
+
+static char regex_unescape(char ch)
+{
+    switch (ch) {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    default: return ch;
+    }
+}
+
+static bool regex_parse_class(RegexParser *parser)
+{
+    Regex *regex = parser->regex;
+    const size_t index = regex_class(regex);
+    unsigned char *bits = regex->classes[index];
+
+    bool negate = false;
+    if (parser->index < parser->size && parser->data[parser->index] == '^') {
+        negate = true;
+        parser->index++;
+    }
+
+    bool first = true;
+    while (parser->index < parser->size && (first || parser->data[parser->index] != ']')) {
+        first = false;
+
+        unsigned char low = parser->data[parser->index++];
+        if (low == '\\' && parser->index < parser->size) {
+            const char ch = parser->data[parser->index++];
+            if (regex_class_escape(bits, ch)) {
+                continue;
+            }
+            low = regex_unescape(ch);
+        }
+
+        unsigned char high = low;
+        if (parser->index + 1 < parser->size &&
+            parser->data[parser->index] == '-' &&
+            parser->data[parser->index + 1] != ']') {
+            high = parser->data[parser->index + 1];
+            parser->index += 2;
+
+            if (high == '\\' && parser->index < parser->size) {
+                high = regex_unescape(parser->data[parser->index++]);
+            }
+
+            if (high < low) {
+                regex->error = "invalid range in character class";
+                return false;
+            }
+        }
+
+        for (size_t ch = low; ch <= high; ++ch) {
+            regex_class_set(bits, ch);
+        }
+    }
+
+    if (parser->index == parser->size) {
+        regex->error = "unterminated character class";
+        return false;
+    }
+    parser->index++;
+
+    if (regex->icase) {
+        for (size_t ch = 0; ch < 256; ++ch) {
+            if (isalpha(ch) && regex_class_get(bits, ch)) {
+                regex_class_set(bits, tolower(ch));
+                regex_class_set(bits, toupper(ch));
+            }
+        }
+    }
+
+    if (negate) {
+        for (size_t i = 0; i < 32; ++i) {
+            bits[i] = ~bits[i];
+        }
+    }
+
+    regex_emit(regex, REGEX_CLASS, index, 0);
+    return true;
+}
+
+static bool regex_parse_alt(RegexParser *parser);
+
+static bool regex_parse_atom(RegexParser *parser)
+{
+    Regex *regex = parser->regex;
+    const unsigned char ch = parser->data[parser->index++];
+
+    switch (ch) {
+    case '(': {
+        size_t group = REGEX_UNSET;
+        if (parser->index + 1 < parser->size &&
+            parser->data[parser->index] == '?' &&
+            parser->data[parser->index + 1] == ':') {
+            parser->index += 2;
+        } else if (regex->groups < REGEX_GROUPS) {
+            group = regex->groups++;
+        }
+
+        if (group != REGEX_UNSET) regex_emit(regex, REGEX_SAVE, group * 2, 0);
+        if (!regex_parse_alt(parser)) {
+            return false;
+        }
+        if (group != REGEX_UNSET) regex_emit(regex, REGEX_SAVE, group * 2 + 1, 0);
+
+        if (parser->index == parser->size) {
+            regex->error = "missing )";
+            return false;
+        }
+        parser->index++;
+    } break;
+
+    case '[':
+        return regex_parse_class(parser);
+
+    case '.':
+        regex_emit(regex, REGEX_ANY, 0, 0);
+        break;
+
+    case '^':
+        regex_emit(regex, REGEX_BOL, 0, 0);
+        break;
+
+    case '$':
+        regex_emit(regex, REGEX_EOL, 0, 0);
+        break;
+
+    case '*':
+    case '+':
+    case '?':
+        regex->error = "nothing to repeat";
+        return false;
+
+    case '\\':
+        if (parser->index == parser->size) {
+            regex->error = "trailing backslash";
+            return false;
+        } else {
+            const char next = parser->data[parser->index++];
+            const size_t index = regex_class(regex);
+            if (regex_class_escape(regex->classes[index], next)) {
+                regex_emit(regex, REGEX_CLASS, index, 0);
+            } else {
+                regex->classes_count--;
+                const unsigned char escaped = regex_unescape(next);
+                regex_emit(regex, REGEX_CHAR, regex->icase ? tolower(escaped) : escaped, 0);
+            }
+        }
+        break;
+
+    default:
+        regex_emit(regex, REGEX_CHAR, regex->icase ? tolower(ch) : ch, 0);
+        break;
+    }
+
+    return true;
+}
+
+static bool regex_parse_concat(RegexParser *parser)
+{
+    Regex *regex = parser->regex;
+
+    while (parser->index < parser->size &&
+           parser->data[parser->index] != '|' &&
+           parser->data[parser->index] != ')') {
+        const size_t start = regex->count;
+        if (!regex_parse_atom(parser)) {
+            return false;
+        }
+
+        while (parser->index < parser->size) {
+            const char op = parser->data[parser->index];
+            if (op != '*' && op != '+' && op != '?') {
+                break;
+            }
+            parser->index++;
+
+            bool greedy = true;
+            if (parser->index < parser->size && parser->data[parser->index] == '?') {
+                greedy = false;
+                parser->index++;
+            }
+
+            if (op == '+') {
+                const size_t next = regex->count + 1;
+                regex_emit(regex, REGEX_SPLIT, greedy ? start : next, greedy ? next : start);
+            } else {
+                const size_t next = regex->count + (op == '*' ? 2 : 1);
+                regex_insert(regex, start, REGEX_SPLIT, greedy ? start + 1 : next, greedy ? next : start + 1);
+                if (op == '*') {
+                    regex_emit(regex, REGEX_JUMP, start, 0);
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool regex_parse_alt(RegexParser *parser)
+{
+    Regex *regex = parser->regex;
+    const size_t start = regex->count;
+
+    if (!regex_parse_concat(parser)) {
+        return false;
+    }
+
+    while (parser->index < parser->size && parser->data[parser->index] == '|') {
+        parser->index++;
+
+        regex_insert(regex, start, REGEX_SPLIT, start + 1, 0);
+        const size_t jump = regex_emit(regex, REGEX_JUMP, 0, 0);
+        regex->insts[start].y = regex->count;
+
+        if (!regex_parse_concat(parser)) {
+            return false;
+        }
+        regex->insts[jump].x = regex->count;
+    }
+
+    return true;
+}
+
+bool regex_compile(Regex *regex, const char *pattern, size_t size, bool icase)
+{
+    memset(regex, 0, sizeof(Regex));
+    regex->icase = icase;
+    regex->groups = 1;
+
+    RegexParser parser = {
+        .regex = regex,
+        .data = pattern,
+        .size = size,
+    };
+
+    regex_emit(regex, REGEX_SAVE, 0, 0);
+    if (!regex_parse_alt(&parser)) {
+        return false;
+    }
+
+    if (parser.index < parser.size) {
+        regex->error = "unmatched )";
+        return false;
+    }
+
+    regex_emit(regex, REGEX_SAVE, 1, 0);
+    regex_emit(regex, REGEX_MATCH, 0, 0);
+
+    const size_t slots = regex->groups * 2;
+    regex->marks = calloc(regex->count, sizeof(size_t));
+    regex->stack = malloc(regex->count * 2 * sizeof(size_t));
+    regex->set = malloc(regex->count * sizeof(size_t));
+    assert(regex->marks && regex->stack && regex->set);
+
+    for (size_t i = 0; i < 2; ++i) {
+        regex->lists[i].items = malloc(regex->count * sizeof(RegexThread));
+        regex->lists[i].groups = malloc(regex->count * slots * sizeof(size_t));
+        assert(regex->lists[i].items && regex->lists[i].groups);
+    }
+
+    regex->states = malloc(REGEX_STATES * sizeof(RegexState));
+    assert(regex->states);
+    memset(regex->table, -1, sizeof(regex->table));
+    regex->start[0] = regex->start[1] = -1;
+
+    return true;
+}
+
+static void regex_flush(Regex *regex)
+{
+    for (size_t i = 0; i < regex->states_count; ++i) {
+        free(regex->states[i].pcs);
+    }
+    regex->states_count = 0;
+    memset(regex->table, -1, sizeof(regex->table));
+    regex->start[0] = regex->start[1] = -1;
+}
+
+void regex_free(Regex *regex)
+{
+    regex_flush(regex);
+    free(regex->states);
+    free(regex->insts);
+    free(regex->classes);
+    free(regex->marks);
+    free(regex->stack);
+    free(regex->set);
+    for (size_t i = 0; i < 2; ++i) {
+        free(regex->lists[i].items);
+        free(regex->lists[i].groups);
+    }
+    memset(regex, 0, sizeof(Regex));
+}
+
+static inline bool regex_step_char(const Regex *regex, RegexInst inst, unsigned char ch)
+{
+    switch (inst.op) {
+    case REGEX_CHAR:
+        return (size_t) (regex->icase ? tolower(ch) : ch) == inst.x;
+
+    case REGEX_ANY:
+        return true;
+
+    case REGEX_CLASS:
+        return regex_class_get(regex->classes[inst.x], ch);
+
+    default:
+        return false;
+    }
+}
+
+// DFA
+
+// Add the epsilon closure of PC to regex->set, under the current mark.
+// Unsatisfied end-of-line assertions are kept in the set, so they can be
+// resolved once the end of the input is reached.
+static void regex_closure(Regex *regex, size_t pc, bool bol, bool eol, size_t *count)
+{
+    size_t top = 0;
+    regex->stack[top++] = pc;
+
+    while (top) {
+        pc = regex->stack[--top];
+        if (regex->marks[pc] == regex->mark) {
+            continue;
+        }
+        regex->marks[pc] = regex->mark;
+
+        const RegexInst inst = regex->insts[pc];
+        switch (inst.op) {
+        case REGEX_JUMP:
+            regex->stack[top++] = inst.x;
+            break;
+
+        case REGEX_SPLIT:
+            regex->stack[top++] = inst.y;
+            regex->stack[top++] = inst.x;
+            break;
+
+        case REGEX_SAVE:
+            regex->stack[top++] = pc + 1;
+            break;
+
+        case REGEX_BOL:
+            if (bol) regex->stack[top++] = pc + 1;
+            break;
+
+        case REGEX_EOL:
+            if (eol) {
+                regex->stack[top++] = pc + 1;
+            } else {
+                regex->set[(*count)++] = pc;
+            }
+            break;
+
+        default:
+            regex->set[(*count)++] = pc;
+            break;
+        }
+    }
+}
+
+// Find or create the DFA state for the first COUNT pcs of regex->set.
+// Returns -1 if the cache is full.
+static int regex_state(Regex *regex, size_t count)
+{
+    size_t *set = regex->set;
+    for (size_t i = 1; i < count; ++i) {
+        const size_t pc = set[i];
+        size_t j = i;
+        for (; j > 0 && set[j - 1] > pc; --j) {
+            set[j] = set[j - 1];
+        }
+        set[j] = pc;
+    }
+
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < count; ++i) {
+        hash = (hash ^ set[i]) * 16777619u;
+    }
+
+    const size_t size = sizeof(regex->table) / sizeof(*regex->table);
+    for (size_t i = hash % size;; i = (i + 1) % size) {
+        const int index = regex->table[i];
+        if (index == -1) {
+            if (regex->states_count == REGEX_STATES) {
+                return -1;
+            }
+
+            RegexState *state = regex->states + regex->states_count;
+            state->pcs = malloc(count * sizeof(size_t) + 1);
+            assert(state->pcs);
+            memcpy(state->pcs, set, count * sizeof(size_t));
+            state->count = count;
+            state->match = false;
+            memset(state->next, -1, sizeof(state->next));
+
+            for (size_t j = 0; j < count; ++j) {
+                if (regex->insts[set[j]].op == REGEX_MATCH) {
+                    state->match = true;
+                }
+            }
+
+            regex->table[i] = regex->states_count;
+            return regex->states_count++;
+        }
+
+        const RegexState *state = regex->states + index;
+        if (state->count == count && !memcmp(state->pcs, set, count * sizeof(size_t))) {
+            return index;
+        }
+    }
+}
+
+static int regex_state_intern(Regex *regex, size_t count)
+{
+    int index = regex_state(regex, count);
+    if (index == -1) {
+        regex_flush(regex);
+        index = regex_state(regex, count);
+    }
+    return index;
+}
+
+static int regex_start(Regex *regex, bool bol)
+{
+    if (regex->start[bol] == -1) {
+        size_t count = 0;
+        regex->mark++;
+        regex_closure(regex, 0, bol, false, &count);
+        const int index = regex_state_intern(regex, count);
+        regex->start[bol] = index;
+    }
+    return regex->start[bol];
+}
+
+static int regex_next(Regex *regex, int from, unsigned char ch)
+{
+    size_t count = 0;
+    regex->mark++;
+
+    const RegexState *state = regex->states + from;
+    for (size_t i = 0; i < state->count; ++i) {
+        const size_t pc = state->pcs[i];
+        if (regex_step_char(regex, regex->insts[pc], ch)) {
+            regex_closure(regex, pc + 1, false, false, &count);
+        }
+    }
+    regex_closure(regex, 0, false, false, &count);
+
+    const size_t states_count = regex->states_count;
+    const int index = regex_state_intern(regex, count);
+    if (regex->states_count >= states_count) {
+        regex->states[from].next[ch] = index;
+    }
+    return index;
+}
+
+bool regex_matches(Regex *regex, const char *data, size_t size, size_t position)
+{
+    if (position > size) {
+        return false;
+    }
+
+    int state = regex_start(regex, position == 0);
+    for (size_t i = position; i < size; ++i) {
+        if (regex->states[state].match) {
+            return true;
+        }
+
+        const unsigned char ch = data[i];
+        const int next = regex->states[state].next[ch];
+        state = next == -1 ? regex_next(regex, state, ch) : next;
+    }
+
+    const RegexState *final = regex->states + state;
+    if (final->match) {
+        return true;
+    }
+
+    size_t count = 0;
+    regex->mark++;
+    for (size_t i = 0; i < final->count; ++i) {
+        if (regex->insts[final->pcs[i]].op == REGEX_EOL) {
+            regex_closure(regex, final->pcs[i] + 1, size == 0, true, &count);
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        if (regex->insts[regex->set[i]].op == REGEX_MATCH) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Pike VM
+
+static void regex_add(Regex *regex, RegexList *list, size_t pc, size_t *groups, size_t size, size_t position)
+{
+    if (regex->marks[pc] == regex->mark) {
+        return;
+    }
+    regex->marks[pc] = regex->mark;
+
+    const RegexInst inst = regex->insts[pc];
+    switch (inst.op) {
+    case REGEX_JUMP:
+        regex_add(regex, list, inst.x, groups, size, position);
+        break;
+
+    case REGEX_SPLIT:
+        regex_add(regex, list, inst.x, groups, size, position);
+        regex_add(regex, list, inst.y, groups, size, position);
+        break;
+
+    case REGEX_SAVE: {
+        const size_t save = groups[inst.x];
+        groups[inst.x] = position;
+        regex_add(regex, list, pc + 1, groups, size, position);
+        groups[inst.x] = save;
+    } break;
+
+    case REGEX_BOL:
+        if (position == 0) regex_add(regex, list, pc + 1, groups, size, position);
+        break;
+
+    case REGEX_EOL:
+        if (position == size) regex_add(regex, list, pc + 1, groups, size, position);
+        break;
+
+    default: {
+        const size_t slots = regex->groups * 2;
+        RegexThread *thread = list->items + list->count;
+        thread->pc = pc;
+        thread->groups = list->groups + list->count * slots;
+        memcpy(thread->groups, groups, slots * sizeof(size_t));
+        list->count++;
+    } break;
+    }
+}
+
+// Run the Pike VM, starting threads at every position in [FROM, TO].
+// If LATEST is set, threads started later take priority over earlier ones,
+// which yields the match with the latest start instead of the first one.
+static bool regex_run(Regex *regex, const char *data, size_t size, size_t from, size_t to, bool latest, RegexMatch *match)
+{
+    const size_t slots = regex->groups * 2;
+    RegexList *clist = regex->lists;
+    RegexList *nlist = regex->lists + 1;
+    clist->count = 0;
+
+    size_t seed[REGEX_GROUPS * 2];
+    bool matched = false;
+
+    for (size_t position = from; position <= size; ++position) {
+        if (position <= to && (latest || !matched)) {
+            for (size_t i = 0; i < slots; ++i) {
+                seed[i] = REGEX_UNSET;
+            }
+
+            regex->mark++;
+            if (latest) {
+                nlist->count = 0;
+                regex_add(regex, nlist, 0, seed, size, position);
+                for (size_t i = 0; i < clist->count; ++i) {
+                    if (regex->marks[clist->items[i].pc] != regex->mark) {
+                        regex->marks[clist->items[i].pc] = regex->mark;
+                        RegexThread *thread = nlist->items + nlist->count;
+                        thread->pc = clist->items[i].pc;
+                        thread->groups = nlist->groups + nlist->count * slots;
+                        memcpy(thread->groups, clist->items[i].groups, slots * sizeof(size_t));
+                        nlist->count++;
+                    }
+                }
+
+                RegexList *temp = clist;
+                clist = nlist;
+                nlist = temp;
+            } else {
+                for (size_t i = 0; i < clist->count; ++i) {
+                    regex->marks[clist->items[i].pc] = regex->mark;
+                }
+                regex_add(regex, clist, 0, seed, size, position);
+            }
+        }
+
+        if (clist->count == 0) {
+            if (position >= to || (matched && !latest)) {
+                break;
+            }
+            continue;
+        }
+
+        regex->mark++;
+        nlist->count = 0;
+
+        for (size_t i = 0; i < clist->count; ++i) {
+            const RegexThread thread = clist->items[i];
+            const RegexInst inst = regex->insts[thread.pc];
+
+            if (inst.op == REGEX_MATCH) {
+                matched = true;
+                for (size_t j = 0; j < REGEX_GROUPS * 2; ++j) {
+                    match->groups[j] = j < slots ? thread.groups[j] : REGEX_UNSET;
+                }
+                break;
+            }
+
+            if (position < size && regex_step_char(regex, inst, data[position])) {
+                regex_add(regex, nlist, thread.pc + 1, thread.groups, size, position + 1);
+            }
+        }
+
+        RegexList *temp = clist;
+        clist = nlist;
+        nlist = temp;
+    }
+
+    return matched;
+}
+
+bool regex_search_forward(Regex *regex, const char *data, size_t size, size_t *position, RegexMatch *match)
+{
+    if (!regex_matches(regex, data, size, *position)) {
+        return false;
+    }
+
+    if (!regex_run(regex, data, size, *position, size, false, match)) {
+        return false;
+    }
+
+    *position = match->groups[0];
+    return true;
+}
+
+bool regex_search_backward(Regex *regex, const char *data, size_t size, size_t *position, RegexMatch *match)
+{
+    if (!regex_matches(regex, data, size, 0)) {
+        return false;
+    }
+
+    if (!regex_run(regex, data, size, 0, *position < size ? *position : size, true, match)) {
+        return false;
+    }
+
+    *position = match->groups[0];
+    return true;
+}
+
+#endif // REGEX_H
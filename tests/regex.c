@@ -0,0 +1,268 @@
+#define main meno_main
+#include "../src/main.c"
+#undef main
+
+// Searches, captures and replacements are checked against what they are
+// expected to give. With --timing, patterns that take a backtracking engine
+// exponential or quadratic time are also run over inputs of growing size.
+// Each run has to take about as long per byte as the smallest one, so that
+// the time stays linear in the input. Timing depends on the machine, so it
+// is left out of the build.
+
+#define U REGEX_UNSET
+
+typedef struct {
+    const char *pattern;
+    const char *input;
+    bool icase;
+    bool backward;
+    size_t position;
+    bool found;
+    size_t groups[6];
+} SearchCase;
+
+static const SearchCase searches[] = {
+    {"abc", "xxabcxx", false, false, 0, true, {2, 5, U, U, U, U}},
+    {"abc", "xxabcxx", false, false, 3, false, {0}},
+    {"ABC", "xxabcxx", true, false, 0, true, {2, 5, U, U, U, U}},
+    {"ABC", "xxabcxx", false, false, 0, false, {0}},
+
+    // Captures
+    {"(\\w+)=(\\d+)", "  foo=69", false, false, 0, true, {2, 8, 2, 5, 6, 8}},
+    {"a(b)?c", "ac", false, false, 0, true, {0, 2, U, U, U, U}},
+    {"(a|b)*c", "abac", false, false, 0, true, {0, 4, 2, 3, U, U}},
+    {"(?:ab)+(c)", "ababc", false, false, 0, true, {0, 5, 4, 5, U, U}},
+    {"cat|category", "category", false, false, 0, true, {0, 3, U, U, U, U}},
+
+    // Greedy and lazy quantifiers
+    {"a.*b", "aXbYb", false, false, 0, true, {0, 5, U, U, U, U}},
+    {"a.*?b", "aXbYb", false, false, 0, true, {0, 3, U, U, U, U}},
+    {"a+?", "aaa", false, false, 0, true, {0, 1, U, U, U, U}},
+    {"a??b", "ab", false, false, 0, true, {0, 2, U, U, U, U}},
+    {"(a+?)(a*)", "aaa", false, false, 0, true, {0, 3, 0, 1, 1, 3}},
+
+    // Anchors and classes
+    {"^b", "ab", false, false, 0, false, {0}},
+    {"^a", "ab", false, false, 0, true, {0, 1, U, U, U, U}},
+    {"a$", "ab", false, false, 0, false, {0}},
+    {"b$", "ab", false, false, 0, true, {1, 2, U, U, U, U}},
+    {"^$", "", false, false, 0, true, {0, 0, U, U, U, U}},
+    {"[^a-z]+", "abC1d", false, false, 0, true, {2, 4, U, U, U, U}},
+    {"\\d\\s\\w", "x1 y", false, false, 0, true, {1, 4, U, U, U, U}},
+    {"a\\.b", "axb a.b", false, false, 0, true, {4, 7, U, U, U, U}},
+
+    // Backward, the last match starting at or before the position
+    {"ab", "ab ab ab", false, true, 8, true, {6, 8, U, U, U, U}},
+    {"ab", "ab ab ab", false, true, 5, true, {3, 5, U, U, U, U}},
+    {"ab", "ab ab ab", false, true, 2, true, {0, 2, U, U, U, U}},
+    {"(\\d+)", "x12 y345", false, true, 8, true, {7, 8, 7, 8, U, U}},
+    {"^ab", "ab ab", false, true, 5, true, {0, 2, U, U, U, U}},
+    {"c", "ab ab", false, true, 5, false, {0}},
+};
+
+static const char *invalid[] = {
+    "(ab",
+    "ab)",
+    "[abc",
+    "*a",
+    "a|*",
+};
+
+typedef struct {
+    const char *pattern;
+    const char *input;
+    const char *with;
+    const char *result;
+} ReplaceCase;
+
+static const ReplaceCase replaces[] = {
+    {"(\\w+)=(\\d+)", "a=1, bb=22", "\\2:\\1", "1:a, 22:bb"},
+    {"b+", "abbbc abc", "\\0\\0", "abbbbbbc abbc"},
+    {"b+", "abbbc abc", "", "ac ac"},
+    {"(x)?b", "ab", "[\\1]", "a[]"},
+    {"b", "abc", "\\\\\\n", "a\\nc"},
+    {"x*", "ab", "-", "-a-b-"},
+};
+
+static bool check_search(const SearchCase *test)
+{
+    Regex regex = {0};
+    bool ok = regex_compile(&regex, test->pattern, strlen(test->pattern), test->icase);
+    RegexMatch match;
+    size_t position = test->position;
+    const size_t size = strlen(test->input);
+    const bool found = ok && (test->backward ? regex_search_backward(&regex, test->input, size, &position, &match)
+                                             : regex_search_forward(&regex, test->input, size, &position, &match));
+
+    ok = ok && found == test->found;
+    for (size_t i = 0; ok && found && i < 6; ++i) {
+        ok = match.groups[i] == test->groups[i];
+    }
+    ok = ok && (!found || position == match.groups[0]);
+
+    if (!ok) {
+        printf("FAIL /%s/ %s \"%s\" at %zu:", test->pattern, test->backward ? "backward in" : "in", test->input,
+               test->position);
+        for (size_t i = 0; found && i < 6; i += 2) {
+            printf(" %zd,%zd", (ssize_t) match.groups[i], (ssize_t) match.groups[i + 1]);
+        }
+        printf("%s%s%s\n", found ? "" : " no match", regex.error ? ": " : "", regex.error ? regex.error : "");
+    }
+    regex_free(&regex);
+    return ok;
+}
+
+static bool check_invalid(const char *pattern)
+{
+    Regex regex = {0};
+    const bool ok = !regex_compile(&regex, pattern, strlen(pattern), false) && regex.error;
+    if (!ok) {
+        printf("FAIL /%s/ compiled\n", pattern);
+    }
+    regex_free(&regex);
+    return ok;
+}
+
+static bool check_replace(const ReplaceCase *test)
+{
+    Pattern pattern = {0};
+    const char *source = test->pattern;
+    bool ok = pattern_compile(&pattern, (String) {.data = (char *) source, .size = strlen(source)}, true);
+
+    String line = string(test->input, strlen(test->input));
+    String expanded = {0};
+    const String with = {.data = (char *) test->with, .size = strlen(test->with)};
+    if (ok) {
+        string_replace_all(&line, &pattern, 0, with, &expanded, NULL);
+    }
+
+    ok = ok && line.size == strlen(test->result) && !memcmp(line.data, test->result, line.size);
+    if (!ok) {
+        printf("FAIL /%s/ \"%s\" -> \"%s\": \"%.*s\"\n", test->pattern, test->input, test->with, (int) line.size,
+               line.data);
+    }
+    string_free(&line);
+    string_free(&expanded);
+    pattern_free(&pattern);
+    return ok;
+}
+
+#define SIZE (1 << 20)
+#define SCALE 8
+#define SLACK 3.0
+#define RUNS 5
+
+typedef struct {
+    const char *name;
+    char *pattern;
+    char *input;
+    bool found;
+} TimingCase;
+
+// The best of RUNS searches of the first SIZE bytes of the input, in
+// nanoseconds per byte
+static double measure(Regex *regex, const TimingCase *test, size_t size, bool *found)
+{
+    double best = 0;
+    for (int run = 0; run < RUNS; ++run) {
+        RegexMatch match;
+        size_t position = 0;
+        const uint64_t start = clock_ns();
+        *found = regex_search_forward(regex, test->input, size, &position, &match) &&
+                 regex_matches(regex, test->input, size, 0);
+        const double elapsed = (double) (clock_ns() - start) / size;
+        best = run == 0 || elapsed < best ? elapsed : best;
+    }
+    return best;
+}
+
+static bool check_timing(const TimingCase *test)
+{
+    Regex regex = {0};
+    if (!regex_compile(&regex, test->pattern, strlen(test->pattern), false)) {
+        printf("FAIL %s: %s\n", test->name, regex.error);
+        regex_free(&regex);
+        return false;
+    }
+
+    bool ok = true, found;
+    const double base = measure(&regex, test, SIZE / SCALE, &found);
+    for (size_t size = SIZE / SCALE * 2; ok && size <= SIZE; size *= 2) {
+        const double per_byte = measure(&regex, test, size, &found);
+        if (found != test->found) {
+            printf("FAIL %s: %s a match in %zu bytes\n", test->name, found ? "found" : "did not find", size);
+            ok = false;
+        } else if (per_byte > base * SLACK && per_byte > 1.0) {
+            printf("FAIL %s: %.2fns per byte over %zu bytes, %.2fns over %d\n", test->name, per_byte, size, base,
+                   SIZE / SCALE);
+            ok = false;
+        }
+    }
+    if (ok) {
+        printf("ok   %s\n", test->name);
+    }
+    regex_free(&regex);
+    return ok;
+}
+
+static bool check_timings(void)
+{
+    enum { N = 25 };
+
+    // a?^n a^n, matching a run of n a's only after trying every way of
+    // leaving the optional ones out
+    char nested[3 * N + 1];
+    for (int i = 0; i < N; ++i) {
+        memcpy(nested + 2 * i, "a?", 2);
+        nested[2 * N + i] = 'a';
+    }
+    nested[3 * N] = '\0';
+
+    // Only a's, and runs of 15 a's each ended by a b
+    char *as = malloc(SIZE);
+    char *runs = malloc(SIZE);
+    assert(as && runs);
+    memset(as, 'a', SIZE);
+    memset(runs, 'a', SIZE);
+    for (size_t i = 15; i < SIZE; i += 16) {
+        runs[i] = 'b';
+    }
+
+    const TimingCase tests[] = {
+        {"a?^n a^n", nested, as, true},
+        {"a?^n a^n over short runs", nested, runs, false},
+        {"(a+)+$", "(a+)+$", as, true},
+        {"(a+)+$ over runs ended by b", "(a+)+$", runs, false},
+        {"(a|aa)*c", "(a|aa)*c", as, false},
+    };
+
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+        ok = check_timing(tests + i) && ok;
+    }
+
+    free(as);
+    free(runs);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    bool ok = true;
+    size_t count = 0;
+    for (size_t i = 0; i < sizeof(searches) / sizeof(searches[0]); ++i, ++count) {
+        ok = check_search(searches + i) && ok;
+    }
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i, ++count) {
+        ok = check_invalid(invalid[i]) && ok;
+    }
+    for (size_t i = 0; i < sizeof(replaces) / sizeof(replaces[0]); ++i, ++count) {
+        ok = check_replace(replaces + i) && ok;
+    }
+    printf("%s %zu searches, compiles and replacements\n", ok ? "ok  " : "FAIL", count);
+
+    if (argc > 1 && !strcmp(argv[1], "--timing")) {
+        ok = check_timings() && ok;
+    }
+    return ok ? 0 : 1;
+}